@@ -124,13 +124,19 @@ ImageIO::errorType ImageIO::loadPPM(const char * filename)
     return INVALID_FILE_FORMAT;
   }
 
-  // read image width and height
-  int i = 0;
+  // read image width and height, which may follow the magic number on the same line (as savePPM writes them)
   int maxval;
+  int i = sscanf(buf + 2, "%d %d %d", &width, &height, &maxval);
+  if(i < 0)
+    i = 0;
   while(i < 3)
   {
-    char * dummy = fgets(buf, 4096, file);
-    dummy = dummy + 1; // to suppress compiler warning
+    if(fgets(buf, 4096, file) == NULL)
+    {
+      printf("Error in loadPPM: Incomplete header in %s.\n", filename);
+      fclose(file);
+      return INVALID_FILE_FORMAT;
+    }
     if(buf[0] == '#') // ignore comments
       continue;
     if(i == 0)
@@ -1034,3 +1040,243 @@ void ImageIO::flipVertically()
   free(rowBuffer);
 }
 
+
+#ifdef ENABLE_JPEG
+struct ImageStreamJPEG
+{
+  struct jpeg_compress_struct jpgPicture;
+  struct jpeg_error_mgr jpgErrorMessage;
+};
+#endif
+
+#ifdef ENABLE_PNG
+struct ImageStreamPNG
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+};
+#endif
+
+ImageStreamWriter::ImageStreamWriter()
+{
+  fileFormat = ImageIO::FORMAT_NONE;
+  width = 0;
+  height = 0;
+  rowsWritten = 0;
+  file = NULL;
+  encoder = NULL;
+}
+
+ImageStreamWriter::~ImageStreamWriter()
+{
+  release();
+}
+
+void ImageStreamWriter::release()
+{
+#ifdef ENABLE_JPEG
+  if ((fileFormat == ImageIO::FORMAT_JPEG) && encoder)
+  {
+    ImageStreamJPEG * jpeg = (ImageStreamJPEG*) encoder;
+    jpeg_destroy_compress(&jpeg->jpgPicture);
+    delete jpeg;
+  }
+#endif
+
+#ifdef ENABLE_PNG
+  if ((fileFormat == ImageIO::FORMAT_PNG) && encoder)
+  {
+    ImageStreamPNG * png = (ImageStreamPNG*) encoder;
+    png_destroy_write_struct(&png->png_ptr, &png->info_ptr);
+    delete png;
+  }
+#endif
+
+  encoder = NULL;
+  if (file)
+    fclose((FILE*) file);
+  file = NULL;
+}
+
+ImageIO::errorType ImageStreamWriter::open(const char * filename, ImageIO::fileFormatType fileFormat_, unsigned int width_, unsigned int height_, int jpegQuality)
+{
+  release();
+  fileFormat = fileFormat_;
+  width = width_;
+  height = height_;
+  rowsWritten = 0;
+
+  if ((fileFormat != ImageIO::FORMAT_PPM) && (fileFormat != ImageIO::FORMAT_JPEG) && (fileFormat != ImageIO::FORMAT_PNG))
+  {
+    printf("Error in ImageStreamWriter: Only PPM, JPEG and PNG images can be streamed.\n");
+    return ImageIO::INVALID_FILE_FORMAT;
+  }
+
+#ifndef ENABLE_JPEG
+  if (fileFormat == ImageIO::FORMAT_JPEG)
+    return ImageIO::INVALID_FILE_FORMAT;
+#endif
+
+#ifndef ENABLE_PNG
+  if (fileFormat == ImageIO::FORMAT_PNG)
+    return ImageIO::INVALID_FILE_FORMAT;
+#endif
+
+  FILE * output = fopen(filename, "wb");
+  if (!output)
+    return ImageIO::IO_ERROR;
+  file = output;
+
+  if (fileFormat == ImageIO::FORMAT_PPM)
+  {
+    fprintf(output, "P6 %d %d 255\n", width, height);
+    return ImageIO::OK;
+  }
+
+#ifdef ENABLE_JPEG
+  if (fileFormat == ImageIO::FORMAT_JPEG)
+  {
+    // same settings as saveJPEGWithGivenQuality, so both write the same file
+    ImageStreamJPEG * jpeg = new ImageStreamJPEG;
+    jpeg->jpgPicture.err = jpeg_std_error(&jpeg->jpgErrorMessage);
+    jpeg_create_compress(&jpeg->jpgPicture);
+    jpeg_stdio_dest(&jpeg->jpgPicture, output);
+    encoder = jpeg;
+
+    jpeg->jpgPicture.image_width = width;
+    jpeg->jpgPicture.image_height = height;
+    jpeg->jpgPicture.input_components = 3;
+    jpeg->jpgPicture.in_color_space = JCS_RGB;
+
+    jpeg_set_defaults(&jpeg->jpgPicture);
+    jpeg_set_quality(&jpeg->jpgPicture, jpegQuality, TRUE);
+    jpeg_start_compress(&jpeg->jpgPicture, TRUE);
+    return ImageIO::OK;
+  }
+#endif
+
+#ifdef ENABLE_PNG
+  if (fileFormat == ImageIO::FORMAT_PNG)
+  {
+    ImageStreamPNG * png = new ImageStreamPNG;
+    png->info_ptr = NULL;
+    png->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png->png_ptr)
+      png->info_ptr = png_create_info_struct(png->png_ptr);
+    encoder = png;
+
+    if (!png->png_ptr || !png->info_ptr)
+    {
+      printf("Error in ImageStreamWriter: Creating the png structures failed.\n");
+      release();
+      return ImageIO::IO_ERROR;
+    }
+
+    if (setjmp(png_jmpbuf(png->png_ptr)))
+    {
+      printf("Error in ImageStreamWriter: cannot write the png header.\n");
+      release();
+      return ImageIO::IO_ERROR;
+    }
+
+    png_init_io(png->png_ptr, output);
+    png_set_IHDR(png->png_ptr, png->info_ptr, (png_uint_32)width, (png_uint_32)height,
+      BITS_PER_CHANNEL_8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+      PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    png_write_info(png->png_ptr, png->info_ptr);
+    return ImageIO::OK;
+  }
+#endif
+
+  return ImageIO::INVALID_FILE_FORMAT;
+}
+
+ImageIO::errorType ImageStreamWriter::writeRows(const unsigned char * rows, unsigned int numRows)
+{
+  if (!file || (rowsWritten + numRows > height))
+    return ImageIO::OTHER_ERROR;
+
+  unsigned int numBytesPerRow = width * 3;
+  if (fileFormat == ImageIO::FORMAT_PPM)
+  {
+    if (fwrite(rows, sizeof(unsigned char), numBytesPerRow * numRows, (FILE*) file) != numBytesPerRow * numRows)
+    {
+      printf("Error in ImageStreamWriter: Error while writing ppm rows.\n");
+      return ImageIO::IO_ERROR;
+    }
+  }
+
+#ifdef ENABLE_JPEG
+  if (fileFormat == ImageIO::FORMAT_JPEG)
+  {
+    ImageStreamJPEG * jpeg = (ImageStreamJPEG*) encoder;
+    for(unsigned int row = 0; row < numRows; row++)
+    {
+      JSAMPROW rowPtr[1];
+      rowPtr[0] = (JSAMPROW) &rows[row * numBytesPerRow];
+      if (jpeg_write_scanlines(&jpeg->jpgPicture, rowPtr, 1) != 1)
+      {
+        printf("Error in ImageStreamWriter: Error while writing jpg rows.\n");
+        return ImageIO::IO_ERROR;
+      }
+    }
+  }
+#endif
+
+#ifdef ENABLE_PNG
+  if (fileFormat == ImageIO::FORMAT_PNG)
+  {
+    ImageStreamPNG * png = (ImageStreamPNG*) encoder;
+    if (setjmp(png_jmpbuf(png->png_ptr)))
+    {
+      printf("Error in ImageStreamWriter: Error while writing png rows.\n");
+      return ImageIO::IO_ERROR;
+    }
+
+    for(unsigned int row = 0; row < numRows; row++)
+      png_write_row(png->png_ptr, (png_bytep) &rows[row * numBytesPerRow]);
+  }
+#endif
+
+  rowsWritten += numRows;
+  return ImageIO::OK;
+}
+
+ImageIO::errorType ImageStreamWriter::close()
+{
+  if (!file)
+    return ImageIO::OTHER_ERROR;
+
+  if (rowsWritten != height)
+  {
+    printf("Error in ImageStreamWriter: Only %d of %d rows were written.\n", rowsWritten, height);
+    release();
+    return ImageIO::OTHER_ERROR;
+  }
+
+#ifdef ENABLE_JPEG
+  if (fileFormat == ImageIO::FORMAT_JPEG)
+    jpeg_finish_compress(&((ImageStreamJPEG*) encoder)->jpgPicture);
+#endif
+
+#ifdef ENABLE_PNG
+  if (fileFormat == ImageIO::FORMAT_PNG)
+  {
+    ImageStreamPNG * png = (ImageStreamPNG*) encoder;
+    if (setjmp(png_jmpbuf(png->png_ptr)))
+    {
+      printf("Error in ImageStreamWriter: unknown error occurred during end of file.\n");
+      release();
+      return ImageIO::IO_ERROR;
+    }
+    png_write_end(png->png_ptr, NULL);
+  }
+#endif
+
+  ImageIO::errorType errorCode = (ferror((FILE*) file) == 0) ? ImageIO::OK : ImageIO::IO_ERROR;
+  if ((fclose((FILE*) file) != 0))
+    errorCode = ImageIO::IO_ERROR;
+  file = NULL;
+  release();
+  return errorCode;
+}
@@ -103,5 +103,35 @@ protected:
   errorType saveNONE(const char * filename);
 };
 
+// Writes an image a band of rows at a time, so that the whole image never has to be in memory.
+// Rows are RGB (3 bytes per pixel) and are passed in file order, top row first.
+// Supports PPM, JPEG and PNG (JPEG and PNG must be enabled in imageFormats.h).
+class ImageStreamWriter
+{
+public:
+
+  ImageStreamWriter();
+  ~ImageStreamWriter(); // an image that was not closed is left incomplete
+
+  ImageIO::errorType open(const char * filename, ImageIO::fileFormatType fileFormat, unsigned int width, unsigned int height, int jpegQuality = 95);
+
+  // rows: numRows * width * 3 bytes
+  ImageIO::errorType writeRows(const unsigned char * rows, unsigned int numRows);
+
+  // finishes the file; all height rows must have been written
+  ImageIO::errorType close();
+
+  inline unsigned int getRowsWritten() { return rowsWritten; }
+
+protected:
+  ImageIO::fileFormatType fileFormat;
+  unsigned int width, height;
+  unsigned int rowsWritten;
+  void * file;
+  void * encoder; // format-specific encoder state
+
+  void release();
+};
+
 #endif
 
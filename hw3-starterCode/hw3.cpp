@@ -9,33 +9,112 @@
 	#include <windows.h>
 #endif
 
-#if defined(WIN32) || defined(linux)
-	#include <GL/gl.h>
-	#include <GL/glut.h>
-#elif defined(__APPLE__)
-	#include <OpenGL/gl.h>
-	#include <GLUT/glut.h>
+// Headless builds (make headless) render straight to a file and never link against OpenGL or GLUT
+#ifndef HW3_HEADLESS
+	#if defined(WIN32) || defined(linux)
+		#include <GL/gl.h>
+		#include <GL/glut.h>
+	#elif defined(__APPLE__)
+		#include <OpenGL/gl.h>
+		#include <GLUT/glut.h>
+	#endif
 #endif
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifdef WIN32
 	#define strcasecmp _stricmp
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <signal.h>
+	#include <netdb.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <sys/wait.h>
+	#include "hw3_protocol.h"
 #endif
 
 #include <imageIO.h>
+#include <imageFormats.h>
 #include <cmath>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// The SIMD kernels (ray packets and light batches) are compiled for AVX2 on x86 and picked at startup when the CPU has it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define HW3_HAS_AVX2_KERNEL
+	#include <immintrin.h>
+	#define HW3_TARGET_AVX2 __attribute__ ((target ("avx2")))
+#endif
+
+// Scalar type of the geometry core: positions, directions, ray parameters and colors. Builds use double unless compiled
+// with HW3_FLOAT (make float), which renders the same scenes in single precision at half the memory.
+#ifdef HW3_FLOAT
+	typedef float Real;
+#else
+	typedef double Real;
+#endif
+
+// The SIMD kernels work on four Reals at a time, to match the four-ray packets: four doubles in an AVX register, or four
+// floats in an SSE one. They are written against these names so the same code serves both precisions.
+#ifdef HW3_HAS_AVX2_KERNEL
+	#ifdef HW3_FLOAT
+		typedef __m128 Lanes;
+		#define LANES_ADD _mm_add_ps
+		#define LANES_SUB _mm_sub_ps
+		#define LANES_MUL _mm_mul_ps
+		#define LANES_DIV _mm_div_ps
+		#define LANES_SQRT _mm_sqrt_ps
+		#define LANES_AND _mm_and_ps
+		#define LANES_ANDNOT _mm_andnot_ps
+		#define LANES_OR _mm_or_ps
+		#define LANES_BLEND _mm_blendv_ps
+		#define LANES_CMP _mm_cmp_ps
+		#define LANES_SET1 _mm_set1_ps
+		#define LANES_SET _mm_set_ps
+		#define LANES_ZERO _mm_setzero_ps
+		#define LANES_LOAD _mm_loadu_ps
+		#define LANES_STORE _mm_storeu_ps
+		#define LANES_MASK _mm_movemask_ps
+	#else
+		typedef __m256d Lanes;
+		#define LANES_ADD _mm256_add_pd
+		#define LANES_SUB _mm256_sub_pd
+		#define LANES_MUL _mm256_mul_pd
+		#define LANES_DIV _mm256_div_pd
+		#define LANES_SQRT _mm256_sqrt_pd
+		#define LANES_AND _mm256_and_pd
+		#define LANES_ANDNOT _mm256_andnot_pd
+		#define LANES_OR _mm256_or_pd
+		#define LANES_BLEND _mm256_blendv_pd
+		#define LANES_CMP _mm256_cmp_pd
+		#define LANES_SET1 _mm256_set1_pd
+		#define LANES_SET _mm256_set_pd
+		#define LANES_ZERO _mm256_setzero_pd
+		#define LANES_LOAD _mm256_loadu_pd
+		#define LANES_STORE _mm256_storeu_pd
+		#define LANES_MASK _mm256_movemask_pd
+	#endif
+#endif
 
 /*************************************************************/
 // Definitions
 /*************************************************************/
-#define MAX_TRIANGLES 20000
-#define MAX_SPHERES 100
-#define MAX_LIGHTS 100
-
 char * filename = NULL;
 
 //different display modes
@@ -44,14 +123,13 @@ char * filename = NULL;
 
 int mode = MODE_DISPLAY;
 
-//you may want to make these smaller for debugging purposes
-#define WIDTH 640
-#define HEIGHT 480
+// The rendered image, gWidth x gHeight RGB pixels row by row. Allocated once the image size is known, unless the
+// image is streamed.
+std::vector<unsigned char> buffer;
 
-//the field of view of the camera
-#define fov 60.0
-
-unsigned char buffer[HEIGHT][WIDTH][3];
+// Where plot_pixel writes: rows from gTargetY0 up, gWidth pixels each. The whole buffer, or one streamed band.
+unsigned char* gTarget = NULL;
+unsigned int gTargetY0 = 0;
 
 /*************************************************************/
 // Constants
@@ -66,51 +144,269 @@ const double BIAS = 1e-16;
 bool gUseAA = false;
 const unsigned int SSAA_SAMPLES = 4;
 
+/*************************************************************/
+// Cost Counters
+/*************************************************************/
+// Builds with HW3_COST_COUNTERS (make COST_COUNTERS=1) count the work spent on every pixel, for the frame totals and
+// the --heatmap image. In every other build COUNT_COST expands to nothing, so the counters cost nothing at all.
+struct PixelCost {
+	unsigned int mPrimaryRays;
+	unsigned int mShadowRays;
+	unsigned int mIntersectionTests;
+	unsigned int mHits;
+	unsigned int mShadingEvaluations;
+};
+
+#ifdef HW3_COST_COUNTERS
+	// Work done on this thread since its last pixel was recorded
+	thread_local PixelCost tPixelCost;
+	#define COUNT_COST(counter, amount) (tPixelCost.counter += (amount))
+#else
+	#define COUNT_COST(counter, amount) ((void)0)
+#endif
+
+/*************************************************************/
+// Timeline Tracing
+/*************************************************************/
+// With --trace FILE, scoped timers record what every thread spends its time on, and the timeline is written on exit as
+// a Chrome trace_event JSON file (open it in chrome://tracing or Perfetto). Each thread records into a ring buffer of
+// its own, so recording never takes a lock; once a buffer is full its oldest events are overwritten. Without --trace,
+// a timer costs a test of gTraceEnabled.
+const unsigned int TRACE_BUFFER_EVENTS = 1 << 16;
+
+struct TraceEvent {
+	const char* mName;
+	const char* mArgName;	// NULL if the event has no argument
+	long long mArg;
+	long long mStart;		// Nanoseconds since gTraceStart
+	long long mDuration;
+};
+
+// Written only by its own thread. mWritten counts every event ever recorded, and is published after the event itself.
+struct TraceBuffer {
+	unsigned int mThread;
+	std::string mThreadName;
+	std::atomic<unsigned long long> mWritten;
+	std::vector<TraceEvent> mEvents;
+
+	TraceBuffer (unsigned int thread) : mThread (thread), mWritten (0), mEvents (TRACE_BUFFER_EVENTS) {}
+};
+
+bool gTraceEnabled = false;
+const char* gTraceFile = NULL;
+std::chrono::steady_clock::time_point gTraceStart = std::chrono::steady_clock::now ();
+
+// Every buffer ever handed out, and the ones whose threads have exited. Render workers are started afresh for every
+// pass, so a new thread takes over a free buffer, and the workers of successive passes share rows of the timeline.
+std::mutex gTraceBuffersMutex;
+std::vector<TraceBuffer*> gTraceBuffers;
+std::vector<TraceBuffer*> gFreeTraceBuffers;
+
+// Returns the thread's buffer to the free list when the thread exits
+struct TraceBufferOwner {
+	TraceBuffer* mBuffer;
+
+	TraceBufferOwner () : mBuffer (NULL) {}
+	~TraceBufferOwner () {
+		if (mBuffer != NULL) {
+			std::lock_guard<std::mutex> lock (gTraceBuffersMutex);
+			gFreeTraceBuffers.push_back (mBuffer);
+		}
+	}
+};
+
+thread_local TraceBufferOwner tTraceBuffer;
+
+TraceBuffer* getTraceBuffer () {
+
+	if (tTraceBuffer.mBuffer == NULL) {
+		std::lock_guard<std::mutex> lock (gTraceBuffersMutex);
+		if (!gFreeTraceBuffers.empty ()) {
+			tTraceBuffer.mBuffer = gFreeTraceBuffers.back ();
+			gFreeTraceBuffers.pop_back ();
+		}
+
+		else {
+			tTraceBuffer.mBuffer = new TraceBuffer ((unsigned int)gTraceBuffers.size ());
+			gTraceBuffers.push_back (tTraceBuffer.mBuffer);
+		}
+	}
+	return tTraceBuffer.mBuffer;
+}
+
+inline long long traceNow () {
+	return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now () - gTraceStart).count ();
+}
+
+// Label the calling thread's row of the timeline
+void setTraceThreadName (const std::string& name) {
+	if (gTraceEnabled) {
+		getTraceBuffer ()->mThreadName = name;
+	}
+}
+
+void recordTraceEvent (const char* name, const char* argName, long long arg, long long start, long long duration) {
+
+	TraceBuffer* buffer = getTraceBuffer ();
+	unsigned long long index = buffer->mWritten.load (std::memory_order_relaxed);
+	TraceEvent& event = buffer->mEvents[index % TRACE_BUFFER_EVENTS];
+	event.mName = name;
+	event.mArgName = argName;
+	event.mArg = arg;
+	event.mStart = start;
+	event.mDuration = duration;
+	buffer->mWritten.store (index + 1, std::memory_order_release);
+}
+
+// Times the enclosing scope. Names must be string literals; they are kept until the dump.
+class TraceScope {
+private:
+	const char* mName;
+	const char* mArgName;
+	long long mArg;
+	long long mStart;
+
+public:
+	TraceScope (const char* name, const char* argName = NULL, long long arg = 0) : mName (name), mArgName (argName), mArg (arg),
+		mStart (gTraceEnabled ? traceNow () : 0) {}
+
+	~TraceScope () {
+		if (gTraceEnabled) {
+			recordTraceEvent (mName, mArgName, mArg, mStart, traceNow () - mStart);
+		}
+	}
+};
+
+// Write every buffer to gTraceFile. Registered with atexit, so it also runs when the window is closed.
+void writeTrace () {
+
+	FILE* file = fopen (gTraceFile, "w");
+	if (file == NULL) {
+		printf ("Unable to write trace: %s\n", gTraceFile);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock (gTraceBuffersMutex);
+	unsigned long long events = 0;
+	unsigned long long dropped = 0;
+	fprintf (file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf (file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"hw3\"}}");
+	for (size_t i = 0; i < gTraceBuffers.size (); i++) {
+		const TraceBuffer& buffer = *gTraceBuffers[i];
+		if (!buffer.mThreadName.empty ()) {
+			fprintf (file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+				buffer.mThread, buffer.mThreadName.c_str ());
+		}
+
+		unsigned long long written = buffer.mWritten.load (std::memory_order_acquire);
+		unsigned long long first = (written > TRACE_BUFFER_EVENTS) ? written - TRACE_BUFFER_EVENTS : 0;
+		for (unsigned long long j = first; j < written; j++) {
+			const TraceEvent& event = buffer.mEvents[j % TRACE_BUFFER_EVENTS];
+			fprintf (file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f", event.mName,
+				buffer.mThread, event.mStart / 1000.0, event.mDuration / 1000.0);
+			if (event.mArgName != NULL) {
+				fprintf (file, ", \"args\": {\"%s\": %lld}", event.mArgName, event.mArg);
+			}
+			fprintf (file, "}");
+		}
+		events += written - first;
+		dropped += first;
+	}
+	fprintf (file, "\n]}\n");
+	fclose (file);
+
+	printf ("Wrote trace: %s (%llu events from %u threads, %llu overwritten)\n", gTraceFile, events,
+		(unsigned int)gTraceBuffers.size (), dropped);
+}
+
 /*************************************************************/
 // Object Structs
 /*************************************************************/
-struct Vertex
+// Every record below is a template over its scalar type; the renderer uses the Real instantiations at the end
+template <typename T>
+struct VertexT
+{
+	T position[3];
+	T color_diffuse[3];
+	T color_specular[3];
+	T normal[3];
+	T shininess;
+};
+
+template <typename T>
+struct TriangleT
+{
+	VertexT<T> v[3];
+};
+
+// Indexed mesh. Triangles are parsed as above, then stored as indices into vertex and material buffers that
+// are shared by every triangle using the same values.
+template <typename T>
+struct MeshVertexT
+{
+	T position[3];
+	T normal[3];
+};
+
+template <typename T>
+struct MaterialT
 {
-	double position[3];
-	double color_diffuse[3];
-	double color_specular[3];
-	double normal[3];
-	double shininess;
+	T color_diffuse[3];
+	T color_specular[3];
+	T shininess;
 };
 
-struct Triangle
+// Materials are given per vertex, so a triangle refers to the materials of its three corners. Nearly every triangle
+// has a single material, which makes these few and widely shared.
+struct TriangleMaterial
 {
-	Vertex v[3];
+	unsigned int v[3];
 };
 
-struct Sphere
+struct MeshTriangle
 {
-	double position[3];
-	double color_diffuse[3];
-	double color_specular[3];
-	double shininess;
-	double radius;
+	unsigned int v[3];
+	unsigned int material;
 };
 
-struct Light
+template <typename T>
+struct SphereT
 {
-	double position[3];
-	double color[3];
+	T position[3];
+	T color_diffuse[3];
+	T color_specular[3];
+	T shininess;
+	T radius;
 };
 
+template <typename T>
+struct LightT
+{
+	T position[3];
+	T color[3];
+};
+
+typedef VertexT<Real> Vertex;
+typedef TriangleT<Real> Triangle;
+typedef MeshVertexT<Real> MeshVertex;
+typedef MaterialT<Real> Material;
+typedef SphereT<Real> Sphere;
+typedef LightT<Real> Light;
+
 /*************************************************************/
 // Ray, Color, and Vector Structs and Classes
 /*************************************************************/
 // Color definition
-struct Color {
-	double mR;
-	double mG;
-	double mB;
+template <typename T>
+struct ColorT {
+	T mR;
+	T mG;
+	T mB;
 
-	Color () : mR(0), mG(0), mB(0) {}
-	Color (double r, double g, double b) : mR(r), mG(g), mB(b) {}
+	ColorT () : mR(0), mG(0), mB(0) {}
+	ColorT (T r, T g, T b) : mR(r), mG(g), mB(b) {}
 
-	Color& operator += (const Color& other) {
+	ColorT& operator += (const ColorT& other) {
 		// Clamp color addition operations to values between 0 and 1
 		mR += other.mR;
 		if (mR > 1.0f) {
@@ -144,30 +440,36 @@ struct Color {
 };
 
 // Vector3 definition and implementation.
-struct Vector3 {
-	double mX;
-	double mY;
-	double mZ;
+template <typename T>
+struct Vector3T {
+	T mX;
+	T mY;
+	T mZ;
 
-	Vector3 () : mX(0), mY(0), mZ(0) {}
-	Vector3 (double x, double y, double z) : mX(x), mY(y), mZ(z) {}
+	Vector3T () : mX(0), mY(0), mZ(0) {}
+	Vector3T (T x, T y, T z) : mX(x), mY(y), mZ(z) {}
 
 	// Static functions
-	static Vector3 cross (const Vector3& a, const Vector3& b);
+	static Vector3T cross (const Vector3T& a, const Vector3T& b);
+	static Vector3T min (const Vector3T& a, const Vector3T& b) { return Vector3T (std::min (a.mX, b.mX), std::min (a.mY, b.mY), std::min (a.mZ, b.mZ)); }
+	static Vector3T max (const Vector3T& a, const Vector3T& b) { return Vector3T (std::max (a.mX, b.mX), std::max (a.mY, b.mY), std::max (a.mZ, b.mZ)); }
 
 	// Member functions
-	inline double dot (const Vector3& other) const { return mX * other.mX + mY * other.mY + mZ * other.mZ; }
-	inline double distance () const { return std::pow(mX, 2) + std::pow(mY, 2) + std::pow(mZ, 2); }
-	inline double magnitude () const { return std::sqrt(distance()); }
-	Vector3& normalize();
+	inline T dot (const Vector3T& other) const { return mX * other.mX + mY * other.mY + mZ * other.mZ; }
+	inline T distance () const { return std::pow(mX, 2) + std::pow(mY, 2) + std::pow(mZ, 2); }
+	inline T magnitude () const { return std::sqrt(distance()); }
+	Vector3T& normalize();
+
+	// Component access by axis index (0 = x, 1 = y, 2 = z)
+	inline T operator[] (int axis) const { return (axis == 0) ? mX : ((axis == 1) ? mY : mZ); }
 
 	// Operators
-	Vector3 operator+ (const Vector3& other) const { return Vector3 (mX + other.mX, mY + other.mY, mZ + other.mZ); }
-	Vector3 operator- (const Vector3& other) const { return Vector3 (mX - other.mX, mY - other.mY, mZ - other.mZ); }
-	Vector3 operator- () const { return Vector3 (-mX, -mY, -mZ); }
-	Vector3 operator* (double scalar) const { return Vector3 (mX * scalar, mY * scalar, mZ * scalar); }
+	Vector3T operator+ (const Vector3T& other) const { return Vector3T (mX + other.mX, mY + other.mY, mZ + other.mZ); }
+	Vector3T operator- (const Vector3T& other) const { return Vector3T (mX - other.mX, mY - other.mY, mZ - other.mZ); }
+	Vector3T operator- () const { return Vector3T (-mX, -mY, -mZ); }
+	Vector3T operator* (T scalar) const { return Vector3T (mX * scalar, mY * scalar, mZ * scalar); }
 
-	Vector3& operator += (const Vector3& other) {
+	Vector3T& operator += (const Vector3T& other) {
 		mX += other.mX;
 		mY += other.mY;
 		mZ += other.mZ;
@@ -175,19 +477,21 @@ struct Vector3 {
 	}
 };
 
-Vector3 Vector3::cross(const Vector3& a, const Vector3& b) {
-	double x = a.mY * b.mZ - a.mZ * b.mY;
-	double y = a.mZ * b.mX - a.mX * b.mZ;
-	double z = a.mX * b.mY - a.mY * b.mX;
-	return Vector3 (x, y, z);
+template <typename T>
+Vector3T<T> Vector3T<T>::cross(const Vector3T& a, const Vector3T& b) {
+	T x = a.mY * b.mZ - a.mZ * b.mY;
+	T y = a.mZ * b.mX - a.mX * b.mZ;
+	T z = a.mX * b.mY - a.mY * b.mX;
+	return Vector3T (x, y, z);
 }
 
-Vector3& Vector3::normalize () {
+template <typename T>
+Vector3T<T>& Vector3T<T>::normalize () {
 
 	// We can't just get the magnitude because the distance could be 0. It's bad to divide by 0.
-	double normal = distance();
+	T normal = distance();
 	if (normal > 0) {
-		double inverse = 1.0f / std::sqrt(normal);
+		T inverse = 1.0f / std::sqrt(normal);
 		mX *= inverse;
 		mY *= inverse;
 		mZ *= inverse;
@@ -195,51 +499,106 @@ Vector3& Vector3::normalize () {
 	return *this;
 }
 
+typedef ColorT<Real> Color;
+typedef Vector3T<Real> Vector3;
+
+// Intersection-only copy of a triangle: the first vertex and the two edges leaving it, which is all the Moller-Trumbore
+// test needs. At 72 bytes it is a quarter of a Triangle, so the intersection loops don't drag the shading attributes
+// through the cache.
+template <typename T>
+struct TriangleRecordT {
+	Vector3T<T> mVertex;
+	Vector3T<T> mEdge1;
+	Vector3T<T> mEdge2;
+};
+
 // Ray definition and implementation
-class Ray {
+template <typename T>
+class RayT {
+public:
+	// What the ray works with, at its own precision
+	typedef Vector3T<T> Vector3;
+	typedef SphereT<T> Sphere;
+	typedef TriangleT<T> Triangle;
+	typedef TriangleRecordT<T> TriangleRecord;
+
 private:
 	Vector3 mOrigin;
 	Vector3 mDirection;
 
 public:
-	Ray () {}
-	Ray (const Vector3& origin, const Vector3& direction) : mOrigin (origin), mDirection (direction) {}
+	RayT () {}
+	RayT (const Vector3& origin, const Vector3& direction) : mOrigin (origin), mDirection (direction) {}
+
+	// Accessors
+	inline const Vector3& getOrigin () const { return mOrigin; }
+	inline const Vector3& getDirection () const { return mDirection; }
 
 	// Member functions
 	bool intersects (const Sphere& sphere, Vector3& intersection);
 	bool intersects (const Triangle& triangle, Vector3& intersection);
+
+	// Variants that report the ray parameter t of the intersection instead of the point
+	bool intersects (const Sphere& sphere, T& t) const;
+	bool intersects (const Triangle& triangle, T& t) const;
+
+	bool intersects (const TriangleRecord& triangle, T& t) const;
+
+	// Occlusion queries--only report whether the object blocks the ray somewhere in [0, maxDistance)
+	bool occludedBy (const Sphere& sphere, T maxDistance) const;
+	bool occludedBy (const Triangle& triangle, T maxDistance) const;
+	bool occludedBy (const TriangleRecord& triangle, T maxDistance) const;
+
+private:
+	bool intersectsTriangle (const Triangle& triangle, T maxDistance, T& t) const;
+	bool intersectsTriangle (const TriangleRecord& triangle, T maxDistance, T& t) const;
 };
 
 // Implementations--sphere intersections
-bool Ray::intersects (const Sphere& sphere, Vector3& intersection) {
+template <typename T>
+bool RayT<T>::intersects (const Sphere& sphere, Vector3& intersection) {
+
+	T t;
+	if (!intersects (sphere, t)) {
+		return false;
+	}
+
+	intersection = mOrigin + (mDirection * t);
+	return true;
+}
+
+template <typename T>
+bool RayT<T>::intersects (const Sphere& sphere, T& t) const {
+
+	COUNT_COST (mIntersectionTests, 1);
 
 	// Get the center of the sphere and the distance vector between the shape and the origin
 	Vector3 position = Vector3(sphere.position[0], sphere.position[1], sphere.position[2]);
 	Vector3 dist = mOrigin - position;
 
 	// Create values that correspond to the results of the quadratic equation. There are two.
-	double t0 = MAX_DIST;
-	double t1 = MAX_DIST;
+	T t0 = MAX_DIST;
+	T t1 = MAX_DIST;
 
 	// Calculate the quadratic equations for the top and bottom of the sphere
-	double a = mDirection.dot(mDirection);
-	double b = 2 * mDirection.dot (dist);
-	double c = dist.dot (dist) - std::pow (sphere.radius, 2);
-	double quad = std::pow(b, 2) - (4 * a * c);
+	T a = mDirection.dot(mDirection);
+	T b = 2 * mDirection.dot (dist);
+	T c = dist.dot (dist) - std::pow (sphere.radius, 2);
+	T quad = std::pow(b, 2) - (4 * a * c);
 	if (quad < 0) {
 		return false;
 	}
 
 	// If the discriminant is nearly equal (or equal) to 0, t0 = t1 = -1/2 * b / a;
 	else if (std::abs(quad) < BIAS) {
-		double q = -0.5f * b / a;
+		T q = -0.5f * b / a;
 		t0 = q;
 		t1 = q;
 	}
 
 	// If the discriminant is greater than 0, then determine the correct half of the sphere to intersect with
 	else {
-		double q = (b > 0) ? -0.5f * (b + std::sqrt(quad)) : -0.5f * (b - std::sqrt(quad));
+		T q = (b > 0) ? -0.5f * (b + std::sqrt(quad)) : -0.5f * (b - std::sqrt(quad));
 		t0 = q / a;
 		t1 = c / q; 
 	}
@@ -249,17 +608,104 @@ bool Ray::intersects (const Sphere& sphere, Vector3& intersection) {
 		return false;
 	}
 
-	// To make further calculations a little simpler, store the lower value in t0.
-	if (t0 > t1 && t1 > 0) {
+	// To make further calculations a little simpler, store the lower value in t0. If the origin is inside the sphere,
+	// t0 is behind the ray, so the exit point t1 is the one we want.
+	if (t0 < 0 || (t1 >= 0 && t1 < t0)) {
 		t0 = t1;
 	}
 
-	intersection = mOrigin + (mDirection * t0);
+	t = t0;
+	COUNT_COST (mHits, 1);
 	return true;
 }
 
 // Implementations--triangle intersections
-bool Ray::intersects (const Triangle& triangle, Vector3& intersection) {
+template <typename T>
+bool RayT<T>::intersects (const Triangle& triangle, Vector3& intersection) {
+
+	T t;
+	if (!intersects (triangle, t)) {
+		return false;
+	}
+
+	intersection = mOrigin + (mDirection * t);
+	return true;
+}
+
+template <typename T>
+bool RayT<T>::intersects (const Triangle& triangle, T& t) const {
+	return intersectsTriangle (triangle, HUGE_VAL, t);
+}
+
+template <typename T>
+bool RayT<T>::occludedBy (const Sphere& sphere, T maxDistance) const {
+
+	// If the origin is outside the sphere and the ray points away from it, both roots are behind the origin
+	Vector3 dist = mOrigin - Vector3 (sphere.position[0], sphere.position[1], sphere.position[2]);
+	if (mDirection.dot (dist) > 0 && dist.dot (dist) > sphere.radius * sphere.radius) {
+		return false;
+	}
+
+	T t;
+	return intersects (sphere, t) && t < maxDistance;
+}
+
+template <typename T>
+bool RayT<T>::occludedBy (const Triangle& triangle, T maxDistance) const {
+	T t;
+	return intersectsTriangle (triangle, maxDistance, t);
+}
+
+template <typename T>
+bool RayT<T>::intersects (const TriangleRecord& triangle, T& t) const {
+	return intersectsTriangle (triangle, HUGE_VAL, t);
+}
+
+template <typename T>
+bool RayT<T>::occludedBy (const TriangleRecord& triangle, T maxDistance) const {
+	T t;
+	return intersectsTriangle (triangle, maxDistance, t);
+}
+
+// Moller-Trumbore intersection against the precomputed edges. Solves for t and the barycentric coordinates (u, v) directly,
+// so there is no normal to normalize and no intersection point to build.
+template <typename T>
+bool RayT<T>::intersectsTriangle (const TriangleRecord& triangle, T maxDistance, T& t) const {
+
+	COUNT_COST (mIntersectionTests, 1);
+
+	// Check to see if the ray and the plane are parallel (or very close to parallel)
+	Vector3 p = Vector3::cross (mDirection, triangle.mEdge2);
+	T determinant = triangle.mEdge1.dot (p);
+	if (std::abs (determinant) < BIAS) {
+		return false;
+	}
+	T inverse = 1.0 / determinant;
+
+	// Reject the ray as soon as either barycentric coordinate falls outside the triangle
+	Vector3 distance = mOrigin - triangle.mVertex;
+	T u = distance.dot (p) * inverse;
+	if (u < 0 || u > 1) {
+		return false;
+	}
+
+	Vector3 q = Vector3::cross (distance, triangle.mEdge1);
+	T v = mDirection.dot (q) * inverse;
+	if (v < 0 || u + v > 1) {
+		return false;
+	}
+
+	// The hit has to be in front of the ray and before maxDistance
+	t = triangle.mEdge2.dot (q) * inverse;
+	bool hit = t >= 0 && t < maxDistance;
+	COUNT_COST (mHits, hit);
+	return hit;
+}
+
+template <typename T>
+bool RayT<T>::intersectsTriangle (const Triangle& triangle, T maxDistance, T& t) const {
+
+	COUNT_COST (mIntersectionTests, 1);
 
 	// Get the coordinates of the triangle's points
 	Vector3 vertexA = Vector3(triangle.v[0].position[0], triangle.v[0].position[1], triangle.v[0].position[2]);
@@ -271,23 +717,24 @@ bool Ray::intersects (const Triangle& triangle, Vector3& intersection) {
 	normal.normalize ();
 
 	// Check to see if the ray and the plane are parallel (or very close to parallel)
-	double dir = normal.dot(mDirection);
+	T dir = normal.dot(mDirection);
 	if (std::abs(dir) < BIAS) {
 		return false;
 	}
 
 	// Compute d parameter
 	Vector3 dist = vertexA - mOrigin;
-	double d = dist.dot(normal);
+	T d = dist.dot(normal);
 
-	// If the t value is negative, no intersection was found (behind the ray)!
-	double t = d / dir;
-	if (t < 0) {
+	// If the t value is negative, no intersection was found (behind the ray)! Anything past maxDistance is of no interest either,
+	// so reject it before the in/out test.
+	t = d / dir;
+	if (t < 0 || t >= maxDistance) {
 		return false;
 	}
 
-	// Update the intersection point
-	intersection = mOrigin + (mDirection * t);
+	// Compute the intersection point
+	Vector3 intersection = mOrigin + (mDirection * t);
 
 	// Determine if the dot product of the normal and the vector between two points faces the camera--if any do not, do not draw the triangle
 	// This needs to be done for all edges, otherwise artifacts appear
@@ -298,695 +745,5141 @@ bool Ray::intersects (const Triangle& triangle, Vector3& intersection) {
 		return false;
 	}
 
+	COUNT_COST (mHits, 1);
 	return true;
 }
 
+typedef TriangleRecordT<Real> TriangleRecord;
+typedef RayT<Real> Ray;
+
 /*************************************************************/
-// Global Variables
+// Camera
 /*************************************************************/
-Triangle triangles[MAX_TRIANGLES];
-Sphere spheres[MAX_SPHERES];
-Light lights[MAX_LIGHTS];
-double ambient_light[3];
+// Pinhole camera. The mapping from a position on the image to a ray direction is worked out once, when the camera is
+// set up, so generating a ray costs a multiply-add per component and a normalize.
+class Camera {
+private:
+	Vector3 mEye;
+	Vector3 mCorner;	// Direction through the lower-left corner of the image
+	Vector3 mStepX;		// Change in direction per pixel to the right
+	Vector3 mStepY;		// Change in direction per pixel up
 
-int num_triangles = 0;
-int num_spheres = 0;
-int num_lights = 0;
+public:
+	Camera () { setup (Vector3 (), Vector3 (0, 0, -1), Vector3 (0, 1, 0), 60.0, 640, 480); }
 
-/*************************************************************/
-// Plotting Function Prototypes
-/*************************************************************/
-void plot_pixel_display(int x,int y,unsigned char r,unsigned char g,unsigned char b);
-void plot_pixel_jpeg(int x,int y,unsigned char r,unsigned char g,unsigned char b);
-void plot_pixel(int x,int y,unsigned char r,unsigned char g,unsigned char b);
+	// Place the camera. Returns false if the view direction is degenerate or parallel to up.
+	bool setup (const Vector3& eye, const Vector3& lookAt, const Vector3& up, double fov, unsigned int width, unsigned int height);
 
-/*************************************************************/
-// Lighting
-/*************************************************************/
-// Compute the magnitude of the light -- this is the same between spheres and triangles
-double computeLightMagnitude (const Vector3& lightDirection, const Vector3& normal) {
+	inline const Vector3& getEye () const { return mEye; }
 
-	// Compute the dot product of the light direction and the normal to get the lighting magnitude, then clamp it
-	double retVal = lightDirection.dot (normal);
-	if (retVal > 1.0f) {
-		retVal = 1.0f;
+	// Ray through a position on the image, in pixels from the lower-left corner
+	inline Ray generateRay (double x, double y) const {
+		Vector3 direction (mCorner.mX + x * mStepX.mX + y * mStepY.mX, mCorner.mY + x * mStepX.mY + y * mStepY.mY, mCorner.mZ + x * mStepX.mZ + y * mStepY.mZ);
+		return Ray (mEye, direction.normalize ());
 	}
+};
 
-	else if (retVal < 0.0f) {
-		retVal = 0.0f;
+bool Camera::setup (const Vector3& eye, const Vector3& lookAt, const Vector3& up, double fov, unsigned int width, unsigned int height) {
+
+	// Orthonormal basis: forward points at the target, right and upward span the image plane
+	Vector3 forward = lookAt - eye;
+	Vector3 right = Vector3::cross (forward, up);
+	if (forward.distance () == 0 || right.distance () == 0) {
+		return false;
 	}
+	forward.normalize ();
+	right.normalize ();
+	Vector3 upward = Vector3::cross (right, forward);
 
-	return retVal;
+	// The image plane sits one unit in front of the eye and spans [-1, 1] vertically before scaling by the field of view
+	double ratio = (double)width / (double)height;
+	double angle = std::tan ((fov / 2.0) * (PI / 180.0));
+	Vector3 halfWidth = right * (angle * ratio);
+	Vector3 halfHeight = upward * angle;
+
+	mEye = eye;
+	mCorner = forward - halfWidth - halfHeight;
+	mStepX = halfWidth * (2.0 / width);
+	mStepY = halfHeight * (2.0 / height);
+	return true;
 }
 
-// Compute the magnitude of the reflectiveness -- this is the same between spheres and triangles
-double computeReflectionMagnitude (double lightMagnitude, const Vector3& lightDirection, const Vector3& intersection, const Vector3& normal) {
+// Image size and camera. Set from the command line before the scene is rendered.
+unsigned int gWidth = 640;
+unsigned int gHeight = 480;
+Camera gCamera;
 
-	// Get normalized direction vector
-	Vector3 direction = -intersection;
-	direction.normalize ();
+// Largest image --size accepts: JPEG's limit on a side, and few enough pixels that the image library can still count
+// their bytes in 32 bits
+const unsigned int MAX_IMAGE_SIZE = 65500;
+const size_t MAX_IMAGE_PIXELS = (size_t)1 << 30;
 
-	// Find the reflection vector, then compute the dot product to get the reflection magnitude
-	Vector3 reflection (2 * lightMagnitude * normal.mX - lightDirection.mX, 2 * lightMagnitude * normal.mY - lightDirection.mY, 2 * lightMagnitude * normal.mZ - lightDirection.mZ);
-	reflection.normalize ();
-	double retVal = reflection.dot (direction);
-	if (retVal > 1.0f) { 
-		retVal = 1.0f;
-	}
+// Camera placement from the command line. The render server sets the camera up again for every image size it is asked
+// for, and distributed workers check theirs against the coordinator's.
+Vector3 gViewEye;
+Vector3 gViewLookAt (0, 0, -1);
+Vector3 gViewUp (0, 1, 0);
+double gViewFov = 60.0;
 
-	else if (retVal < 0.0f) {
-		retVal = 0.0f;
-	}
+/*************************************************************/
+// Scene Storage
+/*************************************************************/
+const size_t ARENA_MIN_BLOCK_SIZE = 4096;
 
-	return retVal;
-}
+// Bump allocator. Memory is handed out from large blocks and only given back all at once, by release.
+class Arena {
+private:
+	struct Block {
+		char* mData;
+		size_t mSize;
+		size_t mUsed;
+	};
 
-// Calculate the lighting (and color) of a point on the sphere
-Color calculateSphereLighting (const Sphere& sphere, const Light& light, const Vector3& intersection) {
+	std::vector<Block> mBlocks;
+	size_t mBytesReserved;
 
-	// Get normal
-	Vector3 normal = intersection - Vector3 (sphere.position[0], sphere.position[1], sphere.position[2]);
-	normal.normalize ();
+	Arena (const Arena&);
+	Arena& operator= (const Arena&);
 
-	// Get normalized light direction vector
-	Vector3 lightPosition (light.position[0], light.position[1], light.position[2]);
-	Vector3 lightDirection = lightPosition - intersection;
-	lightDirection.normalize ();
+public:
+	Arena () : mBytesReserved (0) {}
+	~Arena () { release (); }
 
-	// Compute and clamp the values of the magnitudes of LdotN (light magnitude) and (2 * l (n - dir)) * direction (the reflection magnitude)
-	double lightMagnitude = computeLightMagnitude (lightDirection, normal);
-	double reflectionMagnitude = computeReflectionMagnitude (lightMagnitude, lightDirection, intersection, normal);
+	void* allocate (size_t bytes, size_t alignment);
+	void release ();
 
-	// Get the base diffuse, specular, and shininess values from the sphere object
-	Color diffuse (sphere.color_diffuse[0], sphere.color_diffuse[1], sphere.color_diffuse[2]);
-	Color specular (sphere.color_specular[0], sphere.color_specular[1], sphere.color_specular[2]);
-	double shininess = sphere.shininess;
+	// Trade blocks with another arena, along with the arrays allocated from them
+	void swap (Arena& other) { mBlocks.swap (other.mBlocks); std::swap (mBytesReserved, other.mBytesReserved); }
 
-	// Compute intensity for each color using the Phong equation
-	double r = light.color[0] * (diffuse.mR * lightMagnitude + (specular.mR * std::pow (reflectionMagnitude, shininess)));
-	double g = light.color[1] * (diffuse.mG * lightMagnitude + (specular.mG * std::pow (reflectionMagnitude, shininess)));
-	double b = light.color[2] * (diffuse.mB * lightMagnitude + (specular.mB * std::pow (reflectionMagnitude, shininess)));
-	return Color (r, g, b);
+	inline size_t getBytesReserved () const { return mBytesReserved; }
+};
+
+void* Arena::allocate (size_t bytes, size_t alignment) {
+
+	if (!mBlocks.empty ()) {
+		Block& block = mBlocks.back ();
+		size_t offset = (block.mUsed + alignment - 1) & ~(alignment - 1);
+		if (offset + bytes <= block.mSize) {
+			block.mUsed = offset + bytes;
+			return block.mData + offset;
+		}
+	}
+
+	// Requests are sized up front by the scene loader, so a block is usually exactly one array
+	Block block;
+	block.mSize = std::max (bytes + alignment, ARENA_MIN_BLOCK_SIZE);
+	block.mData = (char*)malloc (block.mSize);
+	if (block.mData == NULL) {
+		printf ("Out of memory allocating %lu bytes for the scene\n", (unsigned long)block.mSize);
+		exit (1);
+	}
+
+	size_t offset = (alignment - ((size_t)block.mData & (alignment - 1))) & (alignment - 1);
+	block.mUsed = offset + bytes;
+	mBlocks.push_back (block);
+	mBytesReserved += block.mSize;
+	return block.mData + offset;
 }
 
-// Calculate the lighting (and color) of a point on the triangle
-Color calculateTriangleLighting (const Triangle& triangle, const Light& light, const Vector3& intersection) {
+void Arena::release () {
 
-	// To compute the normal, the barycentric coordinates need to be computed
-	Vector3 vertexA (triangle.v[0].position[0], triangle.v[0].position[1], triangle.v[0].position[2]);
-	Vector3 vertexB (triangle.v[1].position[0], triangle.v[1].position[1], triangle.v[1].position[2]);
-	Vector3 vertexC (triangle.v[2].position[0], triangle.v[2].position[1], triangle.v[2].position[2]);
+	for (size_t i = 0; i < mBlocks.size (); i++) {
+		free (mBlocks[i].mData);
+	}
+	mBlocks.clear ();
+	mBytesReserved = 0;
+}
 
-	// Compute planar normal
-	Vector3 vAvB = vertexB - vertexA;
-	Vector3 vAvC = vertexC - vertexA;
+// Growable array of plain records allocated from an arena. Growing copies into a new allocation and abandons the old
+// one until the arena is released, so reserve the expected size up front where it is known.
+template <typename T>
+class ArenaArray {
+private:
+	Arena* mArena;
+	T* mData;
+	int mSize;
+	int mCapacity;
 
-	Vector3 planar = Vector3::cross (vAvB, vAvC);
-	float denominator = planar.dot(planar);
+public:
+	ArenaArray (Arena& arena) : mArena (&arena), mData (NULL), mSize (0), mCapacity (0) {}
 
-	// Compute values u and v
-	Vector3 edgeCB = vertexC - vertexB;
-	Vector3 distB = intersection - vertexB;
-	Vector3 cpCB = Vector3::cross(edgeCB, distB);
+	void reserve (int capacity);
+	void resize (int size);
+	void push (const T& value);
 
-	Vector3 edgeAC = vertexA - vertexC;
-	Vector3 distC = intersection - vertexC;
-	Vector3 cpAC = Vector3::cross(edgeAC, distC);
+	// Forget the contents. Call after the arena has been released.
+	void clear () { mData = NULL; mSize = 0; mCapacity = 0; }
 
-	// Compute final u, v, and w values -- these are the barycentric coordinates
-	double u = planar.dot(cpCB) / denominator;	// Alpha
-	double v = planar.dot(cpAC) / denominator;	// Beta
-	double w = 1.0f - u - v;					// Gamma
+	// Trade contents with another array. The arenas the contents came from must be swapped with them.
+	void swap (ArenaArray& other) { std::swap (mData, other.mData); std::swap (mSize, other.mSize); std::swap (mCapacity, other.mCapacity); }
 
-	// Get triangle normals
-	Vector3 normal (
-		u * triangle.v[0].normal[0] + v * triangle.v[1].normal[0] + w * triangle.v[2].normal[0],
-		u * triangle.v[0].normal[1] + v * triangle.v[1].normal[1] + w * triangle.v[2].normal[1],
-		u * triangle.v[0].normal[2] + v * triangle.v[1].normal[2] + w * triangle.v[2].normal[2]
-	);
-	normal.normalize ();
+	inline int getSize () const { return mSize; }
+	inline int getCapacity () const { return mCapacity; }
+	inline T* getData () { return mData; }
+	inline const T* getData () const { return mData; }
+	inline T& operator[] (int index) { return mData[index]; }
+	inline const T& operator[] (int index) const { return mData[index]; }
+};
 
-	// Get normalized light direction vector
-	Vector3 lightPosition (light.position[0], light.position[1], light.position[2]);
-	Vector3 lightDirection = lightPosition - intersection;
-	lightDirection.normalize ();
+template <typename T>
+void ArenaArray<T>::reserve (int capacity) {
 
-	// Compute and clamp the values of the magnitudes of LdotN (light magnitude) and (2 * l (n - dir)) * direction (the reflection magnitude)
-	double lightMagnitude = computeLightMagnitude (lightDirection, normal);
-	double reflectionMagnitude = computeReflectionMagnitude (lightMagnitude, lightDirection, intersection, normal);
-
-	// Get the base diffuse, specular, and shininess values from the triangle object
-	Color diffuse (
-		u * triangle.v[0].color_diffuse[0] + v * triangle.v[1].color_diffuse[0] + w * triangle.v[2].color_diffuse[0],
-		u * triangle.v[0].color_diffuse[1] + v * triangle.v[1].color_diffuse[1] + w * triangle.v[2].color_diffuse[1],
-		u * triangle.v[0].color_diffuse[2] + v * triangle.v[1].color_diffuse[2] + w * triangle.v[2].color_diffuse[2]
-	);
+	if (capacity <= mCapacity) {
+		return;
+	}
 
-	Color specular (
-		u * triangle.v[0].color_specular[0] + v * triangle.v[1].color_specular[0] + w * triangle.v[2].color_specular[0],
-		u * triangle.v[0].color_specular[1] + v * triangle.v[1].color_specular[1] + w * triangle.v[2].color_specular[1],
-		u * triangle.v[0].color_specular[2] + v * triangle.v[1].color_specular[2] + w * triangle.v[2].color_specular[2]
-	);
+	T* data = (T*)mArena->allocate (sizeof (T) * (size_t)capacity, alignof (T));
+	if (mSize > 0) {
+		memcpy (data, mData, sizeof (T) * (size_t)mSize);
+	}
+	mData = data;
+	mCapacity = capacity;
+}
 
-	double shininess = u * triangle.v[0].shininess + v * triangle.v[1].shininess + w * triangle.v[2].shininess;
+template <typename T>
+void ArenaArray<T>::resize (int size) {
 
-	// Compute intensity for each color using the Phong equation
-	double r = light.color[0] * (diffuse.mR * lightMagnitude + (specular.mR * std::pow (reflectionMagnitude, shininess)));
-	double g = light.color[1] * (diffuse.mG * lightMagnitude + (specular.mG * std::pow (reflectionMagnitude, shininess)));
-	double b = light.color[2] * (diffuse.mB * lightMagnitude + (specular.mB * std::pow (reflectionMagnitude, shininess)));
-	return Color (r, g, b);
+	reserve (size);
+	mSize = size;
+}
+
+template <typename T>
+void ArenaArray<T>::push (const T& value) {
+
+	if (mSize == mCapacity) {
+		reserve (std::max (mCapacity * 2, 16));
+	}
+	mData[mSize++] = value;
 }
 
 /*************************************************************/
-// Raytracing
+// Global Variables
 /*************************************************************/
-// Iterate through all spheres and set the pixel color depending on whether or not there is an intersection and if there are shadowing objects
-Color performSphereCollisionTest (Ray& ray, const Color& color, double& closest) {
+// Every scene array lives in one arena, so unloading a scene is a single release
+Arena gSceneArena;
+ArenaArray<MeshTriangle> triangles (gSceneArena);
+ArenaArray<MeshVertex> vertices (gSceneArena);
+ArenaArray<Material> materials (gSceneArena);
+ArenaArray<TriangleMaterial> triangleMaterials (gSceneArena);
+ArenaArray<Sphere> spheres (gSceneArena);
+ArenaArray<Light> lights (gSceneArena);
+Real ambient_light[3];
+
+// Free the loaded scene
+void clearScene () {
+
+	gSceneArena.release ();
+	triangles.clear ();
+	vertices.clear ();
+	materials.clear ();
+	triangleMaterials.clear ();
+	spheres.clear ();
+	lights.clear ();
+}
 
-	Color retVal = color;
-	for (int i = 0; i < num_spheres; i++) {
+/*************************************************************/
+// Preprocessing
+/*************************************************************/
+// Intersection records for triangles[], in the same order. The mesh buffers are only read for shading.
+std::vector<TriangleRecord> gTriangleRecords;
+
+void buildTriangleRecords () {
+
+	gTriangleRecords.resize (triangles.getSize ());
+	for (int i = 0; i < triangles.getSize (); i++) {
+		const MeshVertex& a = vertices[triangles[i].v[0]];
+		const MeshVertex& b = vertices[triangles[i].v[1]];
+		const MeshVertex& c = vertices[triangles[i].v[2]];
+		Vector3 vertexA (a.position[0], a.position[1], a.position[2]);
+		Vector3 vertexB (b.position[0], b.position[1], b.position[2]);
+		Vector3 vertexC (c.position[0], c.position[1], c.position[2]);
+		gTriangleRecords[i].mVertex = vertexA;
+		gTriangleRecords[i].mEdge1 = vertexB - vertexA;
+		gTriangleRecords[i].mEdge2 = vertexC - vertexA;
+	}
+}
 
-		// Only calculate color for the closest intersection -- overwrite retVal if a closer intersection is detected
-		Vector3 intersection (0, 0, MAX_DIST);
-		if (ray.intersects (spheres[i], intersection) && intersection.mZ > closest) {
+/*************************************************************/
+// Bounding Volume Hierarchy
+/*************************************************************/
+const int BVH_BINS = 16;
+const int BVH_MAX_LEAF_SIZE = 4;
+const int BVH_MAX_SAH_DEPTH = 48;
+const int BVH_STACK_SIZE = 128;
+const double BVH_TRAVERSAL_COST = 1.0;
+const double BVH_INTERSECTION_COST = 1.0;
 
-			// By default, the color should be black
-			retVal = Color (0, 0, 0);
+// Axis-aligned bounding box definition and implementation
+struct AABB {
+	Vector3 mMin;
+	Vector3 mMax;
 
-			// Check to see if the sphere is shadowed--if it isn't, add the color at the intersection point
-			for (int j = 0; j < num_lights; j++) {
+	AABB () : mMin (1e30, 1e30, 1e30), mMax (-1e30, -1e30, -1e30) {}
+	AABB (const Vector3& min, const Vector3& max) : mMin (min), mMax (max) {}
 
-				// Get the position of the light
-				Vector3 lightPosition (lights[j].position[0], lights[j].position[1], lights[j].position[2]);
+	// Member functions
+	inline void grow (const Vector3& point) { mMin = Vector3::min (mMin, point); mMax = Vector3::max (mMax, point); }
+	inline void grow (const AABB& other) { mMin = Vector3::min (mMin, other.mMin); mMax = Vector3::max (mMax, other.mMax); }
+	inline bool isEmpty () const { return mMin.mX > mMax.mX; }
+	inline Vector3 centroid () const { return (mMin + mMax) * 0.5; }
+	double surfaceArea () const;
+	bool intersects (const Vector3& origin, const Vector3& inverseDirection, Real tMax, Real& tEntry) const;
+};
 
-				// Create the shadow ray--the origin should be the point where the ray intersected with the sphere, and the direction should be the normalized direction to the light
-				Vector3 origin = intersection;
-				Vector3 direction = lightPosition - origin;
-				Ray shadow (origin, direction.normalize ());
+double AABB::surfaceArea () const {
 
-				// If the object is lit, add color to it
-				bool isLit = true; 
+	if (isEmpty ()) {
+		return 0;
+	}
 
-				// Check for collisions against every object--ignoring our own object (same index)
-				for (int k = 0; k < num_spheres; k++) {
-					Vector3 intersect;
-					if (shadow.intersects (spheres[k], intersect) && k != i) {
+	Vector3 extent = mMax - mMin;
+	return 2.0 * (extent.mX * extent.mY + extent.mY * extent.mZ + extent.mZ * extent.mX);
+}
 
-						// Make sure that the intersection point is not past the light
-						Vector3 x = intersect - intersection;
-						Vector3 y = lightPosition - intersection;
-						if (x.magnitude () < y.magnitude ()) {
-							isLit = false;
-							break;
-						}
-					}
-				}
+// Slab test. Reports the distance at which the ray enters the box, which is used to order the traversal front-to-back.
+bool AABB::intersects (const Vector3& origin, const Vector3& inverseDirection, Real tMax, Real& tEntry) const {
 
-				for (int k = 0; k < num_triangles; k++) {
-					Vector3 intersect;
-					if (shadow.intersects (triangles[k], intersect)) {
-
-						// Make sure that the intersection point is not past the light
-						Vector3 x = intersect - intersection;
-						Vector3 y = lightPosition - intersection;
-						if (x.magnitude () < y.magnitude ()) {
-							isLit = false;
-							break;
-						}
-					}
-				}
+	Real tNear = -1e30;
+	Real tFar = tMax;
+	for (int axis = 0; axis < 3; axis++) {
+		Real t0 = (mMin[axis] - origin[axis]) * inverseDirection[axis];
+		Real t1 = (mMax[axis] - origin[axis]) * inverseDirection[axis];
+		if (t0 > t1) {
+			std::swap (t0, t1);
+		}
 
-				if (isLit) {
-					retVal += calculateSphereLighting (spheres[i], lights[j], intersection);
-				}
-			}
+		// Written so that a NaN (ray origin on the slab with a zero direction component) leaves the interval untouched
+		if (t0 > tNear) {
+			tNear = t0;
+		}
 
-			// Update the closest intersection point
-			closest = intersection.mZ;
+		if (t1 < tFar) {
+			tFar = t1;
 		}
 	}
 
-	return retVal;
+	tEntry = tNear;
+	return tNear <= tFar && tFar >= 0;
 }
 
-// Iterate through all triangles and set the pixel color depending on whether or not there is an intersection and if there are shadowing objects
-Color performTriangleCollisionTest (Ray& ray, const Color& color, double& closest) {
-
-	Color retVal = color;
-	for (int i = 0; i < num_triangles; i++) {
+// Flattened BVH node. Nodes are stored depth-first, so the first child of an interior node always directly follows it.
+struct BVHNode {
+	AABB mBounds;
+	int mOffset;	// Leaves: first entry in the primitive index list. Interior nodes: index of the second child.
+	int mCount;		// Number of primitives in a leaf, 0 for interior nodes
 
-		// Only calculate color for the closest intersection -- overwrite retVal if a closer intersection is detected
-		Vector3 intersection (0, 0, MAX_DIST);
-		if (ray.intersects (triangles[i], intersection) && intersection.mZ > closest) {
+	BVHNode () : mOffset (0), mCount (0) {}
+};
 
-			// By default, the color should be black
-			retVal = Color (0, 0, 0);
+// Traversal statistics, used to report how many nodes are visited per ray
+struct BVHStats {
+	unsigned long long mRays;
+	unsigned long long mNodesVisited;
+	unsigned long long mCacheHits;	// Queries answered without a traversal
 
-			// Check to see if the triangle is shadowed--if it isn't, add the color at the intersection point
-			for (int j = 0; j < num_lights; j++) {
+	BVHStats () : mRays (0), mNodesVisited (0), mCacheHits (0) {}
 
-				// Get the position of the light
-				Vector3 lightPosition (lights[j].position[0], lights[j].position[1], lights[j].position[2]);
+	inline double nodesPerRay () const { return (mRays > 0) ? (double)mNodesVisited / (double)mRays : 0; }
+};
 
-				// Create the shadow ray--the origin should be the point where the ray intersected with the sphere, and the direction should be the normalized direction to the light
-				Vector3 origin = intersection;
-				Vector3 direction = lightPosition - origin;
-				Ray shadow (origin, direction.normalize ());
+// Binned SAH bounding volume hierarchy over an array of primitives. The primitives themselves stay in their own array; the
+// hierarchy only stores indices into it, so the same class serves both spheres and triangles.
+class BVH {
+private:
+	std::vector<BVHNode> mNodes;
+	std::vector<int> mIndices;
 
-				// If the object is lit, add color to it
-				bool isLit = true; 
+	int buildRecursive (const std::vector<AABB>& bounds, const std::vector<Vector3>& centroids, int begin, int end, int depth);
 
-				// Check for collisions against every object--ignoring our own object (same index)
-				for (int k = 0; k < num_spheres; k++) {
-					Vector3 intersect;
-					if (shadow.intersects (spheres[k], intersect)) {
+public:
+	BVH () {}
 
-						// Make sure that the intersection point is not past the light
-						Vector3 x = intersect - intersection;
-						Vector3 y = lightPosition - intersection;
-						if (x.magnitude () < y.magnitude ()) {
-							isLit = false;
-							break;
-						}
-					}
-				}
+	// Member functions
+	void build (const std::vector<AABB>& primitiveBounds);
+	inline int getNodeCount () const { return (int)mNodes.size (); }
+	inline const BVHNode& getNode (int index) const { return mNodes[index]; }
+	inline int getPrimitiveIndex (int index) const { return mIndices[index]; }
+
+	// Find the nearest primitive along the ray that is closer than tMax
+	template <typename Primitive>
+	bool closestHit (const Ray& ray, const Primitive* primitives, Real tMax, int& index, Real& t, BVHStats& stats) const;
+
+	// Find any primitive (other than ignore) closer than maxDistance along the ray. Returns as soon as one is found.
+	template <typename Primitive>
+	bool anyHit (const Ray& ray, const Primitive* primitives, Real maxDistance, int ignore, int& index, BVHStats& stats) const;
+};
 
-				for (int k = 0; k < num_triangles; k++) {
-					Vector3 intersect;
-					if (shadow.intersects (triangles[k], intersect) && k != i) {
-
-						// Make sure that the intersection point is not past the light
-						Vector3 x = intersect - intersection;
-						Vector3 y = lightPosition - intersection;
-						if (x.magnitude () < y.magnitude ()) {
-							isLit = false;
-							break;
-						}
-					}
-				}
+void BVH::build (const std::vector<AABB>& primitiveBounds) {
 
-				if (isLit) {
-					retVal += calculateTriangleLighting (triangles[i], lights[j], intersection);
-				}
-			}
+	mNodes.clear ();
+	mIndices.clear ();
+	if (primitiveBounds.empty ()) {
+		return;
+	}
 
-			// Update the closest intersection point
-			closest = intersection.mZ;
-		}
+	int count = (int)primitiveBounds.size ();
+	std::vector<Vector3> centroids (count);
+	mIndices.resize (count);
+	for (int i = 0; i < count; i++) {
+		centroids[i] = primitiveBounds[i].centroid ();
+		mIndices[i] = i;
 	}
 
-	return retVal;
+	// A binary tree over n primitives never has more than 2n - 1 nodes
+	mNodes.reserve (2 * count - 1);
+	buildRecursive (primitiveBounds, centroids, 0, count, 0);
 }
 
-// Perfrom a raycast to determine a pixel's color
-Color trace (Ray& ray) {
-	
-	// We need to track the current pixel color and current closest intersection
-	Color retVal (1, 1, 1);
-	double closest = MAX_DIST;
+int BVH::buildRecursive (const std::vector<AABB>& bounds, const std::vector<Vector3>& centroids, int begin, int end, int depth) {
 
-	// Check raycasts against all spheres
-	retVal = performSphereCollisionTest (ray, retVal, closest);
+	int nodeIndex = (int)mNodes.size ();
+	mNodes.push_back (BVHNode ());
 
-	// Check raycasts against all triangles
-	retVal = performTriangleCollisionTest (ray, retVal, closest);
+	// Compute the bounds of the primitives and of their centroids
+	AABB nodeBounds;
+	AABB centroidBounds;
+	for (int i = begin; i < end; i++) {
+		nodeBounds.grow (bounds[mIndices[i]]);
+		centroidBounds.grow (centroids[mIndices[i]]);
+	}
+	mNodes[nodeIndex].mBounds = nodeBounds;
 
-	// Add ambient light
-	retVal += Color (ambient_light[0], ambient_light[1], ambient_light[2]);
+	int count = end - begin;
+	double area = nodeBounds.surfaceArea ();
+	if (area <= 0) {
+		area = 1;
+	}
 
-	// If there are no triangles or spheres, return white
-	return retVal;
-}
+	// Evaluate the surface area heuristic at every bin boundary along every axis
+	int bestAxis = -1;
+	int bestSplit = 0;
+	double bestCost = 1e30;
+	for (int axis = 0; axis < 3 && count > 1 && depth < BVH_MAX_SAH_DEPTH; axis++) {
 
-// Compute a series of rays from the camera for each pixel. Since this is used for SSAA, we should have four rays per pixel
-Ray* calculateRaysFromCamera (double x, double y) {
+		double low = centroidBounds.mMin[axis];
+		double extent = centroidBounds.mMax[axis] - low;
+		if (extent <= 0) {
+			continue;
+		}
 
-	Ray* rays = new Ray[SSAA_SAMPLES];
+		AABB binBounds[BVH_BINS];
+		int binCounts[BVH_BINS] = { 0 };
+		double scale = BVH_BINS / extent;
+		for (int i = begin; i < end; i++) {
+			int bin = std::min (BVH_BINS - 1, (int)((centroids[mIndices[i]][axis] - low) * scale));
+			binCounts[bin]++;
+			binBounds[bin].grow (bounds[mIndices[i]]);
+		}
 
-	{
-		// Compute the ratio and angle
-		double ratio = (double)WIDTH / (double)HEIGHT;
-		double angle = std::tan ((fov / 2.0) * (PI / 180.0));
+		// Sweep from the right to get the area and count of every right-hand partition
+		double rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		AABB accumulated;
+		int accumulatedCount = 0;
+		for (int bin = BVH_BINS - 1; bin > 0; bin--) {
+			accumulated.grow (binBounds[bin]);
+			accumulatedCount += binCounts[bin];
+			rightArea[bin] = accumulated.surfaceArea ();
+			rightCount[bin] = accumulatedCount;
+		}
 
-		// Begin computing NDC coordinates
-		double xNDC = (x + 0.25) / (double)WIDTH;
-		double yNDC = (y + 0.25) / (double)HEIGHT;
+		// Then sweep from the left and cost each split
+		accumulated = AABB ();
+		accumulatedCount = 0;
+		for (int bin = 0; bin < BVH_BINS - 1; bin++) {
+			accumulated.grow (binBounds[bin]);
+			accumulatedCount += binCounts[bin];
+			if (accumulatedCount == 0 || rightCount[bin + 1] == 0) {
+				continue;
+			}
+
+			double cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST *
+				(accumulated.surfaceArea () * accumulatedCount + rightArea[bin + 1] * rightCount[bin + 1]) / area;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = bin + 1;
+			}
+		}
+	}
 
-		// Using the NDC coordinates, compute screen coordinates
-		double xScreen = (2 * xNDC) - 1;
-		double yScreen = (2 * yNDC) - 1;
+	// Make a leaf if the node is small and splitting does not pay off
+	double leafCost = BVH_INTERSECTION_COST * count;
+	if (count == 1 || (count <= BVH_MAX_LEAF_SIZE && leafCost <= bestCost)) {
+		mNodes[nodeIndex].mOffset = begin;
+		mNodes[nodeIndex].mCount = count;
+		return nodeIndex;
+	}
 
-		// From the screen coordinates, get the actual coordinates
-		double xActual = xScreen * angle * ratio;
-		double yActual = yScreen * angle;
+	int middle;
+	if (bestAxis >= 0) {
 
-		// Get the origin (camera position) and direction, and return a ray in the normalized direction
-		Vector3 origin;
-		Vector3 dir (xActual, yActual, -1);
-		rays[0] = Ray (origin, dir.normalize ());
+		// Partition the primitives around the chosen bin boundary
+		double low = centroidBounds.mMin[bestAxis];
+		double scale = BVH_BINS / (centroidBounds.mMax[bestAxis] - low);
+		int* split = std::partition (&mIndices[0] + begin, &mIndices[0] + end, [&](int index) {
+			return std::min (BVH_BINS - 1, (int)((centroids[index][bestAxis] - low) * scale)) < bestSplit;
+		});
+		middle = (int)(split - &mIndices[0]);
 	}
 
-	{
-		// Compute the ratio and angle
-		double ratio = (double)WIDTH / (double)HEIGHT;
-		double angle = std::tan ((fov / 2.0) * (PI / 180.0));
+	else {
 
-		// Begin computing NDC coordinates
-		double xNDC = (x + 0.75) / (double)WIDTH;
-		double yNDC = (y + 0.25) / (double)HEIGHT;
+		// No usable SAH split (coincident centroids, or the tree is getting too deep), so fall back to a median split
+		Vector3 extent = centroidBounds.mMax - centroidBounds.mMin;
+		int axis = (extent.mX > extent.mY && extent.mX > extent.mZ) ? 0 : ((extent.mY > extent.mZ) ? 1 : 2);
+		middle = begin + count / 2;
+		std::nth_element (&mIndices[0] + begin, &mIndices[0] + middle, &mIndices[0] + end, [&](int a, int b) {
+			return centroids[a][axis] < centroids[b][axis];
+		});
+	}
 
-		// Using the NDC coordinates, compute screen coordinates
-		double xScreen = (2 * xNDC) - 1;
-		double yScreen = (2 * yNDC) - 1;
+	// The first child directly follows this node; the second child's index is stored in the node
+	buildRecursive (bounds, centroids, begin, middle, depth + 1);
+	int second = buildRecursive (bounds, centroids, middle, end, depth + 1);
+	mNodes[nodeIndex].mOffset = second;
+	mNodes[nodeIndex].mCount = 0;
+	return nodeIndex;
+}
 
-		// From the screen coordinates, get the actual coordinates
-		double xActual = xScreen * angle * ratio;
-		double yActual = yScreen * angle;
+template <typename Primitive>
+bool BVH::closestHit (const Ray& ray, const Primitive* primitives, Real tMax, int& index, Real& t, BVHStats& stats) const {
 
-		// Get the origin (camera position) and direction, and return a ray in the normalized direction
-		Vector3 origin;
-		Vector3 dir (xActual, yActual, -1);
-		rays[1] = Ray (origin, dir.normalize ());
+	index = -1;
+	if (mNodes.empty ()) {
+		return false;
 	}
 
-	{
-		// Compute the ratio and angle
-		double ratio = (double)WIDTH / (double)HEIGHT;
-		double angle = std::tan ((fov / 2.0) * (PI / 180.0));
+	const Vector3& origin = ray.getOrigin ();
+	const Vector3& direction = ray.getDirection ();
+	Vector3 inverseDirection (1.0 / direction.mX, 1.0 / direction.mY, 1.0 / direction.mZ);
+
+	// Each stack entry remembers where the ray entered the node, so nodes beyond the closest hit found since can be skipped
+	struct Entry {
+		int mNode;
+		Real mDistance;
+	};
+	Entry stack[BVH_STACK_SIZE];
+	int top = 0;
+
+	Real closest = tMax;
+	Real entry;
+	stats.mNodesVisited++;
+	if (!mNodes[0].mBounds.intersects (origin, inverseDirection, closest, entry)) {
+		return false;
+	}
+	stack[top].mNode = 0;
+	stack[top++].mDistance = entry;
 
-		// Begin computing NDC coordinates
-		double xNDC = (x + 0.25) / (double)WIDTH;
-		double yNDC = (y + 0.75) / (double)HEIGHT;
+	while (top > 0) {
 
-		// Using the NDC coordinates, compute screen coordinates
-		double xScreen = (2 * xNDC) - 1;
-		double yScreen = (2 * yNDC) - 1;
+		Entry current = stack[--top];
+		if (current.mDistance > closest) {
+			continue;
+		}
 
-		// From the screen coordinates, get the actual coordinates
-		double xActual = xScreen * angle * ratio;
-		double yActual = yScreen * angle;
+		const BVHNode& node = mNodes[current.mNode];
+		if (node.mCount > 0) {
 
-		// Get the origin (camera position) and direction, and return a ray in the normalized direction
-		Vector3 origin;
-		Vector3 dir (xActual, yActual, -1);
-		rays[2] = Ray (origin, dir.normalize ());
-	}
+			// Ties go to the lower index, matching a linear scan over the primitive array
+			for (int i = 0; i < node.mCount; i++) {
+				int primitive = mIndices[node.mOffset + i];
+				Real hit;
+				if (ray.intersects (primitives[primitive], hit) && (hit < closest || (hit == closest && primitive < index))) {
+					closest = hit;
+					index = primitive;
+				}
+			}
+			continue;
+		}
 
-	{
-		// Compute the ratio and angle
-		double ratio = (double)WIDTH / (double)HEIGHT;
-		double angle = std::tan ((fov / 2.0) * (PI / 180.0));
+		// Test both children, then visit the nearer one first by pushing it last
+		int first = current.mNode + 1;
+		int second = node.mOffset;
+		Real firstEntry;
+		Real secondEntry;
+		stats.mNodesVisited += 2;
+		bool hitFirst = mNodes[first].mBounds.intersects (origin, inverseDirection, closest, firstEntry);
+		bool hitSecond = mNodes[second].mBounds.intersects (origin, inverseDirection, closest, secondEntry);
+		if (hitFirst && hitSecond) {
+			if (firstEntry > secondEntry) {
+				std::swap (first, second);
+				std::swap (firstEntry, secondEntry);
+			}
+			stack[top].mNode = second;
+			stack[top++].mDistance = secondEntry;
+			stack[top].mNode = first;
+			stack[top++].mDistance = firstEntry;
+		}
+
+		else if (hitFirst) {
+			stack[top].mNode = first;
+			stack[top++].mDistance = firstEntry;
+		}
 
-		// Begin computing NDC coordinates
-		double xNDC = (x + 0.75) / (double)WIDTH;
-		double yNDC = (y + 0.75) / (double)HEIGHT;
+		else if (hitSecond) {
+			stack[top].mNode = second;
+			stack[top++].mDistance = secondEntry;
+		}
+	}
 
-		// Using the NDC coordinates, compute screen coordinates
-		double xScreen = (2 * xNDC) - 1;
-		double yScreen = (2 * yNDC) - 1;
+	t = closest;
+	return index >= 0;
+}
 
-		// From the screen coordinates, get the actual coordinates
-		double xActual = xScreen * angle * ratio;
-		double yActual = yScreen * angle;
+template <typename Primitive>
+bool BVH::anyHit (const Ray& ray, const Primitive* primitives, Real maxDistance, int ignore, int& index, BVHStats& stats) const {
 
-		// Get the origin (camera position) and direction, and return a ray in the normalized direction
-		Vector3 origin;
-		Vector3 dir (xActual, yActual, -1);
-		rays[3] = Ray (origin, dir.normalize ());
+	if (mNodes.empty ()) {
+		return false;
 	}
-	return rays;
-}
 
-// Compute the ray direction from the camera to a pixel on screen
-Ray calculateRayFromCamera (double x, double y) {
+	const Vector3& origin = ray.getOrigin ();
+	const Vector3& direction = ray.getDirection ();
+	Vector3 inverseDirection (1.0 / direction.mX, 1.0 / direction.mY, 1.0 / direction.mZ);
 
-	// Compute the ratio and angle
-	double ratio = (double)WIDTH / (double)HEIGHT;
-	double angle = std::tan ((fov / 2.0) * (PI / 180.0));
+	int stack[BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
 
-	// Begin computing NDC coordinates
-	double xNDC = (x + 0.5) / (double)WIDTH;
-	double yNDC = (y + 0.5) / (double)HEIGHT;
+	while (top > 0) {
 
-	// Using the NDC coordinates, compute screen coordinates
-	double xScreen = (2 * xNDC) - 1;
-	double yScreen = (2 * yNDC) - 1;
+		int nodeIndex = stack[--top];
+		const BVHNode& node = mNodes[nodeIndex];
+		stats.mNodesVisited++;
 
-	// From the screen coordinates, get the actual coordinates
-	double xActual = xScreen * angle * ratio;
-	double yActual = yScreen * angle;
+		Real entry;
+		if (!node.mBounds.intersects (origin, inverseDirection, maxDistance, entry)) {
+			continue;
+		}
+
+		if (node.mCount > 0) {
+			for (int i = 0; i < node.mCount; i++) {
+				int primitive = mIndices[node.mOffset + i];
+				if (primitive != ignore && ray.occludedBy (primitives[primitive], maxDistance)) {
+					index = primitive;
+					return true;
+				}
+			}
+			continue;
+		}
+
+		stack[top++] = node.mOffset;
+		stack[top++] = nodeIndex + 1;
+	}
 
-	// Get the origin (camera position) and direction, and return a ray in the normalized direction
-	Vector3 origin;
-	Vector3 dir (xActual, yActual, -1);
-	return Ray (origin, dir.normalize ());
+	return false;
 }
 
-void draw_scene() {
-	
-	// Iterate through all pixels and write the results of the trace to the screen and buffer
-	for(unsigned int x = 0; x < WIDTH; x++) {
+// Scene acceleration structures--one hierarchy per primitive type
+BVH gSphereBVH;
+BVH gTriangleBVH;
+BVHStats gPrimaryStats;
+BVHStats gShadowStats;
+unsigned long long gRefinedPixels = 0;
 
-		// Begin drawing
-		glPointSize(2.0);	
-		glBegin(GL_POINTS);
+// The object that last blocked a light. Exactly one of mSphere and mTriangle is set once the light has been blocked.
+struct Occluder {
+	int mSphere;
+	int mTriangle;
 
-		for(unsigned int y = 0; y < HEIGHT; y++) {
+	Occluder () : mSphere (-1), mTriangle (-1) {}
+};
 
-			// Compute the average of the four rays
-			double r = 0;
-			double g = 0;
-			double b = 0;
+// Per-thread tracing state. Every render thread owns one, so nothing in the tracer writes to shared memory.
+struct RenderContext {
+	BVHStats mPrimaryStats;
+	BVHStats mShadowStats;
 
-			// If SSAA is enabled, average the values
-			if (gUseAA) {
-				Ray* rays = calculateRaysFromCamera (x, y);
-				for (int i = 0; i < SSAA_SAMPLES; i++) {
-					Color color = trace (rays[i]);
-					r += color.mR;
-					g += color.mG;
-					b += color.mB;
-				}
-				r /= SSAA_SAMPLES;
-				g /= SSAA_SAMPLES;
-				b /= SSAA_SAMPLES;
-				delete [] rays;
-			}
+	// Neighbouring pixels are usually shadowed by the same object, so that object is tested before the hierarchy
+	std::vector<Occluder> mLastOccluder;
 
-			// Otherwise, just get the value from one ray
-			else {
-				Ray ray = calculateRayFromCamera (x, y);
-				Color color = trace (ray);
-				r = color.mR;
-				g = color.mG;
-				b = color.mB;
-			}
+	// Pixels supersampled by adaptive antialiasing
+	unsigned long long mRefinedPixels;
 
-			// Draw the colors to the screen
-			plot_pixel(x, y, r * 255, g * 255, b * 255);
-		}
+	// Lights that reach the hit being shaded, in order
+	std::vector<int> mLitLights;
+
+	RenderContext () : mLastOccluder (lights.getSize ()), mRefinedPixels (0) {
+		mLitLights.reserve (lights.getSize ());
+	}
+};
+
+void buildLightArrays ();
+void buildLightTree ();
+
+// Build the intersection records and the hierarchies over the loaded scene. Must be called after loadScene.
+void buildAccelerationStructures () {
+
+	TraceScope trace ("buildAccelerationStructures");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	buildTriangleRecords ();
 
-		// End drawing
-		glEnd();
-		glFlush();
+	std::vector<AABB> sphereBounds (spheres.getSize ());
+	for (int i = 0; i < spheres.getSize (); i++) {
+		Vector3 center (spheres[i].position[0], spheres[i].position[1], spheres[i].position[2]);
+		Vector3 radius (spheres[i].radius, spheres[i].radius, spheres[i].radius);
+		sphereBounds[i] = AABB (center - radius, center + radius);
 	}
+	gSphereBVH.build (sphereBounds);
+
+	std::vector<AABB> triangleBounds (triangles.getSize ());
+	for (int i = 0; i < triangles.getSize (); i++) {
+		const TriangleRecord& record = gTriangleRecords[i];
+		triangleBounds[i].grow (record.mVertex);
+		triangleBounds[i].grow (record.mVertex + record.mEdge1);
+		triangleBounds[i].grow (record.mVertex + record.mEdge2);
+	}
+	gTriangleBVH.build (triangleBounds);
+
+	double elapsed = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+	printf ("BVH: %i spheres (%i nodes), %i triangles (%i nodes), built in %.3f ms\n",
+		spheres.getSize (), gSphereBVH.getNodeCount (), triangles.getSize (), gTriangleBVH.getNodeCount (), elapsed);
+
+	buildLightArrays ();
+	buildLightTree ();
+}
+
+// Fold a render thread's statistics into the frame totals
+void accumulateTraversalStats (const RenderContext& context) {
+	gPrimaryStats.mRays += context.mPrimaryStats.mRays;
+	gPrimaryStats.mNodesVisited += context.mPrimaryStats.mNodesVisited;
+	gShadowStats.mRays += context.mShadowStats.mRays;
+	gShadowStats.mNodesVisited += context.mShadowStats.mNodesVisited;
+	gShadowStats.mCacheHits += context.mShadowStats.mCacheHits;
+	gRefinedPixels += context.mRefinedPixels;
+}
+
+// Print the average number of nodes visited per ray
+void reportTraversalStats () {
+	printf ("BVH: %llu primary rays, %.2f nodes visited per ray\n", gPrimaryStats.mRays, gPrimaryStats.nodesPerRay ());
+	printf ("BVH: %llu shadow rays, %.2f nodes visited per ray, %llu answered by the occluder cache\n",
+		gShadowStats.mRays, gShadowStats.nodesPerRay (), gShadowStats.mCacheHits);
 }
 
 /*************************************************************/
-// Pixel plotting
+// Light Hierarchy
 /*************************************************************/
-void plot_pixel_display(int x, int y, unsigned char r, unsigned char g, unsigned char b)
-{
-	glColor3f(((float)r) / 255.0f, ((float)g) / 255.0f, ((float)b) / 255.0f);
-	glVertex2i(x,y);
+// Many-light shading works on a binary tree over the lights. A node covers a cluster of lights with the bounds of their
+// positions, their total color and one representative light that stands in for all of them: --light-tree N shades each
+// point with a cut of at most N clusters through the tree, and --light-samples K descends it K times, choosing children
+// in proportion to how much they could contribute. --light-cull T skips lights and clusters that can't contribute T.
+unsigned int gLightCut = 0;
+unsigned int gLightSamples = 0;
+double gLightCull = 0;
+
+const unsigned int LIGHT_CUT_MAX = 256;
+const unsigned int LIGHT_SAMPLES_MAX = 1024;
+
+struct LightNode {
+	AABB mBounds;
+	Real mTotal[3];		// Summed light colors, not clamped
+	int mRepresentative;	// Index into lights[]
+	int mSecond;			// Second child of an interior node; the first directly follows it. -1 for a single light.
+};
+
+std::vector<LightNode> gLightTree;
+
+inline bool isManyLightShading () {
+	return gLightCut > 0 || gLightSamples > 0;
 }
 
-void plot_pixel_jpeg(int x, int y, unsigned char r, unsigned char g, unsigned char b)
-{
-	buffer[y][x][0] = r;
-	buffer[y][x][1] = g;
-	buffer[y][x][2] = b;
+// Orders light indices by position along one axis
+struct LightAxisLess {
+	int mAxis;
+
+	bool operator() (int a, int b) const { return lights[a].position[mAxis] < lights[b].position[mAxis]; }
+};
+
+// Build the subtree over lights order[begin, end), splitting at the median of the widest axis. Returns its root.
+int buildLightTreeRecursive (std::vector<int>& order, int begin, int end) {
+
+	int index = (int)gLightTree.size ();
+	gLightTree.push_back (LightNode ());
+
+	LightNode node;
+	node.mTotal[0] = node.mTotal[1] = node.mTotal[2] = 0;
+	for (int i = begin; i < end; i++) {
+		const Light& light = lights[order[i]];
+		node.mBounds.grow (Vector3 (light.position[0], light.position[1], light.position[2]));
+		for (int c = 0; c < 3; c++) {
+			node.mTotal[c] += light.color[c];
+		}
+	}
+
+	if (end - begin == 1) {
+		node.mRepresentative = order[begin];
+		node.mSecond = -1;
+		gLightTree[index] = node;
+		return index;
+	}
+
+	Vector3 extent = node.mBounds.mMax - node.mBounds.mMin;
+	LightAxisLess less;
+	less.mAxis = (extent.mX >= extent.mY && extent.mX >= extent.mZ) ? 0 : ((extent.mY >= extent.mZ) ? 1 : 2);
+	int middle = (begin + end) / 2;
+	std::nth_element (order.begin () + begin, order.begin () + middle, order.begin () + end, less);
+
+	int first = buildLightTreeRecursive (order, begin, middle);
+	int second = buildLightTreeRecursive (order, middle, end);
+
+	// The brighter child's representative speaks for the pair
+	const LightNode& a = gLightTree[first];
+	const LightNode& b = gLightTree[second];
+	bool brighter = (a.mTotal[0] + a.mTotal[1] + a.mTotal[2]) >= (b.mTotal[0] + b.mTotal[1] + b.mTotal[2]);
+	node.mRepresentative = brighter ? a.mRepresentative : b.mRepresentative;
+	node.mSecond = second;
+	gLightTree[index] = node;
+	return index;
 }
 
-void plot_pixel(int x, int y, unsigned char r, unsigned char g, unsigned char b)
-{
-	plot_pixel_display(x,y,r,g,b);
-	if(mode == MODE_JPEG)
-		plot_pixel_jpeg(x,y,r,g,b);
+// Build the tree over the loaded lights, if a many-light mode is on
+void buildLightTree () {
+
+	gLightTree.clear ();
+	if (!isManyLightShading () || lights.getSize () == 0) {
+		return;
+	}
+
+	TraceScope trace ("buildLightTree");
+	std::vector<int> order (lights.getSize ());
+	for (int i = 0; i < lights.getSize (); i++) {
+		order[i] = i;
+	}
+	buildLightTreeRecursive (order, 0, lights.getSize ());
+	printf ("Light tree: %i lights (%i nodes), %s\n", lights.getSize (), (int)gLightTree.size (),
+		(gLightSamples > 0) ? "sampled" : "clustered");
 }
 
 /*************************************************************/
-// Parsing
+// Plotting Function Prototypes
 /*************************************************************/
-void save_jpg()
-{
-	printf("Saving JPEG file: %s\n", filename);
+void plot_pixel(int x,int y,unsigned char r,unsigned char g,unsigned char b);
+void display_region(unsigned int x0,unsigned int y0,unsigned int x1,unsigned int y1);
 
-	ImageIO img(WIDTH, HEIGHT, 3, &buffer[0][0][0]);
-	if (img.save(filename, ImageIO::FORMAT_JPEG) != ImageIO::OK)
-		printf("Error in Saving\n");
-	else 
-		printf("File saved Successfully\n");
+/*************************************************************/
+// Lighting
+/*************************************************************/
+// --no-simd turns off every AVX2 kernel
+bool gAllowSIMD = true;
+
+// Everything about a hit point that is the same for every light: where it is, its shading normal, its material and the
+// direction to the eye. Worked out once per hit and then shared by all the lights that reach it.
+struct ShadingPoint {
+	Vector3 mPosition;
+	Vector3 mNormal;
+	Vector3 mToEye;
+	Real mDiffuse[3];
+	Real mSpecular[3];
+	Real mShininess;
+};
+
+// Compute the magnitude of the light -- this is the same between spheres and triangles
+Real computeLightMagnitude (const Vector3& lightDirection, const Vector3& normal) {
+
+	// Compute the dot product of the light direction and the normal to get the lighting magnitude, then clamp it
+	Real retVal = lightDirection.dot (normal);
+	if (retVal > 1.0f) {
+		retVal = 1.0f;
+	}
+
+	else if (retVal < 0.0f) {
+		retVal = 0.0f;
+	}
+
+	return retVal;
 }
 
-void parse_check(const char *expected, char *found)
-{
-	if(strcasecmp(expected,found))
-	{
-		printf("Expected '%s ' found '%s '\n", expected, found);
-		printf("Parse error, abnormal abortion\n");
-		exit(0);
+// Reflection magnitude for a given (normalized) direction to the eye
+Real computeReflectionMagnitudeTowards (Real lightMagnitude, const Vector3& lightDirection, const Vector3& toEye, const Vector3& normal) {
+
+	// Find the reflection vector, then compute the dot product to get the reflection magnitude
+	Vector3 reflection (2 * lightMagnitude * normal.mX - lightDirection.mX, 2 * lightMagnitude * normal.mY - lightDirection.mY, 2 * lightMagnitude * normal.mZ - lightDirection.mZ);
+	reflection.normalize ();
+	Real retVal = reflection.dot (toEye);
+	if (retVal > 1.0f) { 
+		retVal = 1.0f;
+	}
+
+	else if (retVal < 0.0f) {
+		retVal = 0.0f;
 	}
+
+	return retVal;
 }
 
-void parse_doubles(FILE* file, const char *check, double p[3])
-{
-	char str[100];
-	fscanf(file,"%s",str);
-	parse_check(check,str);
-	fscanf(file,"%lf %lf %lf",&p[0],&p[1],&p[2]);
-	printf("%s %lf %lf %lf\n",check,p[0],p[1],p[2]);
+// Compute the magnitude of the reflectiveness -- this is the same between spheres and triangles
+Real computeReflectionMagnitude (Real lightMagnitude, const Vector3& lightDirection, const Vector3& intersection, const Vector3& normal) {
+
+	// Get normalized direction vector
+	Vector3 direction = gCamera.getEye () - intersection;
+	direction.normalize ();
+	return computeReflectionMagnitudeTowards (lightMagnitude, lightDirection, direction, normal);
 }
 
-void parse_rad(FILE *file, double *r)
-{
-	char str[100];
-	fscanf(file,"%s",str);
-	parse_check("rad:",str);
-	fscanf(file,"%lf",r);
-	printf("rad: %f\n",*r);
+// Fill in the parts of a shading point that don't depend on the object
+void describeHitPoint (const Vector3& intersection, ShadingPoint& point) {
+	point.mPosition = intersection;
+	point.mToEye = gCamera.getEye () - intersection;
+	point.mToEye.normalize ();
 }
 
-void parse_shi(FILE *file, double *shi)
-{
-	char s[100];
-	fscanf(file,"%s",s);
-	parse_check("shi:",s);
-	fscanf(file,"%lf",shi);
-	printf("shi: %f\n",*shi);
+// Shading point on a sphere
+void describeSphereHit (const Sphere& sphere, const Vector3& intersection, ShadingPoint& point) {
+
+	describeHitPoint (intersection, point);
+
+	// Get normal
+	point.mNormal = intersection - Vector3 (sphere.position[0], sphere.position[1], sphere.position[2]);
+	point.mNormal.normalize ();
+
+	// Get the base diffuse, specular, and shininess values from the sphere object
+	for (int c = 0; c < 3; c++) {
+		point.mDiffuse[c] = sphere.color_diffuse[c];
+		point.mSpecular[c] = sphere.color_specular[c];
+	}
+	point.mShininess = sphere.shininess;
 }
 
-int loadScene(char *argv)
-{
-	FILE * file = fopen(argv,"r");
-	int number_of_objects;
-	char type[50];
-	Triangle t;
-	Sphere s;
-	Light l;
-	fscanf(file,"%i", &number_of_objects);
+// Shading point on a triangle--the normal and the material are interpolated from the corners
+void describeTriangleHit (const MeshTriangle& triangle, const Vector3& intersection, ShadingPoint& point) {
 
-	printf("number of objects: %i\n",number_of_objects);
+	describeHitPoint (intersection, point);
 
-	parse_doubles(file,"amb:",ambient_light);
+	// Look up the shared corners of the triangle
+	const MeshVertex& cornerA = vertices[triangle.v[0]];
+	const MeshVertex& cornerB = vertices[triangle.v[1]];
+	const MeshVertex& cornerC = vertices[triangle.v[2]];
+	const TriangleMaterial& corners = triangleMaterials[triangle.material];
+	const Material& materialA = materials[corners.v[0]];
+	const Material& materialB = materials[corners.v[1]];
+	const Material& materialC = materials[corners.v[2]];
 
-	for(int i=0; i<number_of_objects; i++)
-	{
-		fscanf(file,"%s\n",type);
-		printf("%s\n",type);
-		if(strcasecmp(type,"triangle")==0)
-		{
-			printf("found triangle\n");
-			for(int j=0;j < 3;j++)
-			{
-				parse_doubles(file,"pos:",t.v[j].position);
-				parse_doubles(file,"nor:",t.v[j].normal);
-				parse_doubles(file,"dif:",t.v[j].color_diffuse);
-				parse_doubles(file,"spe:",t.v[j].color_specular);
-				parse_shi(file,&t.v[j].shininess);
-			}
+	// To compute the normal, the barycentric coordinates need to be computed
+	Vector3 vertexA (cornerA.position[0], cornerA.position[1], cornerA.position[2]);
+	Vector3 vertexB (cornerB.position[0], cornerB.position[1], cornerB.position[2]);
+	Vector3 vertexC (cornerC.position[0], cornerC.position[1], cornerC.position[2]);
 
-			if(num_triangles == MAX_TRIANGLES)
-			{
-				printf("too many triangles, you should increase MAX_TRIANGLES!\n");
-				exit(0);
-			}
-			triangles[num_triangles++] = t;
-		}
-		else if(strcasecmp(type,"sphere")==0)
-		{
-			printf("found sphere\n");
+	// Compute planar normal
+	Vector3 vAvB = vertexB - vertexA;
+	Vector3 vAvC = vertexC - vertexA;
 
-			parse_doubles(file,"pos:",s.position);
-			parse_rad(file,&s.radius);
-			parse_doubles(file,"dif:",s.color_diffuse);
-			parse_doubles(file,"spe:",s.color_specular);
-			parse_shi(file,&s.shininess);
+	Vector3 planar = Vector3::cross (vAvB, vAvC);
+	float denominator = planar.dot(planar);
 
-			if(num_spheres == MAX_SPHERES)
-			{
-				printf("too many spheres, you should increase MAX_SPHERES!\n");
-				exit(0);
-			}
-			spheres[num_spheres++] = s;
-		}
-		else if(strcasecmp(type,"light")==0)
-		{
-			printf("found light\n");
-			parse_doubles(file,"pos:",l.position);
-			parse_doubles(file,"col:",l.color);
+	// Compute values u and v
+	Vector3 edgeCB = vertexC - vertexB;
+	Vector3 distB = intersection - vertexB;
+	Vector3 cpCB = Vector3::cross(edgeCB, distB);
 
-			if(num_lights == MAX_LIGHTS)
-			{
-				printf("too many lights, you should increase MAX_LIGHTS!\n");
-				exit(0);
-			}
-			lights[num_lights++] = l;
-		}
-		else
-		{
-			printf("unknown type in scene description:\n%s\n",type);
-			exit(0);
-		}
+	Vector3 edgeAC = vertexA - vertexC;
+	Vector3 distC = intersection - vertexC;
+	Vector3 cpAC = Vector3::cross(edgeAC, distC);
+
+	// Compute final u, v, and w values -- these are the barycentric coordinates
+	Real u = planar.dot(cpCB) / denominator;	// Alpha
+	Real v = planar.dot(cpAC) / denominator;	// Beta
+	Real w = 1.0f - u - v;					// Gamma
+
+	// Get triangle normals
+	point.mNormal = Vector3 (
+		u * cornerA.normal[0] + v * cornerB.normal[0] + w * cornerC.normal[0],
+		u * cornerA.normal[1] + v * cornerB.normal[1] + w * cornerC.normal[1],
+		u * cornerA.normal[2] + v * cornerB.normal[2] + w * cornerC.normal[2]
+	);
+	point.mNormal.normalize ();
+
+	// Get the base diffuse, specular, and shininess values from the triangle's materials
+	for (int c = 0; c < 3; c++) {
+		point.mDiffuse[c] = u * materialA.color_diffuse[c] + v * materialB.color_diffuse[c] + w * materialC.color_diffuse[c];
+		point.mSpecular[c] = u * materialA.color_specular[c] + v * materialB.color_specular[c] + w * materialC.color_specular[c];
 	}
-	return 0;
+	point.mShininess = u * materialA.shininess + v * materialB.shininess + w * materialC.shininess;
 }
 
-/*************************************************************/
-// Callbacks
-/*************************************************************/
-void display()
-{
-}
+// Phong term of one light at a shading point
+inline Color shadeLightAt (const ShadingPoint& point, const Real position[3], const Real color[3]) {
 
-void init()
-{
-	glMatrixMode(GL_PROJECTION);
-	glOrtho(0,WIDTH,0,HEIGHT,1,-1);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+	// Get normalized light direction vector
+	Vector3 lightDirection = Vector3 (position[0], position[1], position[2]) - point.mPosition;
+	lightDirection.normalize ();
 
-	// Clear to white
-	glClearColor(0,0,0,0);
-	glClear(GL_COLOR_BUFFER_BIT);
+	// Compute and clamp the values of the magnitudes of LdotN (light magnitude) and (2 * l (n - dir)) * direction (the reflection magnitude)
+	Real lightMagnitude = computeLightMagnitude (lightDirection, point.mNormal);
+	Real reflectionMagnitude = computeReflectionMagnitudeTowards (lightMagnitude, lightDirection, point.mToEye, point.mNormal);
+	Real highlight = std::pow (reflectionMagnitude, point.mShininess);
+
+	// Compute intensity for each color using the Phong equation
+	Real r = color[0] * (point.mDiffuse[0] * lightMagnitude + (point.mSpecular[0] * highlight));
+	Real g = color[1] * (point.mDiffuse[1] * lightMagnitude + (point.mSpecular[1] * highlight));
+	Real b = color[2] * (point.mDiffuse[2] * lightMagnitude + (point.mSpecular[2] * highlight));
+	return Color (r, g, b);
 }
 
-void idle()
-{
-	//hack to make it only draw once
-	static int once=0;
-	if(!once)
-	{
-		draw_scene();
-		if(mode == MODE_JPEG)
-			save_jpg();
-	}
-	once=1;
+// Calculate the lighting (and color) of a point on the sphere
+Color calculateSphereLighting (const Sphere& sphere, const Light& light, const Vector3& intersection) {
+	ShadingPoint point;
+	describeSphereHit (sphere, intersection, point);
+	return shadeLightAt (point, light.position, light.color);
+}
+
+// Calculate the lighting (and color) of a point on the triangle
+Color calculateTriangleLighting (const MeshTriangle& triangle, const Light& light, const Vector3& intersection) {
+	ShadingPoint point;
+	describeTriangleHit (triangle, intersection, point);
+	return shadeLightAt (point, light.position, light.color);
 }
 
 /*************************************************************/
-// Main Function
+// Light Batches
 /*************************************************************/
-int main(int argc, char ** argv)
+// The lights in structure-of-arrays form, so the Phong terms of several lights can be evaluated side by side. Built
+// from lights[] after loading.
+struct LightArrays {
+	std::vector<Real> mX, mY, mZ;
+	std::vector<Real> mR, mG, mB;
+};
+
+LightArrays gLightArrays;
+
+// Picked at startup, like the packet kernel
+bool gLightBatchAVX2 = false;
+
+void buildLightArrays () {
+
+	std::vector<Real>* arrays[] = { &gLightArrays.mX, &gLightArrays.mY, &gLightArrays.mZ, &gLightArrays.mR, &gLightArrays.mG, &gLightArrays.mB };
+	for (int i = 0; i < 6; i++) {
+		arrays[i]->resize (lights.getSize ());
+	}
+
+	for (int j = 0; j < lights.getSize (); j++) {
+		gLightArrays.mX[j] = lights[j].position[0];
+		gLightArrays.mY[j] = lights[j].position[1];
+		gLightArrays.mZ[j] = lights[j].position[2];
+		gLightArrays.mR[j] = lights[j].color[0];
+		gLightArrays.mG[j] = lights[j].color[1];
+		gLightArrays.mB[j] = lights[j].color[2];
+	}
+}
+
+// Add up the lights lit[begin, count) one at a time
+void shadeLightBatchScalar (const ShadingPoint& point, const int* lit, int begin, int count, Color& retVal) {
+	for (int i = begin; i < count; i++) {
+		int j = lit[i];
+		Real position[3] = { gLightArrays.mX[j], gLightArrays.mY[j], gLightArrays.mZ[j] };
+		Real color[3] = { gLightArrays.mR[j], gLightArrays.mG[j], gLightArrays.mB[j] };
+		retVal += shadeLightAt (point, position, color);
+	}
+}
+
+#ifdef HW3_HAS_AVX2_KERNEL
+// Vector3::normalize for four vectors
+HW3_TARGET_AVX2 static inline void normalizeAVX2 (Lanes& x, Lanes& y, Lanes& z) {
+	Lanes length = LANES_ADD (LANES_ADD (LANES_MUL (x, x), LANES_MUL (y, y)), LANES_MUL (z, z));
+	Lanes inverse = LANES_DIV (LANES_SET1 (1.0), LANES_SQRT (length));
+	Lanes nonzero = LANES_CMP (length, LANES_ZERO (), _CMP_GT_OQ);
+	x = LANES_BLEND (x, LANES_MUL (x, inverse), nonzero);
+	y = LANES_BLEND (y, LANES_MUL (y, inverse), nonzero);
+	z = LANES_BLEND (z, LANES_MUL (z, inverse), nonzero);
+}
+
+// The clamp of computeLightMagnitude, compare for compare, so NaNs and signed zeros come out the same
+HW3_TARGET_AVX2 static inline Lanes clampUnitAVX2 (Lanes x) {
+	x = LANES_BLEND (x, LANES_SET1 (1.0), LANES_CMP (x, LANES_SET1 (1.0), _CMP_GT_OQ));
+	return LANES_BLEND (x, LANES_ZERO (), LANES_CMP (x, LANES_ZERO (), _CMP_LT_OQ));
+}
+
+// One field of four lights. Plain loads are as fast as the AVX2 gather on most CPUs.
+HW3_TARGET_AVX2 static inline Lanes gatherLightsAVX2 (const std::vector<Real>& field, const int* lit) {
+	return LANES_SET (field[lit[3]], field[lit[2]], field[lit[1]], field[lit[0]]);
+}
+
+// Four lights per step. Every lane repeats shadeLightAt operation for operation (no FMA contraction), so the terms are
+// bit for bit the scalar ones, and they are added up in the same order. std::pow has no vector form that rounds the
+// same, so the highlights are raised per lane.
+HW3_TARGET_AVX2 static void shadeLightBatchAVX2 (const ShadingPoint& point, const int* lit, int count, Color& retVal) {
+
+	const int LANES = 4;
+	Lanes positionX = LANES_SET1 (point.mPosition.mX);
+	Lanes positionY = LANES_SET1 (point.mPosition.mY);
+	Lanes positionZ = LANES_SET1 (point.mPosition.mZ);
+	Lanes normalX = LANES_SET1 (point.mNormal.mX);
+	Lanes normalY = LANES_SET1 (point.mNormal.mY);
+	Lanes normalZ = LANES_SET1 (point.mNormal.mZ);
+	Lanes eyeX = LANES_SET1 (point.mToEye.mX);
+	Lanes eyeY = LANES_SET1 (point.mToEye.mY);
+	Lanes eyeZ = LANES_SET1 (point.mToEye.mZ);
+	Lanes two = LANES_SET1 (2.0);
+
+	int i = 0;
+	for (; i + LANES <= count; i += LANES) {
+
+		// Light directions
+		Lanes lightX = LANES_SUB (gatherLightsAVX2 (gLightArrays.mX, &lit[i]), positionX);
+		Lanes lightY = LANES_SUB (gatherLightsAVX2 (gLightArrays.mY, &lit[i]), positionY);
+		Lanes lightZ = LANES_SUB (gatherLightsAVX2 (gLightArrays.mZ, &lit[i]), positionZ);
+		normalizeAVX2 (lightX, lightY, lightZ);
+
+		// N.L
+		Lanes lightMagnitude = clampUnitAVX2 (LANES_ADD (LANES_ADD (LANES_MUL (lightX, normalX), LANES_MUL (lightY, normalY)), LANES_MUL (lightZ, normalZ)));
+
+		// R.V
+		Lanes twice = LANES_MUL (two, lightMagnitude);
+		Lanes reflectionX = LANES_SUB (LANES_MUL (twice, normalX), lightX);
+		Lanes reflectionY = LANES_SUB (LANES_MUL (twice, normalY), lightY);
+		Lanes reflectionZ = LANES_SUB (LANES_MUL (twice, normalZ), lightZ);
+		normalizeAVX2 (reflectionX, reflectionY, reflectionZ);
+		Lanes reflectionMagnitude = clampUnitAVX2 (LANES_ADD (LANES_ADD (LANES_MUL (reflectionX, eyeX), LANES_MUL (reflectionY, eyeY)), LANES_MUL (reflectionZ, eyeZ)));
+
+		Real highlights[LANES];
+		LANES_STORE (highlights, reflectionMagnitude);
+		for (int lane = 0; lane < LANES; lane++) {
+			highlights[lane] = std::pow (highlights[lane], point.mShininess);
+		}
+		Lanes highlight = LANES_LOAD (highlights);
+
+		// Phong
+		Lanes r = LANES_ADD (LANES_MUL (LANES_SET1 (point.mDiffuse[0]), lightMagnitude), LANES_MUL (LANES_SET1 (point.mSpecular[0]), highlight));
+		Lanes g = LANES_ADD (LANES_MUL (LANES_SET1 (point.mDiffuse[1]), lightMagnitude), LANES_MUL (LANES_SET1 (point.mSpecular[1]), highlight));
+		Lanes b = LANES_ADD (LANES_MUL (LANES_SET1 (point.mDiffuse[2]), lightMagnitude), LANES_MUL (LANES_SET1 (point.mSpecular[2]), highlight));
+		Real shadeR[LANES], shadeG[LANES], shadeB[LANES];
+		LANES_STORE (shadeR, LANES_MUL (gatherLightsAVX2 (gLightArrays.mR, &lit[i]), r));
+		LANES_STORE (shadeG, LANES_MUL (gatherLightsAVX2 (gLightArrays.mG, &lit[i]), g));
+		LANES_STORE (shadeB, LANES_MUL (gatherLightsAVX2 (gLightArrays.mB, &lit[i]), b));
+		for (int lane = 0; lane < LANES; lane++) {
+			retVal += Color (shadeR[lane], shadeG[lane], shadeB[lane]);
+		}
+	}
+
+	// Leftover lights
+	shadeLightBatchScalar (point, lit, i, count, retVal);
+}
+#endif
+
+// Add the lights lit[0, count) to retVal, clamping after each as Color does
+void shadeLightBatch (const ShadingPoint& point, const int* lit, int count, Color& retVal) {
+
+#ifdef HW3_HAS_AVX2_KERNEL
+	if (gLightBatchAVX2) {
+		shadeLightBatchAVX2 (point, lit, count, retVal);
+		return;
+	}
+#endif
+
+	shadeLightBatchScalar (point, lit, 0, count, retVal);
+}
+
+/*************************************************************/
+// Raytracing
+/*************************************************************/
+// Primitive types a tracing function has to look at. The generic path handles every scene (GEOMETRY_MIXED); the
+// specialized render kernels are compiled for scenes with only one type and leave the other out entirely.
+enum SceneGeometry {
+	GEOMETRY_MIXED,
+	GEOMETRY_SPHERES,
+	GEOMETRY_TRIANGLES
+};
+
+// Check whether anything lies between a surface point and a light. The object the shadow ray starts on is ignored.
+template <int Geometry = GEOMETRY_MIXED>
+bool isShadowed (const Ray& shadow, Real lightDistance, int light, int ignoreSphere, int ignoreTriangle, RenderContext& context) {
+
+	const bool hasSpheres = (Geometry != GEOMETRY_TRIANGLES);
+	const bool hasTriangles = (Geometry != GEOMETRY_SPHERES);
+	context.mShadowStats.mRays++;
+	COUNT_COST (mShadowRays, 1);
+
+	// Try whatever blocked this light last time first
+	Occluder& cached = context.mLastOccluder[light];
+	if ((hasSpheres && cached.mSphere >= 0 && cached.mSphere != ignoreSphere && shadow.occludedBy (spheres[cached.mSphere], lightDistance))
+		|| (hasTriangles && cached.mTriangle >= 0 && cached.mTriangle != ignoreTriangle && shadow.occludedBy (gTriangleRecords[cached.mTriangle], lightDistance))) {
+		context.mShadowStats.mCacheHits++;
+		return true;
+	}
+
+	int index;
+	if (hasSpheres && gSphereBVH.anyHit (shadow, spheres.getData (), lightDistance, ignoreSphere, index, context.mShadowStats)) {
+		cached.mSphere = index;
+		cached.mTriangle = -1;
+		return true;
+	}
+
+	if (hasTriangles && gTriangleBVH.anyHit (shadow, gTriangleRecords.data (), lightDistance, ignoreTriangle, index, context.mShadowStats)) {
+		cached.mSphere = -1;
+		cached.mTriangle = index;
+		return true;
+	}
+
+	return false;
+}
+
+// Nearest intersection along a ray. Exactly one of mSphere and mTriangle is set for a hit.
+struct Hit {
+	int mSphere;
+	int mTriangle;
+	Real mT;
+	Vector3 mPosition;
+
+	Hit () : mSphere (-1), mTriangle (-1), mT (1e30) {}
+
+	inline bool isHit () const { return mSphere >= 0 || mTriangle >= 0; }
+};
+
+// Visibility pass--find the single nearest intersection by ray parameter across spheres and triangles
+template <int Geometry = GEOMETRY_MIXED>
+bool findClosestHit (const Ray& ray, Hit& hit, RenderContext& context) {
+
+	int index;
+	Real t;
+	if (Geometry != GEOMETRY_TRIANGLES && gSphereBVH.closestHit (ray, spheres.getData (), hit.mT, index, t, context.mPrimaryStats)) {
+		hit.mSphere = index;
+		hit.mT = t;
+	}
+
+	// Only triangles in front of the nearest sphere are of interest
+	if (Geometry != GEOMETRY_SPHERES && gTriangleBVH.closestHit (ray, gTriangleRecords.data (), hit.mT, index, t, context.mPrimaryStats)) {
+		hit.mSphere = -1;
+		hit.mTriangle = index;
+		hit.mT = t;
+	}
+
+	if (!hit.isHit ()) {
+		return false;
+	}
+
+	hit.mPosition = ray.getOrigin () + (ray.getDirection () * hit.mT);
+	return true;
+}
+
+/*************************************************************/
+// Many-light Shading
+/*************************************************************/
+// The shading point of a hit
+template <int Geometry = GEOMETRY_MIXED>
+void describeShadingPoint (const Hit& hit, ShadingPoint& point) {
+	if (Geometry == GEOMETRY_SPHERES || (Geometry == GEOMETRY_MIXED && hit.mSphere >= 0)) {
+		describeSphereHit (spheres[hit.mSphere], hit.mPosition, point);
+	}
+
+	else {
+		describeTriangleHit (triangles[hit.mTriangle], hit.mPosition, point);
+	}
+}
+
+// Largest contribution that lights inside bounds with the given total color could make at a point: the best N.L towards
+// the box, plus a full specular highlight. The lights have no falloff, so distance doesn't tighten the bound.
+Real lightBound (const Real total[3], const AABB& bounds, const ShadingPoint& point) {
+
+	const Vector3& position = point.mPosition;
+	const Vector3& normal = point.mNormal;
+
+	// N.(x - p) is linear in x, so over the box it peaks at the corner the normal points towards. Dividing by the
+	// distance to the nearest point of the box bounds the cosine.
+	Vector3 corner ((normal.mX > 0) ? bounds.mMax.mX : bounds.mMin.mX, (normal.mY > 0) ? bounds.mMax.mY : bounds.mMin.mY,
+		(normal.mZ > 0) ? bounds.mMax.mZ : bounds.mMin.mZ);
+	Real highest = normal.dot (corner - position);
+	Real cosine = 0;
+	if (highest > 0) {
+		Vector3 nearest = Vector3::min (Vector3::max (position, bounds.mMin), bounds.mMax);
+		Real distance = (nearest - position).magnitude ();
+		cosine = (distance > 0) ? std::min ((Real)1, highest / distance) : 1;
+	}
+
+	Real bound = 0;
+	for (int c = 0; c < 3; c++) {
+		bound = std::max (bound, total[c] * (point.mDiffuse[c] * cosine + point.mSpecular[c]));
+	}
+	return bound;
+}
+
+// Hash a surface point, a sample and a tree level to a number in [0, 1). Only the point decides, so the lights chosen
+// don't depend on the thread or the order pixels are rendered in.
+double shadingRandom (const Vector3& position, unsigned int sample, unsigned int level) {
+
+	unsigned long long bits[3] = { 0, 0, 0 };
+	memcpy (&bits[0], &position.mX, sizeof (Real));
+	memcpy (&bits[1], &position.mY, sizeof (Real));
+	memcpy (&bits[2], &position.mZ, sizeof (Real));
+	unsigned int hash = (unsigned int)(bits[0] ^ (bits[0] >> 32)) * 0x8da6b343u ^ (unsigned int)(bits[1] ^ (bits[1] >> 32)) * 0xd8163841u
+		^ (unsigned int)(bits[2] ^ (bits[2] >> 32)) * 0xcb1ab31fu ^ (sample * 64 + level) * 0x9e3779b9u;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352du;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bu;
+	hash ^= hash >> 16;
+	return (hash >> 8) * (1.0 / 16777216.0);
+}
+
+// Fire a shadow ray at one light and, if it gets through, add its Phong term as if the light had the given color,
+// times scale. Returns whether the light reaches the point.
+bool shadeLight (const Hit& hit, const ShadingPoint& point, int index, const Real color[3], double scale, RenderContext& context, double sum[3], unsigned int* litLights) {
+
+	const Light& light = lights[index];
+	Vector3 lightPosition (light.position[0], light.position[1], light.position[2]);
+	Vector3 direction = lightPosition - hit.mPosition;
+	Real lightDistance = direction.magnitude ();
+	Ray shadow (hit.mPosition, direction.normalize ());
+	if (isShadowed (shadow, lightDistance, index, hit.mSphere, hit.mTriangle, context)) {
+		return false;
+	}
+
+	if (litLights != NULL) {
+		*litLights = *litLights * 31 + index + 1;
+	}
+
+	COUNT_COST (mShadingEvaluations, 1);
+	Color shade = shadeLightAt (point, light.position, color);
+	sum[0] += shade.mR * scale;
+	sum[1] += shade.mG * scale;
+	sum[2] += shade.mB * scale;
+	return true;
+}
+
+// --light-tree: refine a cut through the tree, always splitting the cluster that could contribute most, until it holds
+// gLightCut clusters or nothing but single lights. Each cluster then costs one shadow ray, to its representative.
+void shadeLightCut (const Hit& hit, const ShadingPoint& point, RenderContext& context, double sum[3], unsigned int* litLights) {
+
+	int cut[LIGHT_CUT_MAX];
+	Real bounds[LIGHT_CUT_MAX];
+	int size = 1;
+	cut[0] = 0;
+	bounds[0] = lightBound (gLightTree[0].mTotal, gLightTree[0].mBounds, point);
+
+	unsigned int limit = std::min (gLightCut, LIGHT_CUT_MAX);
+	while ((unsigned int)size < limit) {
+		int largest = -1;
+		for (int i = 0; i < size; i++) {
+			if (gLightTree[cut[i]].mSecond >= 0 && bounds[i] > 0 && bounds[i] >= gLightCull && (largest < 0 || bounds[i] > bounds[largest])) {
+				largest = i;
+			}
+		}
+		if (largest < 0) {
+			break;
+		}
+
+		int node = cut[largest];
+		int second = gLightTree[node].mSecond;
+		cut[largest] = node + 1;
+		bounds[largest] = lightBound (gLightTree[node + 1].mTotal, gLightTree[node + 1].mBounds, point);
+		cut[size] = second;
+		bounds[size++] = lightBound (gLightTree[second].mTotal, gLightTree[second].mBounds, point);
+	}
+
+	for (int i = 0; i < size; i++) {
+		if (bounds[i] > 0 && bounds[i] >= gLightCull) {
+			const LightNode& node = gLightTree[cut[i]];
+			shadeLight (hit, point, node.mRepresentative, node.mTotal, 1.0, context, sum, litLights);
+		}
+	}
+}
+
+// --light-samples: trace gLightSamples shadow rays to lights picked by walking down the tree, taking each child with
+// probability proportional to its bound, and weight each by the inverse of the probability of picking its light
+void shadeLightSamples (const Hit& hit, const ShadingPoint& point, RenderContext& context, double sum[3], unsigned int* litLights) {
+
+	for (unsigned int k = 0; k < gLightSamples; k++) {
+		int node = 0;
+		double probability = 1;
+		unsigned int level = 0;
+		while (node >= 0 && gLightTree[node].mSecond >= 0) {
+			int first = node + 1;
+			int second = gLightTree[node].mSecond;
+			Real a = lightBound (gLightTree[first].mTotal, gLightTree[first].mBounds, point);
+			Real b = lightBound (gLightTree[second].mTotal, gLightTree[second].mBounds, point);
+			a = (a < gLightCull) ? 0 : a;
+			b = (b < gLightCull) ? 0 : b;
+			if (a + b <= 0) {
+				node = -1;
+				break;
+			}
+
+			if (shadingRandom (point.mPosition, k, level++) * (a + b) < a) {
+				node = first;
+				probability *= a / (a + b);
+			}
+
+			else {
+				node = second;
+				probability *= b / (a + b);
+			}
+		}
+
+		if (node >= 0) {
+			const LightNode& leaf = gLightTree[node];
+			shadeLight (hit, point, leaf.mRepresentative, leaf.mTotal, 1.0 / (probability * gLightSamples), context, sum, litLights);
+		}
+	}
+}
+
+Color shadeHitManyLights (const Hit& hit, RenderContext& context, unsigned int* litLights) {
+
+	ShadingPoint point;
+	describeShadingPoint (hit, point);
+
+	double sum[3] = { 0, 0, 0 };
+	if (!gLightTree.empty ()) {
+		// A lone light gets its exact shadow ray; sampling it repeatedly would only cost more rays
+		if (gLightSamples > 0 && gLightTree[0].mSecond >= 0) {
+			shadeLightSamples (hit, point, context, sum, litLights);
+		}
+
+		else {
+			shadeLightCut (hit, point, context, sum, litLights);
+		}
+	}
+
+	// Adding to black clamps the sum, as adding the lights one by one would
+	Color retVal (0, 0, 0);
+	retVal += Color (sum[0], sum[1], sum[2]);
+	return retVal;
+}
+
+// Shading pass--fire one shadow ray per light from the hit point and add up the lights that reach it
+// If litLights is given, it receives a signature of the set of lights that reach the hit point.
+Color shadeHit (const Hit& hit, RenderContext& context, unsigned int* litLights = NULL) {
+
+	if (isManyLightShading ()) {
+		return shadeHitManyLights (hit, context, litLights);
+	}
+
+	// By default, the color should be black
+	Color retVal (0, 0, 0);
+
+	// The normal and material are the same for every light, so they are interpolated once
+	ShadingPoint point;
+	describeShadingPoint (hit, point);
+
+	// Check to see if the object is shadowed--if it isn't, queue the light to be shaded
+	std::vector<int>& lit = context.mLitLights;
+	lit.clear ();
+	for (int j = 0; j < lights.getSize (); j++) {
+
+		// Get the position of the light
+		Vector3 lightPosition (lights[j].position[0], lights[j].position[1], lights[j].position[2]);
+
+		// Skip lights too dim to matter here (--light-cull)
+		if (gLightCull > 0 && lightBound (lights[j].color, AABB (lightPosition, lightPosition), point) < gLightCull) {
+			continue;
+		}
+
+		// Create the shadow ray--the origin should be the point where the ray intersected with the object, and the direction should be the normalized direction to the light
+		Vector3 origin = hit.mPosition;
+		Vector3 direction = lightPosition - origin;
+		Real lightDistance = direction.magnitude ();
+		Ray shadow (origin, direction.normalize ());
+
+		// If the object is lit, add color to it--ignoring our own object
+		if (!isShadowed (shadow, lightDistance, j, hit.mSphere, hit.mTriangle, context)) {
+			if (litLights != NULL) {
+				*litLights = *litLights * 31 + j + 1;
+			}
+
+			COUNT_COST (mShadingEvaluations, 1);
+			lit.push_back (j);
+		}
+	}
+
+	// Add the color of every light that reaches the point
+	if (!lit.empty ()) {
+		shadeLightBatch (point, &lit[0], (int)lit.size (), retVal);
+	}
+
+	return retVal;
+}
+
+// Color of a primary sample, given the result of its visibility pass
+Color shadeSample (const Hit& hit, RenderContext& context, unsigned int* litLights = NULL) {
+
+	// If there are no triangles or spheres along the ray, the pixel is white
+	Color retVal (1, 1, 1);
+	if (hit.isHit ()) {
+		retVal = shadeHit (hit, context, litLights);
+	}
+
+	// Add ambient light
+	retVal += Color (ambient_light[0], ambient_light[1], ambient_light[2]);
+	return retVal;
+}
+
+// Perfrom a raycast to determine a pixel's color
+Color trace (Ray& ray, RenderContext& context) {
+	
+	// Find the nearest object first, then shade only that one
+	context.mPrimaryStats.mRays++;
+	COUNT_COST (mPrimaryRays, 1);
+	Hit hit;
+	findClosestHit (ray, hit, context);
+	return shadeSample (hit, context);
+}
+
+/*************************************************************/
+// Packet Tracing
+/*************************************************************/
+// Primary rays through neighbouring pixels (or the SSAA samples of one pixel) take nearly the same path through the
+// hierarchy, so they are traced together: four rays share every node visit, and each box and primitive test runs on all
+// four at once. Shading still happens one sample at a time.
+const int PACKET_SIZE = 4;
+
+// Packet tracing is opt-in (--packets). The AVX2 kernel is picked at startup when the CPU supports it; otherwise the
+// packet falls back to four scalar queries. --no-simd forces the fallback.
+bool gUsePackets = false;
+bool gPacketAVX2 = false;
+
+#ifdef HW3_HAS_AVX2_KERNEL
+// The rays of a packet in structure-of-arrays form, one ray per lane. The lane arithmetic below repeats the scalar
+// tests operation for operation (no FMA contraction), so packets find exactly the same hits as single rays.
+struct PacketAVX2 {
+	Lanes mOriginX, mOriginY, mOriginZ;
+	Lanes mDirectionX, mDirectionY, mDirectionZ;
+	Lanes mInverseX, mInverseY, mInverseZ;
+};
+
+HW3_TARGET_AVX2 static inline Lanes absAVX2 (Lanes x) {
+	return LANES_ANDNOT (LANES_SET1 (-0.0), x);
+}
+
+HW3_TARGET_AVX2 static inline Real minLaneAVX2 (Lanes x) {
+	Real lanes[PACKET_SIZE];
+	LANES_STORE (lanes, x);
+	return std::min (std::min (lanes[0], lanes[1]), std::min (lanes[2], lanes[3]));
+}
+
+// One slab of AABB::intersects for every lane
+HW3_TARGET_AVX2 static inline void slabAVX2 (Real min, Real max, Lanes origin, Lanes inverse, Lanes& tNear, Lanes& tFar) {
+	Lanes t0 = LANES_MUL (LANES_SUB (LANES_SET1 (min), origin), inverse);
+	Lanes t1 = LANES_MUL (LANES_SUB (LANES_SET1 (max), origin), inverse);
+	Lanes swap = LANES_CMP (t0, t1, _CMP_GT_OQ);
+	Lanes low = LANES_BLEND (t0, t1, swap);
+	Lanes high = LANES_BLEND (t1, t0, swap);
+	tNear = LANES_BLEND (tNear, low, LANES_CMP (low, tNear, _CMP_GT_OQ));
+	tFar = LANES_BLEND (tFar, high, LANES_CMP (high, tFar, _CMP_LT_OQ));
+}
+
+// Slab test for the packet. Lanes that miss the box get an entry distance of infinity.
+HW3_TARGET_AVX2 static inline Lanes intersectBoxAVX2 (const AABB& box, const PacketAVX2& packet, Lanes tMax) {
+	Lanes tNear = LANES_SET1 (-1e30);
+	Lanes tFar = tMax;
+	slabAVX2 (box.mMin.mX, box.mMax.mX, packet.mOriginX, packet.mInverseX, tNear, tFar);
+	slabAVX2 (box.mMin.mY, box.mMax.mY, packet.mOriginY, packet.mInverseY, tNear, tFar);
+	slabAVX2 (box.mMin.mZ, box.mMax.mZ, packet.mOriginZ, packet.mInverseZ, tNear, tFar);
+	Lanes hit = LANES_AND (LANES_CMP (tNear, tFar, _CMP_LE_OQ), LANES_CMP (tFar, LANES_ZERO (), _CMP_GE_OQ));
+	return LANES_BLEND (LANES_SET1 (HUGE_VAL), tNear, hit);
+}
+
+// Keep the lanes' closest hits up to date with a new candidate. Ties go to the lower index, as in BVH::closestHit.
+// Indices ride along as Reals, which float builds hold exactly up to 2^24 primitives.
+HW3_TARGET_AVX2 static inline void updateClosestAVX2 (Lanes valid, Lanes t, Real index, Lanes& closest, Lanes& closestIndex) {
+	Lanes primitive = LANES_SET1 (index);
+	Lanes closer = LANES_OR (LANES_CMP (t, closest, _CMP_LT_OQ),
+		LANES_AND (LANES_CMP (t, closest, _CMP_EQ_OQ), LANES_CMP (primitive, closestIndex, _CMP_LT_OQ)));
+	Lanes update = LANES_AND (valid, closer);
+	closest = LANES_BLEND (closest, t, update);
+	closestIndex = LANES_BLEND (closestIndex, primitive, update);
+}
+
+// Ray::intersects (const Sphere&, Real&) for every lane
+HW3_TARGET_AVX2 static inline void intersectAVX2 (const Sphere& sphere, Real index, const PacketAVX2& packet, Lanes& closest, Lanes& closestIndex) {
+
+	Lanes zero = LANES_ZERO ();
+	Lanes distX = LANES_SUB (packet.mOriginX, LANES_SET1 (sphere.position[0]));
+	Lanes distY = LANES_SUB (packet.mOriginY, LANES_SET1 (sphere.position[1]));
+	Lanes distZ = LANES_SUB (packet.mOriginZ, LANES_SET1 (sphere.position[2]));
+
+	Lanes a = LANES_ADD (LANES_ADD (LANES_MUL (packet.mDirectionX, packet.mDirectionX), LANES_MUL (packet.mDirectionY, packet.mDirectionY)), LANES_MUL (packet.mDirectionZ, packet.mDirectionZ));
+	Lanes b = LANES_MUL (LANES_SET1 (2.0), LANES_ADD (LANES_ADD (LANES_MUL (packet.mDirectionX, distX), LANES_MUL (packet.mDirectionY, distY)), LANES_MUL (packet.mDirectionZ, distZ)));
+	Lanes c = LANES_SUB (LANES_ADD (LANES_ADD (LANES_MUL (distX, distX), LANES_MUL (distY, distY)), LANES_MUL (distZ, distZ)), LANES_SET1 (sphere.radius * sphere.radius));
+	Lanes quad = LANES_SUB (LANES_MUL (b, b), LANES_MUL (LANES_MUL (LANES_SET1 (4.0), a), c));
+	Lanes valid = LANES_CMP (quad, zero, _CMP_NLT_UQ);
+
+	// Both branches of the scalar root computation, blended per lane
+	Lanes half = LANES_SET1 (-0.5);
+	Lanes root = LANES_SQRT (quad);
+	Lanes q = LANES_BLEND (LANES_MUL (half, LANES_SUB (b, root)), LANES_MUL (half, LANES_ADD (b, root)), LANES_CMP (b, zero, _CMP_GT_OQ));
+	Lanes t0 = LANES_DIV (q, a);
+	Lanes t1 = LANES_DIV (c, q);
+	Lanes tangent = LANES_CMP (absAVX2 (quad), LANES_SET1 (BIAS), _CMP_LT_OQ);
+	Lanes qTangent = LANES_DIV (LANES_MUL (half, b), a);
+	t0 = LANES_BLEND (t0, qTangent, tangent);
+	t1 = LANES_BLEND (t1, qTangent, tangent);
+
+	// Both roots behind the origin is a miss; otherwise take the nearest root in front of it
+	valid = LANES_ANDNOT (LANES_AND (LANES_CMP (t0, zero, _CMP_LT_OQ), LANES_CMP (t1, zero, _CMP_LT_OQ)), valid);
+	Lanes useT1 = LANES_OR (LANES_CMP (t0, zero, _CMP_LT_OQ), LANES_AND (LANES_CMP (t1, zero, _CMP_GE_OQ), LANES_CMP (t1, t0, _CMP_LT_OQ)));
+	Lanes t = LANES_BLEND (t0, t1, useT1);
+
+	COUNT_COST (mIntersectionTests, PACKET_SIZE);
+	COUNT_COST (mHits, __builtin_popcount (LANES_MASK (valid)));
+	updateClosestAVX2 (valid, t, index, closest, closestIndex);
+}
+
+// Ray::intersectsTriangle (const TriangleRecord&, ...) for every lane
+HW3_TARGET_AVX2 static inline void intersectAVX2 (const TriangleRecord& triangle, Real index, const PacketAVX2& packet, Lanes& closest, Lanes& closestIndex) {
+
+	Lanes zero = LANES_ZERO ();
+	Lanes one = LANES_SET1 (1.0);
+	Lanes e1X = LANES_SET1 (triangle.mEdge1.mX);
+	Lanes e1Y = LANES_SET1 (triangle.mEdge1.mY);
+	Lanes e1Z = LANES_SET1 (triangle.mEdge1.mZ);
+	Lanes e2X = LANES_SET1 (triangle.mEdge2.mX);
+	Lanes e2Y = LANES_SET1 (triangle.mEdge2.mY);
+	Lanes e2Z = LANES_SET1 (triangle.mEdge2.mZ);
+
+	// p = direction x edge2, determinant = edge1 . p
+	Lanes pX = LANES_SUB (LANES_MUL (packet.mDirectionY, e2Z), LANES_MUL (packet.mDirectionZ, e2Y));
+	Lanes pY = LANES_SUB (LANES_MUL (packet.mDirectionZ, e2X), LANES_MUL (packet.mDirectionX, e2Z));
+	Lanes pZ = LANES_SUB (LANES_MUL (packet.mDirectionX, e2Y), LANES_MUL (packet.mDirectionY, e2X));
+	Lanes determinant = LANES_ADD (LANES_ADD (LANES_MUL (e1X, pX), LANES_MUL (e1Y, pY)), LANES_MUL (e1Z, pZ));
+	Lanes valid = LANES_CMP (absAVX2 (determinant), LANES_SET1 (BIAS), _CMP_NLT_UQ);
+	Lanes inverse = LANES_DIV (one, determinant);
+
+	// u = (origin - vertex) . p / determinant
+	Lanes sX = LANES_SUB (packet.mOriginX, LANES_SET1 (triangle.mVertex.mX));
+	Lanes sY = LANES_SUB (packet.mOriginY, LANES_SET1 (triangle.mVertex.mY));
+	Lanes sZ = LANES_SUB (packet.mOriginZ, LANES_SET1 (triangle.mVertex.mZ));
+	Lanes u = LANES_MUL (LANES_ADD (LANES_ADD (LANES_MUL (sX, pX), LANES_MUL (sY, pY)), LANES_MUL (sZ, pZ)), inverse);
+	valid = LANES_AND (valid, LANES_AND (LANES_CMP (u, zero, _CMP_NLT_UQ), LANES_CMP (u, one, _CMP_NGT_UQ)));
+
+	// q = (origin - vertex) x edge1, v = direction . q / determinant
+	Lanes qX = LANES_SUB (LANES_MUL (sY, e1Z), LANES_MUL (sZ, e1Y));
+	Lanes qY = LANES_SUB (LANES_MUL (sZ, e1X), LANES_MUL (sX, e1Z));
+	Lanes qZ = LANES_SUB (LANES_MUL (sX, e1Y), LANES_MUL (sY, e1X));
+	Lanes v = LANES_MUL (LANES_ADD (LANES_ADD (LANES_MUL (packet.mDirectionX, qX), LANES_MUL (packet.mDirectionY, qY)), LANES_MUL (packet.mDirectionZ, qZ)), inverse);
+	valid = LANES_AND (valid, LANES_AND (LANES_CMP (v, zero, _CMP_NLT_UQ), LANES_CMP (LANES_ADD (u, v), one, _CMP_NGT_UQ)));
+
+	// t = edge2 . q / determinant
+	Lanes t = LANES_MUL (LANES_ADD (LANES_ADD (LANES_MUL (e2X, qX), LANES_MUL (e2Y, qY)), LANES_MUL (e2Z, qZ)), inverse);
+	valid = LANES_AND (valid, LANES_AND (LANES_CMP (t, zero, _CMP_GE_OQ), LANES_CMP (t, LANES_SET1 (HUGE_VAL), _CMP_LT_OQ)));
+
+	COUNT_COST (mIntersectionTests, PACKET_SIZE);
+	COUNT_COST (mHits, __builtin_popcount (LANES_MASK (valid)));
+	updateClosestAVX2 (valid, t, index, closest, closestIndex);
+}
+
+// BVH::closestHit for a whole packet. A node is entered if any lane reaches it before that lane's closest hit, and the
+// child that the packet reaches first is visited first.
+template <typename Primitive>
+HW3_TARGET_AVX2 static void closestHitAVX2 (const BVH& bvh, const Primitive* primitives, const PacketAVX2& packet, Lanes& closest, Lanes& closestIndex, BVHStats& stats) {
+
+	closestIndex = LANES_SET1 (-1.0);
+	if (bvh.getNodeCount () == 0) {
+		return;
+	}
+
+	struct Entry {
+		Lanes mDistance;
+		int mNode;
+	};
+	Entry stack[BVH_STACK_SIZE];
+	int top = 0;
+
+	stats.mNodesVisited++;
+	stack[top].mNode = 0;
+	stack[top++].mDistance = intersectBoxAVX2 (bvh.getNode (0).mBounds, packet, closest);
+
+	while (top > 0) {
+
+		Entry current = stack[--top];
+		if (LANES_MASK (LANES_CMP (current.mDistance, closest, _CMP_LE_OQ)) == 0) {
+			continue;
+		}
+
+		const BVHNode& node = bvh.getNode (current.mNode);
+		if (node.mCount > 0) {
+			for (int i = 0; i < node.mCount; i++) {
+				int primitive = bvh.getPrimitiveIndex (node.mOffset + i);
+				intersectAVX2 (primitives[primitive], primitive, packet, closest, closestIndex);
+			}
+			continue;
+		}
+
+		int first = current.mNode + 1;
+		int second = node.mOffset;
+		stats.mNodesVisited += 2;
+		Lanes firstEntry = intersectBoxAVX2 (bvh.getNode (first).mBounds, packet, closest);
+		Lanes secondEntry = intersectBoxAVX2 (bvh.getNode (second).mBounds, packet, closest);
+		Real firstNearest = minLaneAVX2 (firstEntry);
+		Real secondNearest = minLaneAVX2 (secondEntry);
+
+		// Push the farther child first so the nearer one is popped next
+		if (firstNearest > secondNearest) {
+			std::swap (first, second);
+			std::swap (firstEntry, secondEntry);
+			std::swap (firstNearest, secondNearest);
+		}
+
+		if (secondNearest < HUGE_VAL) {
+			stack[top].mNode = second;
+			stack[top++].mDistance = secondEntry;
+		}
+
+		if (firstNearest < HUGE_VAL) {
+			stack[top].mNode = first;
+			stack[top++].mDistance = firstEntry;
+		}
+	}
+}
+
+// findClosestHit for a packet of rays
+HW3_TARGET_AVX2 static void findClosestHitsAVX2 (const Ray rays[], Hit hits[], RenderContext& context) {
+
+	Real lanes[9][PACKET_SIZE];
+	for (int i = 0; i < PACKET_SIZE; i++) {
+		const Vector3& origin = rays[i].getOrigin ();
+		const Vector3& direction = rays[i].getDirection ();
+		lanes[0][i] = origin.mX;
+		lanes[1][i] = origin.mY;
+		lanes[2][i] = origin.mZ;
+		lanes[3][i] = direction.mX;
+		lanes[4][i] = direction.mY;
+		lanes[5][i] = direction.mZ;
+		lanes[6][i] = 1.0 / direction.mX;
+		lanes[7][i] = 1.0 / direction.mY;
+		lanes[8][i] = 1.0 / direction.mZ;
+	}
+
+	PacketAVX2 packet;
+	packet.mOriginX = LANES_LOAD (lanes[0]);
+	packet.mOriginY = LANES_LOAD (lanes[1]);
+	packet.mOriginZ = LANES_LOAD (lanes[2]);
+	packet.mDirectionX = LANES_LOAD (lanes[3]);
+	packet.mDirectionY = LANES_LOAD (lanes[4]);
+	packet.mDirectionZ = LANES_LOAD (lanes[5]);
+	packet.mInverseX = LANES_LOAD (lanes[6]);
+	packet.mInverseY = LANES_LOAD (lanes[7]);
+	packet.mInverseZ = LANES_LOAD (lanes[8]);
+
+	// Spheres first, then only triangles in front of each lane's nearest sphere
+	Lanes closest = LANES_SET1 (1e30);
+	Lanes sphereIndex;
+	Lanes triangleIndex;
+	closestHitAVX2 (gSphereBVH, spheres.getData (), packet, closest, sphereIndex, context.mPrimaryStats);
+	closestHitAVX2 (gTriangleBVH, gTriangleRecords.data (), packet, closest, triangleIndex, context.mPrimaryStats);
+
+	Real t[PACKET_SIZE];
+	Real sphere[PACKET_SIZE];
+	Real triangle[PACKET_SIZE];
+	LANES_STORE (t, closest);
+	LANES_STORE (sphere, sphereIndex);
+	LANES_STORE (triangle, triangleIndex);
+	for (int i = 0; i < PACKET_SIZE; i++) {
+		hits[i] = Hit ();
+		if (triangle[i] >= 0) {
+			hits[i].mTriangle = (int)triangle[i];
+		}
+
+		else if (sphere[i] >= 0) {
+			hits[i].mSphere = (int)sphere[i];
+		}
+
+		else {
+			continue;
+		}
+
+		hits[i].mT = t[i];
+		hits[i].mPosition = rays[i].getOrigin () + (rays[i].getDirection () * t[i]);
+	}
+}
+#endif
+
+// Pick the packet and light batch kernels for this CPU
+void selectSIMDKernels () {
+
+	gPacketAVX2 = false;
+#ifdef HW3_HAS_AVX2_KERNEL
+	__builtin_cpu_init ();
+	gPacketAVX2 = gAllowSIMD && __builtin_cpu_supports ("avx2");
+#endif
+	gLightBatchAVX2 = gPacketAVX2;
+
+	if (gUsePackets) {
+		printf ("Packet tracing: %i-ray packets, %s kernel\n", PACKET_SIZE, gPacketAVX2 ? "AVX2" : "scalar");
+	}
+}
+
+// Visibility pass for a packet of rays
+void findClosestHits (const Ray rays[], Hit hits[], RenderContext& context) {
+
+#ifdef HW3_HAS_AVX2_KERNEL
+	if (gPacketAVX2) {
+		findClosestHitsAVX2 (rays, hits, context);
+		return;
+	}
+#endif
+
+	for (int i = 0; i < PACKET_SIZE; i++) {
+		hits[i] = Hit ();
+		findClosestHit (rays[i], hits[i], context);
+	}
+}
+
+// Trace a packet of rays and return the color of each. Only the first count rays are valid; the rest of the packet
+// is padded with copies of the last one.
+void tracePacket (Ray rays[], int count, Color colors[], RenderContext& context) {
+
+	for (int i = count; i < PACKET_SIZE; i++) {
+		rays[i] = rays[count - 1];
+	}
+
+	Hit hits[PACKET_SIZE];
+	findClosestHits (rays, hits, context);
+
+	context.mPrimaryStats.mRays += count;
+	COUNT_COST (mPrimaryRays, count);
+	for (int i = 0; i < count; i++) {
+		colors[i] = shadeSample (hits[i], context);
+	}
+}
+
+
+// Sub-pixel offsets of the fixed SSAA samples
+const double SSAA_OFFSETS[SSAA_SAMPLES][2] = { { 0.25, 0.25 }, { 0.75, 0.25 }, { 0.25, 0.75 }, { 0.75, 0.75 } };
+
+// Compute the ray direction from the camera through a point on screen, given as a pixel and an offset within it
+Ray calculateRayFromCamera (double x, double y, double offsetX, double offsetY) {
+	return gCamera.generateRay (x + offsetX, y + offsetY);
+}
+
+// Compute the ray direction from the camera to a pixel on screen
+Ray calculateRayFromCamera (double x, double y) {
+	return calculateRayFromCamera (x, y, 0.5, 0.5);
+}
+
+// Compute the four SSAA rays for a pixel
+void calculateRaysFromCamera (double x, double y, Ray rays[SSAA_SAMPLES]) {
+
+	for (unsigned int i = 0; i < SSAA_SAMPLES; i++) {
+		rays[i] = calculateRayFromCamera (x, y, SSAA_OFFSETS[i][0], SSAA_OFFSETS[i][1]);
+	}
+}
+
+/*************************************************************/
+// Per-pixel Costs
+/*************************************************************/
+#ifdef HW3_COST_COUNTERS
+// Work counted for every pixel, row by row like the framebuffer
+std::vector<PixelCost> gPixelCosts;
+
+// Share of total that pixel i of count gets
+inline unsigned int costShare (unsigned int total, int count, int i) {
+	return total / count + (((unsigned int)i < total % count) ? 1 : 0);
+}
+
+// Charge the work counted on this thread since the last call to pixels (xs, ys). The lanes of a packet are traced
+// together, so its work is split evenly between its pixels.
+void recordPixelCost (const unsigned int xs[], const unsigned int ys[], int count) {
+
+	for (int i = 0; i < count; i++) {
+		PixelCost& cost = gPixelCosts[(size_t)ys[i] * gWidth + xs[i]];
+		cost.mPrimaryRays += costShare (tPixelCost.mPrimaryRays, count, i);
+		cost.mShadowRays += costShare (tPixelCost.mShadowRays, count, i);
+		cost.mIntersectionTests += costShare (tPixelCost.mIntersectionTests, count, i);
+		cost.mHits += costShare (tPixelCost.mHits, count, i);
+		cost.mShadingEvaluations += costShare (tPixelCost.mShadingEvaluations, count, i);
+	}
+	tPixelCost = PixelCost ();
+}
+
+	#define RECORD_PIXEL_COST(xs, ys, count) recordPixelCost (xs, ys, count)
+#else
+	#define RECORD_PIXEL_COST(xs, ys, count) ((void)0)
+#endif
+
+/*************************************************************/
+// Adaptive Antialiasing
+/*************************************************************/
+// Adaptive antialiasing (--adaptive N) traces one ray through every pixel first, then goes back and supersamples only
+// the pixels that differ from a neighbour: in color by more than the threshold, in the object they see, or in which
+// lights reach them. Flat background and the insides of large surfaces keep their single ray.
+const int ADAPTIVE_MAX_SAMPLES = 16;
+
+enum SamplePattern {
+	PATTERN_ROTATED_GRID,
+	PATTERN_STRATIFIED
+};
+
+bool gAdaptiveAA = false;
+int gAdaptiveSamples = 4;
+SamplePattern gSamplePattern = PATTERN_ROTATED_GRID;
+double gAdaptiveThreshold = 0.1;
+
+// Rotated-grid patterns with 4, 8 and 16 samples, in sixteenths of a pixel from its center. No two samples share a row
+// or a column, so near-horizontal and near-vertical edges get as many distinct coverage steps as there are samples.
+const int ROTATED_GRID_4[4][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+const int ROTATED_GRID_8[8][2] = { { 1, -3 }, { -1, 3 }, { 5, 1 }, { -3, -5 }, { -5, 5 }, { -7, -1 }, { 3, 7 }, { 7, -7 } };
+const int ROTATED_GRID_16[16][2] = {
+	{ 1, 1 }, { -1, -3 }, { -3, 2 }, { 4, -1 }, { -5, -2 }, { 2, 5 }, { 5, 3 }, { 3, -5 },
+	{ -2, 6 }, { 0, -7 }, { -4, -6 }, { -6, 4 }, { -8, 0 }, { 7, -4 }, { 6, 7 }, { -7, -8 }
+};
+
+// What the first pass saw through the center of a pixel
+struct BaseSample {
+	Color mColor;
+	int mObject;
+	unsigned int mLitLights;
+};
+
+// First-pass samples for rows [gBaseY0, gBaseY1) of the image, row by row. That is the whole image, or the band being
+// streamed plus the row on either side of it.
+std::vector<BaseSample> gBaseSamples;
+unsigned int gBaseY0 = 0;
+unsigned int gBaseY1 = 0;
+
+// Hash a pixel and sample number to a number in [0, 1). Jitter depends only on these, so every thread and every run
+// places the samples of a pixel in the same spots.
+double sampleJitter (unsigned int x, unsigned int y, unsigned int sample) {
+
+	unsigned int hash = x * 0x8da6b343u ^ y * 0xd8163841u ^ sample * 0xcb1ab31fu;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352du;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bu;
+	hash ^= hash >> 16;
+	return (hash >> 8) * (1.0 / 16777216.0);
+}
+
+// Offset of one adaptive sample within pixel (x, y)
+void samplePosition (unsigned int x, unsigned int y, int sample, double& offsetX, double& offsetY) {
+
+	if (gSamplePattern == PATTERN_STRATIFIED) {
+
+		// One jittered sample per cell of a 2x2, 4x2 or 4x4 grid
+		int columns = (gAdaptiveSamples >= 8) ? 4 : 2;
+		int rows = gAdaptiveSamples / columns;
+		offsetX = ((sample % columns) + sampleJitter (x, y, 2 * sample)) / columns;
+		offsetY = ((sample / columns) + sampleJitter (x, y, 2 * sample + 1)) / rows;
+		return;
+	}
+
+	const int (*pattern)[2] = (gAdaptiveSamples == 16) ? ROTATED_GRID_16 : (gAdaptiveSamples == 8) ? ROTATED_GRID_8 : ROTATED_GRID_4;
+	offsetX = 0.5 + pattern[sample][0] / 16.0;
+	offsetY = 0.5 + pattern[sample][1] / 16.0;
+}
+
+// Identify the surface a sample landed on. Triangles are grouped by material, so the edges between the triangles of
+// one mesh do not count as object boundaries.
+int sampleObject (const Hit& hit) {
+
+	if (hit.mSphere >= 0) {
+		return hit.mSphere;
+	}
+
+	if (hit.mTriangle >= 0) {
+		return spheres.getSize () + (int)triangles[hit.mTriangle].material;
+	}
+
+	return -1;
+}
+
+// First pass--trace the center rays of up to PACKET_SIZE pixels and record what they saw
+void renderBaseSamples (const unsigned int xs[], const unsigned int ys[], int count, RenderContext& context) {
+
+	Ray rays[PACKET_SIZE];
+	Hit hits[PACKET_SIZE];
+	for (int i = 0; i < count; i++) {
+		rays[i] = calculateRayFromCamera (xs[i], ys[i]);
+	}
+
+	if (gUsePackets) {
+		for (int i = count; i < PACKET_SIZE; i++) {
+			rays[i] = rays[count - 1];
+		}
+		findClosestHits (rays, hits, context);
+	}
+
+	else {
+		for (int i = 0; i < count; i++) {
+			findClosestHit (rays[i], hits[i], context);
+		}
+	}
+
+	context.mPrimaryStats.mRays += count;
+	COUNT_COST (mPrimaryRays, count);
+	for (int i = 0; i < count; i++) {
+		BaseSample& sample = gBaseSamples[(size_t)(ys[i] - gBaseY0) * gWidth + xs[i]];
+		sample.mLitLights = 0;
+		sample.mColor = shadeSample (hits[i], context, &sample.mLitLights);
+		sample.mObject = sampleObject (hits[i]);
+	}
+	RECORD_PIXEL_COST (xs, ys, count);
+}
+
+// Check whether a pixel has to be supersampled, by comparing its first-pass sample with those of its four neighbours
+bool needsRefinement (unsigned int x, unsigned int y) {
+
+	const BaseSample& center = gBaseSamples[(size_t)(y - gBaseY0) * gWidth + x];
+	const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	for (int i = 0; i < 4; i++) {
+		int nx = (int)x + neighbours[i][0];
+		int ny = (int)y + neighbours[i][1];
+		if (nx < 0 || ny < (int)gBaseY0 || nx >= (int)gWidth || ny >= (int)gBaseY1) {
+			continue;
+		}
+
+		const BaseSample& other = gBaseSamples[(size_t)(ny - gBaseY0) * gWidth + nx];
+		if (other.mObject != center.mObject || other.mLitLights != center.mLitLights
+			|| std::abs (other.mColor.mR - center.mColor.mR) > gAdaptiveThreshold
+			|| std::abs (other.mColor.mG - center.mColor.mG) > gAdaptiveThreshold
+			|| std::abs (other.mColor.mB - center.mColor.mB) > gAdaptiveThreshold) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Second pass--keep the first-pass color of a pixel, or replace it with the average of gAdaptiveSamples new samples
+Color renderPixelAdaptive (unsigned int x, unsigned int y, RenderContext& context) {
+
+	if (!needsRefinement (x, y)) {
+		return gBaseSamples[(size_t)(y - gBaseY0) * gWidth + x].mColor;
+	}
+
+	context.mRefinedPixels++;
+	Ray rays[ADAPTIVE_MAX_SAMPLES];
+	Color colors[ADAPTIVE_MAX_SAMPLES];
+	for (int i = 0; i < gAdaptiveSamples; i++) {
+		double offsetX;
+		double offsetY;
+		samplePosition (x, y, i, offsetX, offsetY);
+		rays[i] = calculateRayFromCamera (x, y, offsetX, offsetY);
+	}
+
+	// Every pattern is a multiple of the packet size
+	if (gUsePackets) {
+		for (int i = 0; i < gAdaptiveSamples; i += PACKET_SIZE) {
+			tracePacket (rays + i, PACKET_SIZE, colors + i, context);
+		}
+	}
+
+	else {
+		for (int i = 0; i < gAdaptiveSamples; i++) {
+			colors[i] = trace (rays[i], context);
+		}
+	}
+
+	double r = 0;
+	double g = 0;
+	double b = 0;
+	for (int i = 0; i < gAdaptiveSamples; i++) {
+		r += colors[i].mR;
+		g += colors[i].mG;
+		b += colors[i].mB;
+	}
+	return Color (r / gAdaptiveSamples, g / gAdaptiveSamples, b / gAdaptiveSamples);
+}
+
+// Average the SSAA_SAMPLES sub-samples of a pixel. With packet tracing, the sub-samples are traced as one packet.
+Color renderPixelSupersampled (unsigned int x, unsigned int y, RenderContext& context) {
+
+	Ray rays[SSAA_SAMPLES];
+	calculateRaysFromCamera (x, y, rays);
+	Color colors[SSAA_SAMPLES];
+	if (gUsePackets) {
+		tracePacket (rays, SSAA_SAMPLES, colors, context);
+	}
+
+	else {
+		for (unsigned int i = 0; i < SSAA_SAMPLES; i++) {
+			colors[i] = trace (rays[i], context);
+		}
+	}
+
+	double r = 0;
+	double g = 0;
+	double b = 0;
+	for (unsigned int i = 0; i < SSAA_SAMPLES; i++) {
+		r += colors[i].mR;
+		g += colors[i].mG;
+		b += colors[i].mB;
+	}
+	return Color (r / SSAA_SAMPLES, g / SSAA_SAMPLES, b / SSAA_SAMPLES);
+}
+
+// Trace the ray (or the SSAA rays) through a pixel and return its color
+Color renderPixel (unsigned int x, unsigned int y, RenderContext& context) {
+
+	if (gAdaptiveAA) {
+		return renderPixelAdaptive (x, y, context);
+	}
+
+	// If SSAA is enabled, average the values
+	if (gUseAA) {
+		return renderPixelSupersampled (x, y, context);
+	}
+
+	// Otherwise, just get the value from one ray
+	Ray ray = calculateRayFromCamera (x, y);
+	return trace (ray, context);
+}
+
+// Render up to PACKET_SIZE neighbouring pixels. Without SSAA their primary rays are traced as one packet.
+void renderPixels (const unsigned int xs[], const unsigned int ys[], int count, Color colors[], RenderContext& context) {
+
+	if (gUsePackets && !gUseAA && !gAdaptiveAA) {
+		Ray rays[PACKET_SIZE];
+		for (int i = 0; i < count; i++) {
+			rays[i] = calculateRayFromCamera (xs[i], ys[i]);
+		}
+		tracePacket (rays, count, colors, context);
+		RECORD_PIXEL_COST (xs, ys, count);
+		return;
+	}
+
+	for (int i = 0; i < count; i++) {
+		colors[i] = renderPixel (xs[i], ys[i], context);
+		RECORD_PIXEL_COST (xs + i, ys + i, 1);
+	}
+}
+
+/*************************************************************/
+// Specialized Kernels
+/*************************************************************/
+// renderPixels decides for every pixel, sample and hit what the scene and options need: SSAA or not, which primitive
+// hierarchies to search, whether to batch the lights. The specialized kernels below are compiled once per combination
+// of those, so each decision is made a single time per frame, when the kernel is picked. They cover the common case:
+// no packets, no adaptive antialiasing, no light tree or culling. Anything else goes through renderPixels.
+bool gSpecializedKernels = true;
+
+// Signature shared by renderPixels and the specialized kernels
+typedef void (*RenderKernel) (const unsigned int xs[], const unsigned int ys[], int count, Color colors[], RenderContext& context);
+
+// Picked by selectRenderKernel at the start of every frame
+RenderKernel gRenderKernel = renderPixels;
+
+// shadeHit without the many-light modes, culling or lit-light signature. A single light needs no batch: it is shaded
+// straight away, and only if its shadow ray gets through.
+template <int Geometry, bool SingleLight>
+Color shadeHitSpecialized (const Hit& hit, RenderContext& context) {
+
+	Color retVal (0, 0, 0);
+	ShadingPoint point;
+	if (!SingleLight) {
+		describeShadingPoint<Geometry> (hit, point);
+	}
+
+	std::vector<int>& lit = context.mLitLights;
+	lit.clear ();
+	int count = SingleLight ? 1 : lights.getSize ();
+	for (int j = 0; j < count; j++) {
+		Vector3 lightPosition (lights[j].position[0], lights[j].position[1], lights[j].position[2]);
+		Vector3 origin = hit.mPosition;
+		Vector3 direction = lightPosition - origin;
+		Real lightDistance = direction.magnitude ();
+		Ray shadow (origin, direction.normalize ());
+		if (isShadowed<Geometry> (shadow, lightDistance, j, hit.mSphere, hit.mTriangle, context)) {
+			continue;
+		}
+
+		COUNT_COST (mShadingEvaluations, 1);
+		if (SingleLight) {
+			describeShadingPoint<Geometry> (hit, point);
+			retVal += shadeLightAt (point, lights[j].position, lights[j].color);
+		}
+
+		else {
+			lit.push_back (j);
+		}
+	}
+
+	if (!SingleLight && !lit.empty ()) {
+		shadeLightBatch (point, &lit[0], (int)lit.size (), retVal);
+	}
+
+	return retVal;
+}
+
+// trace and shadeSample for one scene configuration
+template <int Geometry, bool SingleLight>
+Color traceSpecialized (const Ray& ray, RenderContext& context) {
+
+	context.mPrimaryStats.mRays++;
+	COUNT_COST (mPrimaryRays, 1);
+	Hit hit;
+	Color retVal (1, 1, 1);
+	if (findClosestHit<Geometry> (ray, hit, context)) {
+		retVal = shadeHitSpecialized<Geometry, SingleLight> (hit, context);
+	}
+
+	retVal += Color (ambient_light[0], ambient_light[1], ambient_light[2]);
+	return retVal;
+}
+
+// renderPixels for one scene configuration. The samples are averaged in the same order as renderPixelSupersampled, so
+// the image is the same as the generic path renders.
+template <bool AA, int Geometry, bool SingleLight>
+void renderPixelsSpecialized (const unsigned int xs[], const unsigned int ys[], int count, Color colors[], RenderContext& context) {
+
+	for (int i = 0; i < count; i++) {
+		if (AA) {
+			Ray rays[SSAA_SAMPLES];
+			calculateRaysFromCamera (xs[i], ys[i], rays);
+			double r = 0;
+			double g = 0;
+			double b = 0;
+			for (unsigned int j = 0; j < SSAA_SAMPLES; j++) {
+				Color color = traceSpecialized<Geometry, SingleLight> (rays[j], context);
+				r += color.mR;
+				g += color.mG;
+				b += color.mB;
+			}
+			colors[i] = Color (r / SSAA_SAMPLES, g / SSAA_SAMPLES, b / SSAA_SAMPLES);
+		}
+
+		else {
+			Ray ray = calculateRayFromCamera (xs[i], ys[i]);
+			colors[i] = traceSpecialized<Geometry, SingleLight> (ray, context);
+		}
+		RECORD_PIXEL_COST (xs + i, ys + i, 1);
+	}
+}
+
+// Every instantiation, indexed by [SSAA][SceneGeometry][single light]
+const RenderKernel SPECIALIZED_KERNELS[2][3][2] = {
+	{
+		{ renderPixelsSpecialized<false, GEOMETRY_MIXED, false>, renderPixelsSpecialized<false, GEOMETRY_MIXED, true> },
+		{ renderPixelsSpecialized<false, GEOMETRY_SPHERES, false>, renderPixelsSpecialized<false, GEOMETRY_SPHERES, true> },
+		{ renderPixelsSpecialized<false, GEOMETRY_TRIANGLES, false>, renderPixelsSpecialized<false, GEOMETRY_TRIANGLES, true> }
+	},
+	{
+		{ renderPixelsSpecialized<true, GEOMETRY_MIXED, false>, renderPixelsSpecialized<true, GEOMETRY_MIXED, true> },
+		{ renderPixelsSpecialized<true, GEOMETRY_SPHERES, false>, renderPixelsSpecialized<true, GEOMETRY_SPHERES, true> },
+		{ renderPixelsSpecialized<true, GEOMETRY_TRIANGLES, false>, renderPixelsSpecialized<true, GEOMETRY_TRIANGLES, true> }
+	}
+};
+
+// The primitive types present in the loaded scene. An empty scene counts as spheres only.
+SceneGeometry sceneGeometry () {
+
+	if (triangles.getSize () == 0) {
+		return GEOMETRY_SPHERES;
+	}
+
+	if (spheres.getSize () == 0) {
+		return GEOMETRY_TRIANGLES;
+	}
+
+	return GEOMETRY_MIXED;
+}
+
+// Pick the render kernel for the loaded scene and the options
+void selectRenderKernel () {
+
+	gRenderKernel = renderPixels;
+	if (!gSpecializedKernels || gUsePackets || gAdaptiveAA || isManyLightShading () || gLightCull > 0) {
+		printf ("Render kernel: generic\n");
+		return;
+	}
+
+	SceneGeometry geometry = sceneGeometry ();
+	bool singleLight = (lights.getSize () == 1);
+	gRenderKernel = SPECIALIZED_KERNELS[gUseAA ? 1 : 0][geometry][singleLight ? 1 : 0];
+
+	const char* names[] = { "spheres and triangles", "spheres only", "triangles only" };
+	printf ("Render kernel: specialized for %s, %s, %s\n", names[geometry], singleLight ? "one light" : "any number of lights",
+		gUseAA ? "SSAA" : "one sample per pixel");
+}
+
+// Render rows [y0, y1) of the image one column at a time on the calling thread
+void draw_scene_serial(unsigned int y0, unsigned int y1) {
+
+	RenderContext context;
+
+	// Adaptive antialiasing needs the first pass over all of its rows before any pixel can be finished
+	if (gAdaptiveAA) {
+		TraceScope trace ("adaptive base pass");
+		for(unsigned int x = 0; x < gWidth; x++) {
+			for(unsigned int y = gBaseY0; y < gBaseY1; y += PACKET_SIZE) {
+				unsigned int xs[PACKET_SIZE];
+				unsigned int ys[PACKET_SIZE];
+				int count = 0;
+				for (unsigned int i = y; i < gBaseY1 && count < PACKET_SIZE; i++) {
+					xs[count] = x;
+					ys[count++] = i;
+				}
+				renderBaseSamples (xs, ys, count, context);
+			}
+		}
+	}
+
+	// Iterate through all pixels and write the results of the trace to the buffer
+	for(unsigned int x = 0; x < gWidth; x++) {
+		TraceScope trace ("column", "x", x);
+
+		// Pixels are rendered in runs of PACKET_SIZE down the column
+		for(unsigned int y = y0; y < y1; y += PACKET_SIZE) {
+
+			unsigned int xs[PACKET_SIZE];
+			unsigned int ys[PACKET_SIZE];
+			int count = 0;
+			for (unsigned int i = y; i < y1 && count < PACKET_SIZE; i++) {
+				xs[count] = x;
+				ys[count++] = i;
+			}
+
+			// Write the colors to the buffer
+			Color colors[PACKET_SIZE];
+			gRenderKernel (xs, ys, count, colors, context);
+			for (int i = 0; i < count; i++) {
+				plot_pixel(xs[i], ys[i], colors[i].mR * 255, colors[i].mG * 255, colors[i].mB * 255);
+			}
+		}
+
+		// Show the finished column
+		display_region(x, y0, x + 1, y1);
+	}
+
+	accumulateTraversalStats (context);
+}
+
+/*************************************************************/
+// Parallel Rendering
+/*************************************************************/
+const unsigned int TILE_SIZE = 16;
+
+// Pixel spacing of the first progressive pass. Must divide TILE_SIZE.
+const unsigned int PROGRESSIVE_FIRST_STEP = 8;
+
+// Number of render threads; 0 picks one per hardware thread
+unsigned int gNumThreads = 0;
+
+// A rectangular block of pixels, [mX0, mX1) x [mY0, mY1)
+struct Tile {
+	unsigned int mX0;
+	unsigned int mY0;
+	unsigned int mX1;
+	unsigned int mY1;
+};
+
+// Per-worker tile queue. The owner takes tiles from the front, working through its own run of neighbouring tiles in order,
+// while idle workers steal from the back, so the tiles furthest from where the owner is working are the ones that migrate.
+class WorkStealingQueue {
+private:
+	std::mutex mMutex;
+	std::deque<int> mTiles;
+
+public:
+	void push (int tile) {
+		std::lock_guard<std::mutex> lock (mMutex);
+		mTiles.push_back (tile);
+	}
+
+	bool pop (int& tile) {
+		std::lock_guard<std::mutex> lock (mMutex);
+		if (mTiles.empty ()) {
+			return false;
+		}
+		tile = mTiles.front ();
+		mTiles.pop_front ();
+		return true;
+	}
+
+	bool steal (int& tile) {
+		std::lock_guard<std::mutex> lock (mMutex);
+		if (mTiles.empty ()) {
+			return false;
+		}
+		tile = mTiles.back ();
+		mTiles.pop_back ();
+		return true;
+	}
+};
+
+// Shared state of a parallel frame. Workers render tiles into the framebuffer and post their indices to the finished list,
+// which the calling thread drains to feed the display.
+struct TileScheduler {
+	std::vector<Tile> mTiles;
+	std::vector<WorkStealingQueue> mQueues;
+
+	std::mutex mFinishedMutex;
+	std::condition_variable mFinishedCondition;
+	std::vector<int> mFinished;
+	std::atomic<int> mSkipped;
+
+	TileScheduler (unsigned int workers) : mQueues (workers), mSkipped (0) {}
+
+	// Take the next tile from our own queue, or steal one from another worker once ours runs dry
+	bool nextTile (unsigned int worker, int& tile) {
+		if (mQueues[worker].pop (tile)) {
+			return true;
+		}
+
+		for (unsigned int i = 1; i < mQueues.size (); i++) {
+			if (mQueues[(worker + i) % mQueues.size ()].steal (tile)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void finishTile (int tile) {
+		std::lock_guard<std::mutex> lock (mFinishedMutex);
+		mFinished.push_back (tile);
+		mFinishedCondition.notify_one ();
+	}
+};
+
+// What a pass over the tiles computes. PASS_BASE only fills in gBaseSamples for adaptive antialiasing; PASS_COARSE and
+// PASS_SUPERSAMPLE are the refinement passes of progressive rendering.
+enum TilePassKind {
+	PASS_FINAL,
+	PASS_BASE,
+	PASS_COARSE,
+	PASS_SUPERSAMPLE
+};
+
+struct TilePass {
+	TilePassKind mKind;
+
+	// PASS_COARSE: the spacing of the pixels traced, each of which fills the mStep x mStep block below and right of it
+	unsigned int mStep;
+
+	// Tiles not yet started when the deadline passes are skipped
+	bool mHasDeadline;
+	std::chrono::high_resolution_clock::time_point mDeadline;
+};
+
+// Render the final color of every pixel of the tile
+void renderTileFinal (const Tile& tile, bool basePass, RenderContext& context) {
+
+	// Walk the tile in 2x2 blocks, which make the most coherent packets
+	for (unsigned int y = tile.mY0; y < tile.mY1; y += 2) {
+		for (unsigned int x = tile.mX0; x < tile.mX1; x += 2) {
+
+			unsigned int xs[PACKET_SIZE];
+			unsigned int ys[PACKET_SIZE];
+			int count = 0;
+			for (unsigned int j = y; j < std::min (y + 2, tile.mY1); j++) {
+				for (unsigned int i = x; i < std::min (x + 2, tile.mX1); i++) {
+					xs[count] = i;
+					ys[count++] = j;
+				}
+			}
+
+			if (basePass) {
+				renderBaseSamples (xs, ys, count, context);
+				continue;
+			}
+
+			Color colors[PACKET_SIZE];
+			gRenderKernel (xs, ys, count, colors, context);
+			for (int i = 0; i < count; i++) {
+				plot_pixel(xs[i], ys[i], colors[i].mR * 255, colors[i].mG * 255, colors[i].mB * 255);
+			}
+		}
+	}
+}
+
+// Trace the pixels on the step grid that no coarser pass has traced, and fill the block each one covers. Tiles start on
+// multiples of TILE_SIZE, so no block crosses into another tile.
+void renderTileCoarse (const Tile& tile, unsigned int step, RenderContext& context) {
+
+	unsigned int xs[PACKET_SIZE];
+	unsigned int ys[PACKET_SIZE];
+	int count = 0;
+	for (unsigned int y = tile.mY0; y < tile.mY1; y += step) {
+		for (unsigned int x = tile.mX0; x < tile.mX1; x += step) {
+
+			// The first pass traces the whole grid; later ones skip the points of the previous, twice as coarse grid
+			bool traced = (step < PROGRESSIVE_FIRST_STEP) && (x % (step * 2) == 0) && (y % (step * 2) == 0);
+			if (!traced) {
+				xs[count] = x;
+				ys[count++] = y;
+			}
+
+			bool last = (x + step >= tile.mX1) && (y + step >= tile.mY1);
+			if (count < PACKET_SIZE && !(last && count > 0)) {
+				continue;
+			}
+
+			Color colors[PACKET_SIZE];
+			gRenderKernel (xs, ys, count, colors, context);
+			for (int i = 0; i < count; i++) {
+				for (unsigned int j = ys[i]; j < std::min (ys[i] + step, tile.mY1); j++) {
+					for (unsigned int k = xs[i]; k < std::min (xs[i] + step, tile.mX1); k++) {
+						plot_pixel(k, j, colors[i].mR * 255, colors[i].mG * 255, colors[i].mB * 255);
+					}
+				}
+			}
+			count = 0;
+		}
+	}
+}
+
+// Replace every pixel of the tile with its supersampled color
+void renderTileSupersampled (const Tile& tile, RenderContext& context) {
+
+	for (unsigned int y = tile.mY0; y < tile.mY1; y++) {
+		for (unsigned int x = tile.mX0; x < tile.mX1; x++) {
+			Color color = renderPixelSupersampled (x, y, context);
+			RECORD_PIXEL_COST (&x, &y, 1);
+			plot_pixel(x, y, color.mR * 255, color.mG * 255, color.mB * 255);
+		}
+	}
+}
+
+// Worker thread body--render tiles until every queue is empty. No work is added once the frame starts, so an empty sweep
+// over all queues means the frame is (or is about to be) complete. Tiles skipped because of the deadline are still
+// reported as finished, so the calling thread is not left waiting for them.
+void renderWorker (TileScheduler& scheduler, unsigned int worker, const TilePass& pass, RenderContext& context) {
+
+	setTraceThreadName ("render worker " + std::to_string (worker));
+	int index;
+	while (scheduler.nextTile (worker, index)) {
+		const Tile& tile = scheduler.mTiles[index];
+		TraceScope trace ("tile", "index", index);
+
+		if (pass.mHasDeadline && std::chrono::high_resolution_clock::now () >= pass.mDeadline) {
+			scheduler.mSkipped++;
+		}
+
+		else if (pass.mKind == PASS_COARSE) {
+			renderTileCoarse (tile, pass.mStep, context);
+		}
+
+		else if (pass.mKind == PASS_SUPERSAMPLE) {
+			renderTileSupersampled (tile, context);
+		}
+
+		else {
+			renderTileFinal (tile, pass.mKind == PASS_BASE, context);
+		}
+		scheduler.finishTile (index);
+	}
+}
+
+// Run one pass over rows [y0, y1) of the image in tiles on a pool of worker threads. Returns the number of tiles rendered,
+// which is less than all of them only if the pass has a deadline.
+unsigned int render_tiles(unsigned int threads, unsigned int y0, unsigned int y1, const TilePass& pass) {
+
+	TraceScope trace ("render_tiles", "pass", pass.mKind);
+	TileScheduler scheduler (threads);
+	for (unsigned int y = y0; y < y1; y += TILE_SIZE) {
+		for (unsigned int x = 0; x < gWidth; x += TILE_SIZE) {
+			Tile tile = { x, y, std::min (x + TILE_SIZE, gWidth), std::min (y + TILE_SIZE, y1) };
+			scheduler.mTiles.push_back (tile);
+		}
+	}
+
+	// Hand each worker a contiguous run of tiles; stealing evens out the runs that turn out to be expensive
+	int numTiles = (int)scheduler.mTiles.size ();
+	for (int i = 0; i < numTiles; i++) {
+		scheduler.mQueues[(unsigned long long)i * threads / numTiles].push (i);
+	}
+
+	std::vector<RenderContext> contexts (threads);
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < threads; i++) {
+		workers.push_back (std::thread (renderWorker, std::ref (scheduler), i, std::cref (pass), std::ref (contexts[i])));
+	}
+
+	// Pass finished tiles to the display as they come in
+	int drawn = 0;
+	while (drawn < numTiles) {
+		std::vector<int> finished;
+		{
+			std::unique_lock<std::mutex> lock (scheduler.mFinishedMutex);
+			while (scheduler.mFinished.empty ()) {
+				scheduler.mFinishedCondition.wait (lock);
+			}
+			finished.swap (scheduler.mFinished);
+		}
+
+		for (size_t i = 0; i < finished.size (); i++) {
+			const Tile& tile = scheduler.mTiles[finished[i]];
+			if (pass.mKind != PASS_BASE) {
+				display_region (tile.mX0, tile.mY0, tile.mX1, tile.mY1);
+			}
+		}
+		drawn += (int)finished.size ();
+	}
+
+	for (unsigned int i = 0; i < threads; i++) {
+		workers[i].join ();
+		accumulateTraversalStats (contexts[i]);
+	}
+	return numTiles - scheduler.mSkipped;
+}
+
+// Render the image in tiles on a pool of worker threads. Every pixel is still computed by renderPixel on its own, so the
+// result is identical to the serial path.
+void draw_scene_parallel(unsigned int threads, unsigned int y0, unsigned int y1) {
+
+	TilePass pass = {};
+	if (gAdaptiveAA) {
+		pass.mKind = PASS_BASE;
+		render_tiles (threads, gBaseY0, gBaseY1, pass);
+	}
+	pass.mKind = PASS_FINAL;
+	render_tiles (threads, y0, y1, pass);
+}
+
+void reportAdaptiveStats () {
+	printf ("Adaptive AA: %llu of %u pixels refined with %i %s samples\n", gRefinedPixels, gWidth * gHeight, gAdaptiveSamples,
+		(gSamplePattern == PATTERN_STRATIFIED) ? "stratified" : "rotated-grid");
+}
+
+// Render rows [y0, y1) of the image into the render target
+void draw_rows(unsigned int y0, unsigned int y1, unsigned int threads) {
+
+	// The first pass of adaptive antialiasing also covers the row on either side, which the edge test compares against
+	if (gAdaptiveAA) {
+		gBaseY0 = (y0 > 0) ? y0 - 1 : 0;
+		gBaseY1 = std::min (y1 + 1, gHeight);
+		gBaseSamples.resize ((size_t)(gBaseY1 - gBaseY0) * gWidth);
+	}
+
+	if (threads == 1) {
+		draw_scene_serial (y0, y1);
+	}
+
+	else {
+		draw_scene_parallel (threads, y0, y1);
+	}
+}
+
+/*************************************************************/
+// Progressive Rendering
+/*************************************************************/
+// With --progressive, the image is refined in passes: every 8th pixel first, each filling its 8x8 block, then every 4th,
+// 2nd and finally every pixel, and then a pass that supersamples every pixel. A pass only traces the pixels the passes
+// before it have not, so the full resolution image costs no more than rendering it directly. With --budget, refinement
+// stops when the time is up and the image holds the best result reached; the first pass always completes, so there is
+// never a hole in the image.
+bool gProgressive = false;
+
+// Milliseconds from the start of the render; 0 is no limit
+double gBudget = 0;
+
+void describeProgressivePass (const TilePass& pass, char* text, size_t size) {
+
+	if (pass.mKind == PASS_SUPERSAMPLE) {
+		snprintf (text, size, "%ux supersampled", SSAA_SAMPLES);
+	}
+
+	else if (pass.mStep == 1) {
+		snprintf (text, size, "full resolution");
+	}
+
+	else {
+		snprintf (text, size, "1/%u resolution", pass.mStep);
+	}
+}
+
+void draw_scene_progressive(unsigned int threads) {
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+
+	std::vector<TilePass> schedule;
+	for (unsigned int step = PROGRESSIVE_FIRST_STEP; step >= 1; step /= 2) {
+		TilePass pass = {};
+		pass.mKind = PASS_COARSE;
+		pass.mStep = step;
+		schedule.push_back (pass);
+	}
+	TilePass supersample = {};
+	supersample.mKind = PASS_SUPERSAMPLE;
+	schedule.push_back (supersample);
+
+	char name[64];
+	printf ("Progressive passes:");
+	for (size_t i = 0; i < schedule.size (); i++) {
+		describeProgressivePass (schedule[i], name, sizeof (name));
+		printf ("%s %s", (i == 0) ? "" : ",", name);
+	}
+	if (gBudget > 0) {
+		printf ("; budget %.0f ms", gBudget);
+	}
+	printf ("\n");
+
+	gTarget = &buffer[0];
+	gTargetY0 = 0;
+
+	unsigned int totalTiles = ((gWidth + TILE_SIZE - 1) / TILE_SIZE) * ((gHeight + TILE_SIZE - 1) / TILE_SIZE);
+	int reached = -1;
+	unsigned int partialTiles = 0;
+	for (size_t i = 0; i < schedule.size (); i++) {
+		TilePass& pass = schedule[i];
+		pass.mHasDeadline = (gBudget > 0) && (i > 0);
+		pass.mDeadline = start + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration> (
+			std::chrono::duration<double, std::milli> (gBudget));
+		if (pass.mHasDeadline && std::chrono::high_resolution_clock::now () >= pass.mDeadline) {
+			break;
+		}
+
+		TraceScope trace ("progressive pass", "step", (pass.mKind == PASS_COARSE) ? pass.mStep : 0);
+		std::chrono::high_resolution_clock::time_point passStart = std::chrono::high_resolution_clock::now ();
+		unsigned int rendered = render_tiles (threads, 0, gHeight, pass);
+		double elapsed = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - passStart).count ();
+
+		describeProgressivePass (pass, name, sizeof (name));
+		printf ("  Pass %u (%s): %u of %u tiles in %.3f ms\n", (unsigned int)i + 1, name, rendered, totalTiles, elapsed);
+		if (rendered < totalTiles) {
+			partialTiles = rendered;
+			break;
+		}
+		reached = (int)i;
+	}
+
+	describeProgressivePass (schedule[reached], name, sizeof (name));
+	if (reached + 1 == (int)schedule.size ()) {
+		printf ("Progressive quality: %s (all %u passes)\n", name, (unsigned int)schedule.size ());
+	}
+
+	else {
+		char next[64];
+		describeProgressivePass (schedule[reached + 1], next, sizeof (next));
+		printf ("Progressive quality: %s (%i of %u passes), %u%% of the image at %s when the budget ran out\n", name,
+			reached + 1, (unsigned int)schedule.size (), partialTiles * 100 / totalTiles, next);
+	}
+}
+
+/*************************************************************/
+// Streaming Output
+/*************************************************************/
+// With --stream, the image is rendered in bands of rows from the top down, and each finished band goes to an encoder
+// thread that writes it out while the next band renders. Only STREAM_BANDS bands are ever allocated, so memory stays
+// proportional to the image width however tall the image is.
+const unsigned int STREAM_BAND_HEIGHT = 32;
+const unsigned int STREAM_BANDS = 3;
+
+bool gStreamOutput = false;
+
+// Rows [mY0, mY1) of the image, bottom row first like the framebuffer
+struct Band {
+	unsigned int mY0;
+	unsigned int mY1;
+	std::vector<unsigned char> mPixels;
+};
+
+// Bands cycle between the renderer and the encoder: the renderer takes an empty band, fills it and queues it, the encoder
+// writes the queued bands in order and hands them back. The renderer blocks while every band is waiting to be written.
+class BandQueue {
+private:
+	std::mutex mMutex;
+	std::condition_variable mCondition;
+	std::deque<Band*> mEmpty;
+	std::deque<Band*> mFilled;
+	bool mDone;
+
+public:
+	BandQueue () : mDone (false) {}
+
+	void release (Band* band) {
+		std::lock_guard<std::mutex> lock (mMutex);
+		mEmpty.push_back (band);
+		mCondition.notify_all ();
+	}
+
+	Band* acquire () {
+		std::unique_lock<std::mutex> lock (mMutex);
+		while (mEmpty.empty ()) {
+			mCondition.wait (lock);
+		}
+		Band* band = mEmpty.front ();
+		mEmpty.pop_front ();
+		return band;
+	}
+
+	void submit (Band* band) {
+		std::lock_guard<std::mutex> lock (mMutex);
+		mFilled.push_back (band);
+		mCondition.notify_all ();
+	}
+
+	// No more bands will be submitted
+	void finish () {
+		std::lock_guard<std::mutex> lock (mMutex);
+		mDone = true;
+		mCondition.notify_all ();
+	}
+
+	// Returns NULL once every submitted band has been taken and finish has been called
+	Band* takeFilled () {
+		std::unique_lock<std::mutex> lock (mMutex);
+		while (mFilled.empty () && !mDone) {
+			mCondition.wait (lock);
+		}
+		if (mFilled.empty ()) {
+			return NULL;
+		}
+		Band* band = mFilled.front ();
+		mFilled.pop_front ();
+		return band;
+	}
+};
+
+// Pick the output format from the file extension. Anything that isn't .ppm, or .png in a build with libpng enabled in
+// imageFormats.h, is written as a JPEG.
+ImageIO::fileFormatType imageFormatFor (const char* path) {
+
+	const char* extension = strrchr (path, '.');
+	if (extension != NULL && strcasecmp (extension, ".ppm") == 0) {
+		return ImageIO::FORMAT_PPM;
+	}
+
+#ifdef ENABLE_PNG
+	if (extension != NULL && strcasecmp (extension, ".png") == 0) {
+		return ImageIO::FORMAT_PNG;
+	}
+#endif
+
+	return ImageIO::FORMAT_JPEG;
+}
+
+// Encoder thread body--write bands as they arrive. Files store the top row first, so each band is written from its last row.
+void encodeBands (BandQueue& queue, ImageStreamWriter& writer, bool& ok) {
+
+	setTraceThreadName ("encoder");
+	while (true) {
+		Band* band;
+		{
+			TraceScope trace ("wait for band");
+			band = queue.takeFilled ();
+		}
+		if (band == NULL) {
+			break;
+		}
+
+		TraceScope trace ("encode band", "y0", band->mY0);
+		for (unsigned int y = band->mY1; y > band->mY0; y--) {
+			if (ok && writer.writeRows (&band->mPixels[(size_t)(y - 1 - band->mY0) * gWidth * 3], 1) != ImageIO::OK) {
+				ok = false;
+			}
+		}
+		queue.release (band);
+	}
+}
+
+// Render the image band by band, writing it to filename as it goes
+void draw_scene_streaming(unsigned int threads) {
+
+	printf("Streaming image file: %s\n", filename);
+	ImageStreamWriter writer;
+	if (writer.open (filename, imageFormatFor (filename), gWidth, gHeight) != ImageIO::OK) {
+		printf("Error in Saving\n");
+		return;
+	}
+
+	std::vector<Band> bands (STREAM_BANDS);
+	BandQueue queue;
+	for (unsigned int i = 0; i < STREAM_BANDS; i++) {
+		bands[i].mPixels.resize ((size_t)gWidth * STREAM_BAND_HEIGHT * 3);
+		queue.release (&bands[i]);
+	}
+
+	bool ok = true;
+	std::thread encoder (encodeBands, std::ref (queue), std::ref (writer), std::ref (ok));
+
+	for (unsigned int y1 = gHeight; y1 > 0; ) {
+		Band* band;
+		{
+			TraceScope trace ("wait for free band");
+			band = queue.acquire ();
+		}
+		TraceScope trace ("band", "y0", (y1 > STREAM_BAND_HEIGHT) ? y1 - STREAM_BAND_HEIGHT : 0);
+		band->mY0 = (y1 > STREAM_BAND_HEIGHT) ? y1 - STREAM_BAND_HEIGHT : 0;
+		band->mY1 = y1;
+
+		gTarget = &band->mPixels[0];
+		gTargetY0 = band->mY0;
+		draw_rows (band->mY0, band->mY1, threads);
+		queue.submit (band);
+		y1 = band->mY0;
+	}
+
+	queue.finish ();
+	encoder.join ();
+	gTarget = NULL;
+
+	if (!ok || writer.close () != ImageIO::OK)
+		printf("Error in Saving\n");
+	else
+		printf("File saved Successfully\n");
+}
+
+void draw_scene() {
+
+	TraceScope trace ("draw_scene");
+	selectRenderKernel ();
+	unsigned int threads = gNumThreads;
+	if (threads == 0) {
+		threads = std::max (1u, std::thread::hardware_concurrency ());
+	}
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	if (gStreamOutput) {
+		draw_scene_streaming (threads);
+	}
+
+	else if (gProgressive) {
+		draw_scene_progressive (threads);
+	}
+
+	else {
+		gTarget = &buffer[0];
+		gTargetY0 = 0;
+		draw_rows (0, gHeight, threads);
+	}
+
+	double elapsed = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+	printf ("Rendered %ux%u in %.3f ms on %u thread(s)\n", gWidth, gHeight, elapsed, threads);
+	if (gAdaptiveAA) {
+		reportAdaptiveStats ();
+	}
+}
+
+/*************************************************************/
+// Pixel plotting
+/*************************************************************/
+void plot_pixel(int x, int y, unsigned char r, unsigned char g, unsigned char b)
+{
+	unsigned char* pixel = &gTarget[((size_t)(y - gTargetY0) * gWidth + x) * 3];
+	pixel[0] = r;
+	pixel[1] = g;
+	pixel[2] = b;
+}
+
+/*************************************************************/
+// Display
+/*************************************************************/
+#ifndef HW3_HEADLESS
+// The window shows the framebuffer through a texture. Render threads report the regions they have finished, and the GL
+// thread uploads just those regions and redraws at most DISPLAY_REFRESH_RATE times a second. A refresh is a few GL calls
+// per finished region instead of two per pixel, so watching the render no longer slows it down.
+const double DISPLAY_REFRESH_RATE = 30.0;
+
+// A rectangle of the framebuffer, [mX0, mX1) x [mY0, mY1)
+struct Region {
+	unsigned int mX0;
+	unsigned int mY0;
+	unsigned int mX1;
+	unsigned int mY1;
+};
+
+class DisplayBackend {
+private:
+	std::mutex mMutex;
+	std::vector<Region> mFinished;
+	GLuint mTexture;
+	std::chrono::high_resolution_clock::time_point mLastRefresh;
+
+public:
+	DisplayBackend () : mTexture (0) {}
+
+	// Create the texture. Needs the GL context and the framebuffer.
+	void init ();
+
+	// Called by any render thread once a region of the framebuffer holds its final colors
+	void finishRegion (unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1);
+
+	// GL thread only--upload the regions finished since the last refresh and redraw
+	void refresh ();
+
+	// GL thread only--redraw the window from the texture
+	void draw ();
+
+	// Time left before the refresh rate allows the next refresh
+	double secondsUntilRefresh () const;
+};
+
+void DisplayBackend::init () {
+
+	if (buffer.empty ()) {
+		return;
+	}
+
+	glGenTextures (1, &mTexture);
+	glBindTexture (GL_TEXTURE_2D, mTexture);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, gWidth, gHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, &buffer[0]);
+	mLastRefresh = std::chrono::high_resolution_clock::now ();
+}
+
+void DisplayBackend::finishRegion (unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1) {
+
+	// Nothing is shown while the image is streamed to a file
+	if (mTexture == 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock (mMutex);
+
+	// The serial renderer finishes one column at a time; merge neighbouring columns into one upload
+	if (!mFinished.empty ()) {
+		Region& last = mFinished.back ();
+		if (last.mX1 == x0 && last.mY0 == y0 && last.mY1 == y1) {
+			last.mX1 = x1;
+			return;
+		}
+	}
+
+	Region region = { x0, y0, x1, y1 };
+	mFinished.push_back (region);
+}
+
+void DisplayBackend::refresh () {
+
+	if (mTexture == 0) {
+		return;
+	}
+
+	std::vector<Region> finished;
+	{
+		std::lock_guard<std::mutex> lock (mMutex);
+		finished.swap (mFinished);
+	}
+	mLastRefresh = std::chrono::high_resolution_clock::now ();
+	if (finished.empty ()) {
+		return;
+	}
+
+	TraceScope trace ("display refresh", "regions", finished.size ());
+	// Upload each region straight out of the framebuffer, whose rows are gWidth pixels apart
+	glBindTexture (GL_TEXTURE_2D, mTexture);
+	glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei (GL_UNPACK_ROW_LENGTH, gWidth);
+	for (size_t i = 0; i < finished.size (); i++) {
+		const Region& region = finished[i];
+		glPixelStorei (GL_UNPACK_SKIP_PIXELS, region.mX0);
+		glPixelStorei (GL_UNPACK_SKIP_ROWS, region.mY0);
+		glTexSubImage2D (GL_TEXTURE_2D, 0, region.mX0, region.mY0, region.mX1 - region.mX0, region.mY1 - region.mY0,
+			GL_RGB, GL_UNSIGNED_BYTE, &buffer[0]);
+	}
+	glPixelStorei (GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei (GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei (GL_UNPACK_SKIP_ROWS, 0);
+
+	draw ();
+}
+
+void DisplayBackend::draw () {
+
+	if (mTexture == 0) {
+		return;
+	}
+
+	glEnable (GL_TEXTURE_2D);
+	glBindTexture (GL_TEXTURE_2D, mTexture);
+	glTexEnvi (GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	glBegin (GL_QUADS);
+	glTexCoord2f (0, 0);
+	glVertex2i (0, 0);
+	glTexCoord2f (1, 0);
+	glVertex2i (gWidth, 0);
+	glTexCoord2f (1, 1);
+	glVertex2i (gWidth, gHeight);
+	glTexCoord2f (0, 1);
+	glVertex2i (0, gHeight);
+	glEnd ();
+	glDisable (GL_TEXTURE_2D);
+	glFlush ();
+}
+
+double DisplayBackend::secondsUntilRefresh () const {
+	double elapsed = std::chrono::duration<double> (std::chrono::high_resolution_clock::now () - mLastRefresh).count ();
+	return std::max (0.0, 1.0 / DISPLAY_REFRESH_RATE - elapsed);
+}
+
+DisplayBackend gDisplay;
+
+// The frame renders on its own thread, so the GL thread stays free to refresh the window
+std::thread gRenderThread;
+std::atomic<bool> gRenderDone (false);
+#endif
+
+void display_region(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1)
+{
+#ifndef HW3_HEADLESS
+	gDisplay.finishRegion(x0, y0, x1, y1);
+#endif
+}
+
+/*************************************************************/
+// Parsing
+/*************************************************************/
+bool save_jpg()
+{
+	TraceScope trace ("save_jpg");
+	// Any name is saved as a JPEG, as it always was, unless its extension asks for a format this build can write
+	ImageIO::fileFormatType format = imageFormatFor(filename);
+	printf("Saving %s file: %s\n", (format == ImageIO::FORMAT_PPM) ? "PPM" : ((format == ImageIO::FORMAT_PNG) ? "PNG" : "JPEG"), filename);
+	const char* extension = strrchr(filename, '.');
+	if (format == ImageIO::FORMAT_JPEG && extension != NULL && strcasecmp(extension, ".png") == 0) {
+		printf("This build has no libpng (ENABLE_PNG in imageFormats.h), so the file holds JPEG data\n");
+	}
+
+	ImageIO img(gWidth, gHeight, 3, &buffer[0]);
+	if (img.save(filename, format) != ImageIO::OK)
+	{
+		printf("Error in Saving\n");
+		return false;
+	}
+
+	printf("File saved Successfully\n");
+	return true;
+}
+
+// Reference image for a tolerance report (--compare), such as the double build's render of the same scene
+const char* gCompareFile = NULL;
+
+// Report how far the rendered image is from gCompareFile. A .ppm reference measures the renderer alone; a JPEG one adds
+// its own compression error.
+void compareWithReference ()
+{
+	ImageIO::fileFormatType format;
+	ImageIO reference;
+	if (reference.load(gCompareFile, &format) != ImageIO::OK) {
+		printf("Could not read %s\n", gCompareFile);
+		return;
+	}
+
+	if (reference.getWidth() != gWidth || reference.getHeight() != gHeight || reference.getBytesPerPixel() != 3) {
+		printf("%s is not a %ux%u RGB image\n", gCompareFile, gWidth, gHeight);
+		return;
+	}
+
+	const unsigned char* pixels = reference.getPixels();
+	size_t channels = (size_t)gWidth * gHeight * 3;
+	int largest = 0;
+	unsigned long long total = 0;
+	unsigned long long squared = 0;
+	unsigned long long off = 0;
+	for (size_t i = 0; i < channels; i++) {
+		int difference = std::abs((int)buffer[i] - (int)pixels[i]);
+		largest = std::max(largest, difference);
+		total += difference;
+		squared += difference * difference;
+		off += (difference > 1);
+	}
+
+	double error = (double)squared / channels;
+	printf("Compared with %s: max difference %i, mean %.4f, %.3f%% of channels off by more than 1, ", gCompareFile, largest,
+		(double)total / channels, 100.0 * off / channels);
+	if (squared == 0) {
+		printf("identical\n");
+	}
+
+	else {
+		printf("PSNR %.1f dB\n", 10.0 * std::log10(255.0 * 255.0 / error));
+	}
+}
+
+// Cost image written alongside the render (--heatmap), and the counter it shows
+const char* gHeatmapFile = NULL;
+
+enum CostCounter {
+	COST_PRIMARY_RAYS,
+	COST_SHADOW_RAYS,
+	COST_INTERSECTION_TESTS,
+	COST_HITS,
+	COST_SHADING_EVALUATIONS
+};
+
+CostCounter gHeatmapCounter = COST_INTERSECTION_TESTS;
+
+#ifdef HW3_COST_COUNTERS
+unsigned int getCost (const PixelCost& cost, CostCounter counter) {
+
+	switch (counter) {
+		case COST_PRIMARY_RAYS: return cost.mPrimaryRays;
+		case COST_SHADOW_RAYS: return cost.mShadowRays;
+		case COST_INTERSECTION_TESTS: return cost.mIntersectionTests;
+		case COST_HITS: return cost.mHits;
+		default: return cost.mShadingEvaluations;
+	}
+}
+
+// Print the frame totals of every counter
+void reportCosts () {
+
+	unsigned long long totals[5] = { 0, 0, 0, 0, 0 };
+	unsigned int maxTests = 0;
+	for (size_t i = 0; i < gPixelCosts.size (); i++) {
+		for (int j = 0; j < 5; j++) {
+			totals[j] += getCost (gPixelCosts[i], (CostCounter)j);
+		}
+		maxTests = std::max (maxTests, gPixelCosts[i].mIntersectionTests);
+	}
+
+	printf ("Cost: %llu primary rays, %llu shadow rays, %llu intersection tests (%llu hits), %llu shading evaluations\n",
+		totals[COST_PRIMARY_RAYS], totals[COST_SHADOW_RAYS], totals[COST_INTERSECTION_TESTS], totals[COST_HITS],
+		totals[COST_SHADING_EVALUATIONS]);
+	printf ("Cost: %.1f intersection tests per pixel on average, %u at most\n",
+		(double)totals[COST_INTERSECTION_TESTS] / gPixelCosts.size (), maxTests);
+}
+
+// False-color ramp from black through blue, magenta, red and yellow to white, for a value in [0, 1]
+void heatmapColor (double value, unsigned char color[3]) {
+
+	static const double STOPS[6][3] = { { 0, 0, 0 }, { 0, 0, 1 }, { 1, 0, 1 }, { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 } };
+	double position = std::min (std::max (value, 0.0), 1.0) * 5;
+	int stop = std::min ((int)position, 4);
+	double blend = position - stop;
+	for (int i = 0; i < 3; i++) {
+		color[i] = (unsigned char)(255 * (STOPS[stop][i] * (1 - blend) + STOPS[stop + 1][i] * blend));
+	}
+}
+
+// Write the chosen counter of every pixel as a false-color image. The ramp tops out at the 99th percentile, so a few
+// very expensive pixels don't wash out the rest.
+void save_heatmap() {
+
+	TraceScope trace ("save_heatmap");
+	std::vector<unsigned int> costs (gPixelCosts.size ());
+	for (size_t i = 0; i < costs.size (); i++) {
+		costs[i] = getCost (gPixelCosts[i], gHeatmapCounter);
+	}
+	std::vector<unsigned int> sorted (costs);
+	std::nth_element (sorted.begin (), sorted.begin () + sorted.size () * 99 / 100, sorted.end ());
+	unsigned int scale = std::max (1u, sorted[sorted.size () * 99 / 100]);
+
+	std::vector<unsigned char> pixels (costs.size () * 3);
+	for (size_t i = 0; i < costs.size (); i++) {
+		heatmapColor ((double)costs[i] / scale, &pixels[i * 3]);
+	}
+
+	printf("Saving heatmap: %s (white is %u or more)\n", gHeatmapFile, scale);
+	ImageIO img(gWidth, gHeight, 3, &pixels[0]);
+	if (img.save(gHeatmapFile, imageFormatFor (gHeatmapFile)) != ImageIO::OK)
+		printf("Error in Saving\n");
+	else
+		printf("File saved Successfully\n");
+}
+#endif
+
+// Echo every parsed token (--verbose). Off by default--printing the scene dominates the load time of large scenes.
+bool gVerboseParse = false;
+
+// Read the scene through a binary .sceneb cache next to the scene file, writing it if it is missing or stale (--cache)
+bool gUseSceneCache = false;
+
+// Read-only view of a whole file. Memory-mapped where the platform supports it, read into memory otherwise.
+class MappedFile {
+private:
+	const char* mData;
+	size_t mSize;
+	bool mMapped;
+	std::vector<char> mContents;
+
+public:
+	MappedFile () : mData (NULL), mSize (0), mMapped (false) {}
+	~MappedFile ();
+
+	bool open (const char* path);
+	inline const char* getData () const { return mData; }
+	inline size_t getSize () const { return mSize; }
+};
+
+MappedFile::~MappedFile () {
+#ifndef WIN32
+	if (mMapped) {
+		munmap ((void*)mData, mSize);
+	}
+#endif
+}
+
+bool MappedFile::open (const char* path) {
+
+#ifndef WIN32
+	int fd = ::open (path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat (fd, &info) == 0 && info.st_size > 0) {
+		void* data = mmap (NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			mData = (const char*)data;
+			mSize = (size_t)info.st_size;
+			mMapped = true;
+		}
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	close (fd);
+	if (mMapped) {
+		return true;
+	}
+#endif
+
+	FILE* file = fopen (path, "rb");
+	if (file == NULL) {
+		return false;
+	}
+
+	char chunk[65536];
+	size_t read;
+	while ((read = fread (chunk, 1, sizeof (chunk), file)) > 0) {
+		mContents.insert (mContents.end (), chunk, chunk + read);
+	}
+	fclose (file);
+
+	mData = mContents.empty () ? "" : &mContents[0];
+	mSize = mContents.size ();
+	return true;
+}
+
+// Splits a scene file into whitespace-separated tokens in place, without copying them
+class SceneTokenizer {
+private:
+	const char* mCursor;
+	const char* mEnd;
+
+public:
+	SceneTokenizer (const char* data, size_t size) : mCursor (data), mEnd (data + size) {}
+
+	// Get the next token. Returns false at the end of the file.
+	bool next (const char*& token, size_t& length);
+
+	// Get the next token as a null-terminated string, truncated to fit the buffer
+	bool next (char* buffer, size_t size);
+
+	// Parse the next token as a number
+	bool nextInt (int& value);
+	bool nextDouble (double& value);
+};
+
+bool SceneTokenizer::next (const char*& token, size_t& length) {
+
+	while (mCursor < mEnd && isspace ((unsigned char)*mCursor)) {
+		mCursor++;
+	}
+
+	if (mCursor == mEnd) {
+		return false;
+	}
+
+	token = mCursor;
+	while (mCursor < mEnd && !isspace ((unsigned char)*mCursor)) {
+		mCursor++;
+	}
+	length = mCursor - token;
+	return true;
+}
+
+bool SceneTokenizer::next (char* buffer, size_t size) {
+
+	const char* token;
+	size_t length;
+	if (!next (token, length)) {
+		buffer[0] = '\0';
+		return false;
+	}
+
+	length = std::min (length, size - 1);
+	memcpy (buffer, token, length);
+	buffer[length] = '\0';
+	return true;
+}
+
+bool SceneTokenizer::nextInt (int& value) {
+
+	double number;
+	if (!nextDouble (number)) {
+		return false;
+	}
+
+	value = (int)number;
+	return true;
+}
+
+// Numbers in scene files are short decimals like -8.83442. Those are read with the exact fast path: while the digits fit
+// in 2^53 and the power of ten is at most 10^22, both are exactly representable and one multiply or divide is correctly
+// rounded, so the result is the same double strtod would return. Anything else goes through strtod.
+bool SceneTokenizer::nextDouble (double& value) {
+
+	static const double POWERS_OF_TEN[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	const char* token;
+	size_t length;
+	if (!next (token, length)) {
+		return false;
+	}
+
+	const char* cursor = token;
+	const char* end = token + length;
+	bool negative = false;
+	if (cursor < end && (*cursor == '-' || *cursor == '+')) {
+		negative = (*cursor == '-');
+		cursor++;
+	}
+
+	unsigned long long mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+		mantissa = mantissa * 10 + (*cursor++ - '0');
+		digits++;
+	}
+
+	if (cursor < end && *cursor == '.') {
+		cursor++;
+		while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+			mantissa = mantissa * 10 + (*cursor++ - '0');
+			digits++;
+			exponent--;
+		}
+	}
+
+	if (cursor < end && (*cursor == 'e' || *cursor == 'E')) {
+		cursor++;
+		bool negativeExponent = false;
+		if (cursor < end && (*cursor == '-' || *cursor == '+')) {
+			negativeExponent = (*cursor == '-');
+			cursor++;
+		}
+
+		int power = 0;
+		while (cursor < end && *cursor >= '0' && *cursor <= '9' && power < 10000) {
+			power = power * 10 + (*cursor++ - '0');
+		}
+		exponent += negativeExponent ? -power : power;
+	}
+
+	if (cursor == end && digits > 0 && digits <= 15 && exponent >= -22 && exponent <= 22) {
+		value = (exponent < 0) ? (double)mantissa / POWERS_OF_TEN[-exponent] : (double)mantissa * POWERS_OF_TEN[exponent];
+		if (negative) {
+			value = -value;
+		}
+		return true;
+	}
+
+	// Slow path for long mantissas, large exponents and anything unusual
+	char buffer[128];
+	length = std::min (length, sizeof (buffer) - 1);
+	memcpy (buffer, token, length);
+	buffer[length] = '\0';
+
+	char* parsed;
+	value = strtod (buffer, &parsed);
+	return parsed != buffer;
+}
+
+void parse_check(const char *expected, char *found)
+{
+	if(strcasecmp(expected,found))
+	{
+		printf("Expected '%s ' found '%s '\n", expected, found);
+		printf("Parse error, abnormal abortion\n");
+		exit(0);
+	}
+}
+
+void parse_number(SceneTokenizer& tokens, Real* value)
+{
+	double number;
+	if(!tokens.nextDouble(number))
+	{
+		printf("Expected a number\n");
+		printf("Parse error, abnormal abortion\n");
+		exit(0);
+	}
+	*value = (Real)number;
+}
+
+void parse_doubles(SceneTokenizer& tokens, const char *check, Real p[3])
+{
+	char str[100];
+	tokens.next(str, sizeof(str));
+	parse_check(check,str);
+	parse_number(tokens,&p[0]);
+	parse_number(tokens,&p[1]);
+	parse_number(tokens,&p[2]);
+	if(gVerboseParse)
+		printf("%s %lf %lf %lf\n",check,p[0],p[1],p[2]);
+}
+
+void parse_rad(SceneTokenizer& tokens, Real *r)
+{
+	char str[100];
+	tokens.next(str, sizeof(str));
+	parse_check("rad:",str);
+	parse_number(tokens,r);
+	if(gVerboseParse)
+		printf("rad: %f\n",*r);
+}
+
+void parse_shi(SceneTokenizer& tokens, Real *shi)
+{
+	char s[100];
+	tokens.next(s, sizeof(s));
+	parse_check("shi:",s);
+	parse_number(tokens,shi);
+	if(gVerboseParse)
+		printf("shi: %f\n",*shi);
+}
+
+// Binary scene cache (.sceneb): a versioned header followed by the raw scene arrays, in the order of the sections below.
+// The header records the record sizes, so a cache written by a build with a different layout (or byte order) is rejected
+// and rebuilt.
+const unsigned int SCENEB_MAGIC = 0x53335748;	// "HW3S" in a little-endian file
+const unsigned int SCENEB_VERSION = 2;
+
+enum SceneBinarySection {
+	SCENEB_TRIANGLES,
+	SCENEB_VERTICES,
+	SCENEB_MATERIALS,
+	SCENEB_TRIANGLE_MATERIALS,
+	SCENEB_SPHERES,
+	SCENEB_LIGHTS,
+	SCENEB_SECTIONS
+};
+
+struct SceneBinaryHeader {
+	unsigned int mMagic;
+	unsigned int mVersion;
+	unsigned int mRecordSize[SCENEB_SECTIONS];
+	int mCount[SCENEB_SECTIONS];
+	Real mAmbient[3];
+};
+
+// Fill in the record size and count of one section from the array it is stored in
+template <typename T>
+void describeSection (SceneBinaryHeader& header, SceneBinarySection section, const ArenaArray<T>& array) {
+	header.mRecordSize[section] = sizeof (T);
+	header.mCount[section] = array.getSize ();
+}
+
+// Copy one section out of a mapped .sceneb file, allocating the array at its final size
+template <typename T>
+const char* readSection (const SceneBinaryHeader& header, SceneBinarySection section, const char* data, ArenaArray<T>& array) {
+	array.resize (header.mCount[section]);
+	memcpy (array.getData (), data, sizeof (T) * (size_t)header.mCount[section]);
+	return data + sizeof (T) * (size_t)header.mCount[section];
+}
+
+template <typename T>
+bool writeSection (FILE* file, const ArenaArray<T>& array) {
+	return fwrite (array.getData (), sizeof (T), array.getSize (), file) == (size_t)array.getSize ();
+}
+
+// Build the header describing the loaded scene
+SceneBinaryHeader describeScene () {
+
+	SceneBinaryHeader header;
+	header.mMagic = SCENEB_MAGIC;
+	header.mVersion = SCENEB_VERSION;
+	describeSection (header, SCENEB_TRIANGLES, triangles);
+	describeSection (header, SCENEB_VERTICES, vertices);
+	describeSection (header, SCENEB_MATERIALS, materials);
+	describeSection (header, SCENEB_TRIANGLE_MATERIALS, triangleMaterials);
+	describeSection (header, SCENEB_SPHERES, spheres);
+	describeSection (header, SCENEB_LIGHTS, lights);
+	memcpy (header.mAmbient, ambient_light, sizeof (ambient_light));
+	return header;
+}
+
+// Check that every index in the mesh refers to an existing vertex or material
+bool isMeshValid () {
+
+	for (int i = 0; i < triangles.getSize (); i++) {
+		if (triangles[i].material >= (unsigned int)triangleMaterials.getSize ()) {
+			return false;
+		}
+
+		for (int j = 0; j < 3; j++) {
+			if (triangles[i].v[j] >= (unsigned int)vertices.getSize ()) {
+				return false;
+			}
+		}
+	}
+
+	for (int i = 0; i < triangleMaterials.getSize (); i++) {
+		for (int j = 0; j < 3; j++) {
+			if (triangleMaterials[i].v[j] >= (unsigned int)materials.getSize ()) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Check whether a mapped file starts with a .sceneb header this build can read
+bool isSceneBinary (const MappedFile& file) {
+
+	if (file.getSize () < sizeof (SceneBinaryHeader)) {
+		return false;
+	}
+
+	SceneBinaryHeader header;
+	memcpy (&header, file.getData (), sizeof (header));
+	return header.mMagic == SCENEB_MAGIC;
+}
+
+// Load a .sceneb file. Returns false if it was written by an incompatible build or is damaged.
+bool loadSceneBinary (const MappedFile& file) {
+
+	TraceScope trace ("loadSceneBinary");
+	if (file.getSize () < sizeof (SceneBinaryHeader)) {
+		return false;
+	}
+
+	SceneBinaryHeader header;
+	memcpy (&header, file.getData (), sizeof (header));
+	SceneBinaryHeader expected = describeScene ();
+	if (header.mMagic != SCENEB_MAGIC || header.mVersion != SCENEB_VERSION
+		|| memcmp (header.mRecordSize, expected.mRecordSize, sizeof (header.mRecordSize)) != 0) {
+		return false;
+	}
+
+	size_t size = sizeof (header);
+	for (int i = 0; i < SCENEB_SECTIONS; i++) {
+		if (header.mCount[i] < 0) {
+			return false;
+		}
+		size += (size_t)header.mRecordSize[i] * (size_t)header.mCount[i];
+	}
+
+	if (file.getSize () != size) {
+		return false;
+	}
+
+	clearScene ();
+	const char* data = file.getData () + sizeof (header);
+	data = readSection (header, SCENEB_TRIANGLES, data, triangles);
+	data = readSection (header, SCENEB_VERTICES, data, vertices);
+	data = readSection (header, SCENEB_MATERIALS, data, materials);
+	data = readSection (header, SCENEB_TRIANGLE_MATERIALS, data, triangleMaterials);
+	data = readSection (header, SCENEB_SPHERES, data, spheres);
+	readSection (header, SCENEB_LIGHTS, data, lights);
+	memcpy (ambient_light, header.mAmbient, sizeof (ambient_light));
+
+	if (!isMeshValid ()) {
+		clearScene ();
+		return false;
+	}
+	return true;
+}
+
+// Write the loaded scene to a .sceneb file
+bool saveSceneBinary (const char* path) {
+
+	SceneBinaryHeader header = describeScene ();
+	FILE* file = fopen (path, "wb");
+	if (file == NULL) {
+		return false;
+	}
+
+	bool ok = fwrite (&header, sizeof (header), 1, file) == 1
+		&& writeSection (file, triangles)
+		&& writeSection (file, vertices)
+		&& writeSection (file, materials)
+		&& writeSection (file, triangleMaterials)
+		&& writeSection (file, spheres)
+		&& writeSection (file, lights);
+	ok = (fclose (file) == 0) && ok;
+	if (!ok) {
+		remove (path);
+	}
+	return ok;
+}
+
+// Hashing and equality on the exact bytes of a plain record, for deduplicating mesh data
+template <typename T>
+struct BitwiseHash {
+	size_t operator() (const T& value) const {
+
+		// FNV-1a
+		const unsigned char* bytes = (const unsigned char*)&value;
+		unsigned long long hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < sizeof (T); i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		}
+		return (size_t)hash;
+	}
+};
+
+template <typename T>
+struct BitwiseEqual {
+	bool operator() (const T& a, const T& b) const {
+		return memcmp (&a, &b, sizeof (T)) == 0;
+	}
+};
+
+// Collects the shared vertex and material buffers while a text scene is parsed. Values are only shared when they are
+// bit-for-bit identical, so the indexed mesh shades exactly like the triangles it was built from.
+class MeshBuilder {
+private:
+	typedef std::unordered_map<MeshVertex, unsigned int, BitwiseHash<MeshVertex>, BitwiseEqual<MeshVertex> > VertexMap;
+	typedef std::unordered_map<Material, unsigned int, BitwiseHash<Material>, BitwiseEqual<Material> > MaterialMap;
+	typedef std::unordered_map<TriangleMaterial, unsigned int, BitwiseHash<TriangleMaterial>, BitwiseEqual<TriangleMaterial> > TriangleMaterialMap;
+
+	VertexMap mVertexIndices;
+	MaterialMap mMaterialIndices;
+	TriangleMaterialMap mTriangleMaterialIndices;
+	std::vector<MeshVertex> mVertices;
+	std::vector<Material> mMaterials;
+	std::vector<TriangleMaterial> mTriangleMaterials;
+
+	// Find the index of a value, appending it if it has not been seen yet
+	template <typename T, typename Map>
+	static unsigned int intern (const T& value, Map& indices, std::vector<T>& values);
+
+public:
+	MeshTriangle add (const Triangle& triangle);
+
+	// Copy the buffers into the scene arena, each at its final size
+	void finish ();
+};
+
+template <typename T, typename Map>
+unsigned int MeshBuilder::intern (const T& value, Map& indices, std::vector<T>& values) {
+
+	std::pair<typename Map::iterator, bool> result = indices.insert (std::make_pair (value, (unsigned int)values.size ()));
+	if (result.second) {
+		values.push_back (value);
+	}
+	return result.first->second;
+}
+
+MeshTriangle MeshBuilder::add (const Triangle& triangle) {
+
+	MeshTriangle indexed;
+	TriangleMaterial corners;
+	for (int i = 0; i < 3; i++) {
+		const Vertex& vertex = triangle.v[i];
+
+		MeshVertex shared;
+		memcpy (shared.position, vertex.position, sizeof (shared.position));
+		memcpy (shared.normal, vertex.normal, sizeof (shared.normal));
+		indexed.v[i] = intern (shared, mVertexIndices, mVertices);
+
+		Material material;
+		memcpy (material.color_diffuse, vertex.color_diffuse, sizeof (material.color_diffuse));
+		memcpy (material.color_specular, vertex.color_specular, sizeof (material.color_specular));
+		material.shininess = vertex.shininess;
+		corners.v[i] = intern (material, mMaterialIndices, mMaterials);
+	}
+
+	indexed.material = intern (corners, mTriangleMaterialIndices, mTriangleMaterials);
+	return indexed;
+}
+
+void MeshBuilder::finish () {
+
+	vertices.resize ((int)mVertices.size ());
+	materials.resize ((int)mMaterials.size ());
+	triangleMaterials.resize ((int)mTriangleMaterials.size ());
+	if (!mVertices.empty ()) {
+		memcpy (vertices.getData (), &mVertices[0], sizeof (MeshVertex) * mVertices.size ());
+	}
+	if (!mMaterials.empty ()) {
+		memcpy (materials.getData (), &mMaterials[0], sizeof (Material) * mMaterials.size ());
+	}
+	if (!mTriangleMaterials.empty ()) {
+		memcpy (triangleMaterials.getData (), &mTriangleMaterials[0], sizeof (TriangleMaterial) * mTriangleMaterials.size ());
+	}
+}
+
+// Initial capacity for the sphere and light arrays of a text scene
+const int SCENE_INITIAL_CAPACITY = 64;
+
+// Parse a text scene description
+void loadSceneText(const MappedFile& file)
+{
+	TraceScope trace ("loadSceneText");
+	SceneTokenizer tokens(file.getData(), file.getSize());
+	int number_of_objects;
+	char type[50];
+	Triangle t;
+	MeshBuilder mesh;
+	Sphere s;
+	Light l;
+	if(!tokens.nextInt(number_of_objects) || number_of_objects < 0)
+	{
+		printf("Expected the number of objects\n");
+		printf("Parse error, abnormal abortion\n");
+		exit(0);
+	}
+
+	if(gVerboseParse)
+		printf("number of objects: %i\n",number_of_objects);
+
+	parse_doubles(tokens,"amb:",ambient_light);
+
+	// Meshes make up nearly all of a large scene, so the triangle array is sized from the object count when the first
+	// triangle is found and never has to grow. Spheres and lights are few; their arrays start small and grow on demand.
+	clearScene();
+
+	for(int i=0; i<number_of_objects; i++)
+	{
+		tokens.next(type, sizeof(type));
+		if(gVerboseParse)
+			printf("%s\n",type);
+		if(strcasecmp(type,"triangle")==0)
+		{
+			if(gVerboseParse)
+				printf("found triangle\n");
+			for(int j=0;j < 3;j++)
+			{
+				parse_doubles(tokens,"pos:",t.v[j].position);
+				parse_doubles(tokens,"nor:",t.v[j].normal);
+				parse_doubles(tokens,"dif:",t.v[j].color_diffuse);
+				parse_doubles(tokens,"spe:",t.v[j].color_specular);
+				parse_shi(tokens,&t.v[j].shininess);
+			}
+
+			if(triangles.getCapacity() == 0)
+				triangles.reserve(number_of_objects - i);
+			triangles.push(mesh.add(t));
+		}
+		else if(strcasecmp(type,"sphere")==0)
+		{
+			if(gVerboseParse)
+				printf("found sphere\n");
+
+			parse_doubles(tokens,"pos:",s.position);
+			parse_rad(tokens,&s.radius);
+			parse_doubles(tokens,"dif:",s.color_diffuse);
+			parse_doubles(tokens,"spe:",s.color_specular);
+			parse_shi(tokens,&s.shininess);
+
+			if(spheres.getCapacity() == 0)
+				spheres.reserve(std::min(number_of_objects - i, SCENE_INITIAL_CAPACITY));
+			spheres.push(s);
+		}
+		else if(strcasecmp(type,"light")==0)
+		{
+			if(gVerboseParse)
+				printf("found light\n");
+			parse_doubles(tokens,"pos:",l.position);
+			parse_doubles(tokens,"col:",l.color);
+
+			if(lights.getCapacity() == 0)
+				lights.reserve(std::min(number_of_objects - i, SCENE_INITIAL_CAPACITY));
+			lights.push(l);
+		}
+		else
+		{
+			printf("unknown type in scene description:\n%s\n",type);
+			exit(0);
+		}
+	}
+
+	mesh.finish();
+}
+
+// Check whether the file at path exists and was modified no earlier than the file at reference
+bool isUpToDate(const char *path, const char *reference)
+{
+	struct stat cached;
+	struct stat source;
+	return stat(path, &cached) == 0 && stat(reference, &source) == 0 && cached.st_mtime >= source.st_mtime;
+}
+
+// Load a scene from a text description or a .sceneb file. With the scene cache enabled, a text scene is read from its
+// .sceneb cache when that is up to date, and the cache is (re)written after parsing otherwise.
+int loadScene(char *argv)
+{
+	TraceScope trace ("loadScene");
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	std::string cachePath = std::string(argv) + "b";
+	const char *source = "text";
+
+	MappedFile file;
+	if(gUseSceneCache && isUpToDate(cachePath.c_str(), argv) && file.open(cachePath.c_str()) && loadSceneBinary(file))
+	{
+		source = "binary cache";
+	}
+	else
+	{
+		MappedFile scene;
+		if(!scene.open(argv))
+		{
+			printf("Unable to open scene file: %s\n", argv);
+			exit(0);
+		}
+
+		if(isSceneBinary(scene))
+		{
+			if(!loadSceneBinary(scene))
+			{
+				printf("%s was written by an incompatible build, regenerate it from the text scene\n", argv);
+				exit(0);
+			}
+			source = "binary";
+		}
+		else
+		{
+			loadSceneText(scene);
+			if(gUseSceneCache)
+			{
+				TraceScope trace ("saveSceneBinary");
+				if(saveSceneBinary(cachePath.c_str()))
+					printf("Wrote scene cache: %s\n", cachePath.c_str());
+				else
+					printf("Unable to write scene cache: %s\n", cachePath.c_str());
+			}
+		}
+	}
+
+	double elapsed = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+	printf("Loaded %s (%s): %i triangles (%i vertices, %i materials), %i spheres, %i lights (%lu KB) in %.3f ms\n", argv, source,
+		triangles.getSize(), vertices.getSize(), materials.getSize(), spheres.getSize(), lights.getSize(),
+		(unsigned long)(gSceneArena.getBytesReserved() / 1024), elapsed);
+	return 0;
+}
+
+/*************************************************************/
+// Callbacks
+/*************************************************************/
+// Render the frame and write it out if an output file was given
+void render_frame()
+{
+	draw_scene();
+	reportTraversalStats();
+	if(mode == MODE_JPEG && !gStreamOutput)
+		save_jpg();
+	if(gCompareFile != NULL)
+		compareWithReference();
+#ifdef HW3_COST_COUNTERS
+	reportCosts();
+	if(gHeatmapFile != NULL)
+		save_heatmap();
+#endif
+}
+
+#ifndef HW3_HEADLESS
+void display()
+{
+	gDisplay.draw();
+}
+
+void init()
+{
+	glMatrixMode(GL_PROJECTION);
+	glOrtho(0,gWidth,0,gHeight,1,-1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	// Clear to white
+	glClearColor(0,0,0,0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	gDisplay.init();
+}
+
+void render_thread()
+{
+	setTraceThreadName("render");
+	render_frame();
+	gRenderDone = true;
+}
+
+void idle()
+{
+	// Start the frame on the first call, then keep the window up to date until it is done
+	static bool started = false;
+	if(!started)
+	{
+		started = true;
+		gRenderThread = std::thread(render_thread);
+		return;
+	}
+
+	if(gRenderDone)
+	{
+		gRenderThread.join();
+		gDisplay.refresh();
+
+		// Nothing left to do; stop polling
+		glutIdleFunc(NULL);
+		return;
+	}
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(gDisplay.secondsUntilRefresh()));
+	gDisplay.refresh();
+}
+#endif
+
+/*************************************************************/
+// Render Server
+/*************************************************************/
+// With --serve SOCKET, every scene on the command line is loaded once, its hierarchies are built, and it stays resident
+// while requests from hw3-client (see hw3_protocol.h) arrive on a Unix-domain socket. A request names the scene, the
+// image size and the antialiasing, and either an output file or a reply with the pixels, so re-rendering a scene costs
+// only the render. Every connection has its own thread, but frames are rendered one at a time: a request waits for the
+// render lock, then has all the render threads to itself.
+#ifndef WIN32
+const char* gServeSocket = NULL;
+
+// A loaded scene and everything built from it. The renderer only reads the scene globals, so the other scenes are
+// parked here and swapScene trades places with the globals in constant time.
+struct ResidentScene {
+	std::string mName;
+	Arena mArena;
+	ArenaArray<MeshTriangle> mTriangles;
+	ArenaArray<MeshVertex> mVertices;
+	ArenaArray<Material> mMaterials;
+	ArenaArray<TriangleMaterial> mTriangleMaterials;
+	ArenaArray<Sphere> mSpheres;
+	ArenaArray<Light> mLights;
+	Real mAmbient[3];
+	std::vector<TriangleRecord> mTriangleRecords;
+	BVH mSphereBVH;
+	BVH mTriangleBVH;
+	LightArrays mLightArrays;
+	std::vector<LightNode> mLightTree;
+
+	ResidentScene () : mTriangles (mArena), mVertices (mArena), mMaterials (mArena), mTriangleMaterials (mArena),
+		mSpheres (mArena), mLights (mArena) {}
+};
+
+std::vector<ResidentScene*> gResidentScenes;
+
+// Held while a scene is swapped in and rendered
+std::mutex gRenderMutex;
+
+// Set by FRAME_STOP. Requests still waiting for the render lock are turned away.
+bool gServerStopping = false;
+int gServerListener = -1;
+
+const unsigned int SERVE_MAX_SIZE = 16384;
+
+// Trade the loaded scene (and everything built from it) with a resident one
+void swapScene (ResidentScene& scene) {
+
+	gSceneArena.swap (scene.mArena);
+	triangles.swap (scene.mTriangles);
+	vertices.swap (scene.mVertices);
+	materials.swap (scene.mMaterials);
+	triangleMaterials.swap (scene.mTriangleMaterials);
+	spheres.swap (scene.mSpheres);
+	lights.swap (scene.mLights);
+	for (int i = 0; i < 3; i++) {
+		std::swap (ambient_light[i], scene.mAmbient[i]);
+	}
+	gTriangleRecords.swap (scene.mTriangleRecords);
+	std::swap (gSphereBVH, scene.mSphereBVH);
+	std::swap (gTriangleBVH, scene.mTriangleBVH);
+	std::swap (gLightArrays, scene.mLightArrays);
+	gLightTree.swap (scene.mLightTree);
+}
+
+// Find a resident scene by path, file name or position. Returns -1 if there is none.
+int findResidentScene (const std::string& id) {
+
+	if (!id.empty () && id.find_first_not_of ("0123456789") == std::string::npos) {
+		errno = 0;
+		unsigned long index = strtoul (id.c_str (), NULL, 10);
+		return (errno == 0 && index < gResidentScenes.size ()) ? (int)index : -1;
+	}
+
+	for (size_t i = 0; i < gResidentScenes.size (); i++) {
+		const std::string& name = gResidentScenes[i]->mName;
+		size_t slash = name.find_last_of ('/');
+		if (name == id || (slash != std::string::npos && name.compare (slash + 1, std::string::npos, id) == 0)) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// One line per resident scene, for FRAME_LIST
+std::string describeResidentScenes () {
+
+	std::string text;
+	for (size_t i = 0; i < gResidentScenes.size (); i++) {
+		const ResidentScene& scene = *gResidentScenes[i];
+		char line[512];
+		snprintf (line, sizeof (line), "%u %s: %i triangles, %i spheres, %i lights (%lu KB)\n", (unsigned int)i, scene.mName.c_str (),
+			scene.mTriangles.getSize (), scene.mSpheres.getSize (), scene.mLights.getSize (), (unsigned long)(scene.mArena.getBytesReserved () / 1024));
+		text += line;
+	}
+	return text;
+}
+
+// Render a request and send the reply. The pixels or the file are produced under the render lock; the reply is sent
+// after it is released, so a slow client holds up no one else.
+bool serveRender (int connection, const RenderRequest& request, const std::string& sceneId, const std::string& output) {
+
+	int index = findResidentScene (sceneId);
+	if (index < 0) {
+		return sendText (connection, FRAME_ERROR, "No resident scene " + sceneId);
+	}
+	if (request.mWidth == 0 || request.mHeight == 0 || request.mWidth > SERVE_MAX_SIZE || request.mHeight > SERVE_MAX_SIZE) {
+		return sendText (connection, FRAME_ERROR, "The image size must be between 1x1 and 16384x16384");
+	}
+	if (request.mAdaptive != 0 && request.mAdaptive != 4 && request.mAdaptive != 8 && request.mAdaptive != 16) {
+		return sendText (connection, FRAME_ERROR, "Adaptive antialiasing takes 4, 8 or 16 samples");
+	}
+	if (request.mSSAA != 0 && request.mAdaptive != 0) {
+		return sendText (connection, FRAME_ERROR, "SSAA and adaptive antialiasing are alternatives; pick one");
+	}
+
+	std::vector<unsigned char> pixels;
+	bool saved = false;
+	double elapsed = 0;
+	{
+		std::lock_guard<std::mutex> lock (gRenderMutex);
+		if (gServerStopping) {
+			return sendText (connection, FRAME_ERROR, "The server is stopping");
+		}
+
+		TraceScope trace ("render request", "scene", index);
+		ResidentScene& scene = *gResidentScenes[index];
+		printf ("Request: %s at %ux%u%s\n", scene.mName.c_str (), request.mWidth, request.mHeight,
+			request.mSSAA ? ", SSAA" : (request.mAdaptive ? ", adaptive" : ""));
+		swapScene (scene);
+
+		gWidth = request.mWidth;
+		gHeight = request.mHeight;
+		gCamera.setup (gViewEye, gViewLookAt, gViewUp, gViewFov, gWidth, gHeight);
+		gUseAA = (request.mSSAA != 0);
+		gAdaptiveAA = (request.mAdaptive != 0);
+		gAdaptiveSamples = gAdaptiveAA ? (int)request.mAdaptive : gAdaptiveSamples;
+		gPrimaryStats = BVHStats ();
+		gShadowStats = BVHStats ();
+		gRefinedPixels = 0;
+		buffer.assign ((size_t)gWidth * gHeight * 3, 0);
+#ifdef HW3_COST_COUNTERS
+		gPixelCosts.assign ((size_t)gWidth * gHeight, PixelCost ());
+#endif
+
+		std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+		draw_scene ();
+		elapsed = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+		reportTraversalStats ();
+
+		if (!output.empty ()) {
+			std::vector<char> path (output.begin (), output.end ());
+			path.push_back (0);
+			filename = &path[0];
+			saved = save_jpg ();
+			filename = NULL;
+		}
+
+		// The framebuffer holds the bottom row first; replies hold the top row first, like the image files
+		else {
+			pixels.resize (buffer.size ());
+			size_t row = (size_t)gWidth * 3;
+			for (unsigned int y = 0; y < gHeight; y++) {
+				memcpy (&pixels[y * row], &buffer[(gHeight - 1 - y) * row], row);
+			}
+		}
+
+		swapScene (scene);
+	}
+
+	char text[512];
+	if (!output.empty ()) {
+		snprintf (text, sizeof (text), "%s %ux%u in %.3f ms to %s", saved ? "Rendered" : "Rendered, but could not save,",
+			request.mWidth, request.mHeight, elapsed, output.c_str ());
+		return sendText (connection, saved ? FRAME_DONE : FRAME_ERROR, text);
+	}
+
+	RenderImageHeader header = { request.mWidth, request.mHeight };
+	std::vector<char> reply (sizeof (header));
+	memcpy (&reply[0], &header, sizeof (header));
+	return sendFrame (connection, FRAME_IMAGE, &reply[0], reply.size (), &pixels[0], pixels.size ());
+}
+
+// Let the frame in progress finish and confirm, then close the listening socket, which ends the accept loop in runServer.
+// The process exits soon after, so the reply has to go out first.
+void stopServer (int connection) {
+
+	{
+		std::lock_guard<std::mutex> lock (gRenderMutex);
+		gServerStopping = true;
+	}
+	sendText (connection, FRAME_DONE, "Server stopped");
+	shutdown (gServerListener, SHUT_RDWR);
+}
+
+// Connection thread body--answer requests until the client hangs up
+void serveConnection (int connection) {
+
+	setTraceThreadName ("connection");
+	uint32_t type;
+	std::vector<char> payload;
+	while (receiveFrame (connection, type, payload)) {
+		bool ok;
+		if (type == FRAME_RENDER && payload.size () >= sizeof (RenderRequest)) {
+			RenderRequest request;
+			memcpy (&request, &payload[0], sizeof (request));
+			if (payload.size () != sizeof (request) + (size_t)request.mSceneLength + (size_t)request.mOutputLength) {
+				ok = sendText (connection, FRAME_ERROR, "Malformed render request");
+			}
+
+			else {
+				std::string sceneId (&payload[sizeof (request)], request.mSceneLength);
+				std::string output (&payload[sizeof (request)] + request.mSceneLength, request.mOutputLength);
+				ok = serveRender (connection, request, sceneId, output);
+			}
+		}
+
+		else if (type == FRAME_LIST) {
+			ok = sendText (connection, FRAME_DONE, describeResidentScenes ());
+		}
+
+		else if (type == FRAME_STOP) {
+			stopServer (connection);
+			break;
+		}
+
+		else {
+			ok = sendText (connection, FRAME_ERROR, "Unknown request");
+		}
+
+		if (!ok) {
+			break;
+		}
+	}
+	close (connection);
+}
+
+// Load the scenes and serve requests until a client sends FRAME_STOP
+int runServer (const std::vector<char*>& scenes) {
+
+	for (size_t i = 0; i < scenes.size (); i++) {
+		loadScene (scenes[i]);
+		buildAccelerationStructures ();
+		ResidentScene* scene = new ResidentScene ();
+		scene->mName = scenes[i];
+		swapScene (*scene);
+		gResidentScenes.push_back (scene);
+	}
+	selectSIMDKernels ();
+
+	// A socket file left behind by an earlier server would make bind fail
+	sockaddr_un address;
+	if (!unixSocketAddress (gServeSocket, address)) {
+		printf ("The socket path %s is too long\n", gServeSocket);
+		exit(0);
+	}
+	unlink (gServeSocket);
+	gServerListener = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (gServerListener < 0 || bind (gServerListener, (sockaddr*)&address, sizeof (address)) != 0 || listen (gServerListener, 16) != 0) {
+		printf ("Unable to listen on %s: %s\n", gServeSocket, strerror (errno));
+		exit(1);
+	}
+
+	// A client that hangs up mid-reply must not take the server down
+	signal (SIGPIPE, SIG_IGN);
+	printf ("Serving %u scene(s) on %s\n", (unsigned int)gResidentScenes.size (), gServeSocket);
+	fflush (stdout);
+
+	while (true) {
+		int connection = accept (gServerListener, NULL, NULL);
+		if (connection >= 0) {
+			std::thread (serveConnection, connection).detach ();
+		}
+
+		else if (errno != EINTR && errno != ECONNABORTED) {
+			break;
+		}
+	}
+
+	// Keep the render lock from here on, so no request starts on a scene that is being freed
+	gRenderMutex.lock ();
+	close (gServerListener);
+	unlink (gServeSocket);
+	printf ("Server stopped\n");
+	return 0;
+}
+
+/*************************************************************/
+// Distributed Rendering
+/*************************************************************/
+// With --distribute PORT, hw3 becomes a coordinator: it splits the image into bands of whole tile rows and hands them
+// to worker processes over TCP, then assembles their pixels in the framebuffer and saves it. A worker is hw3 run with
+// the same scene and options plus --worker HOST:PORT; it loads the scene, renders each band it is given with draw_rows
+// and sends the rows back. --spawn N starts N workers on this machine and --ssh HOST,... one on each host (which must
+// see the binary and the scene at the same paths). Workers ask for the next band as soon as they have sent one, so
+// fast workers take more bands; once none are left, idle workers get copies of the bands still out, and whichever
+// copy arrives first is kept. A slow, stuck or lost worker therefore can't hold up the frame.
+int gDistributePort = -1;
+unsigned int gSpawnWorkers = 0;
+const char* gWorkerHosts = NULL;
+const char* gWorkerAddress = NULL;
+
+// Most workers --spawn starts on this machine
+const long MAX_SPAWN_WORKERS = 64;
+
+// Rows per band. A multiple of the tile size, so a band is whole rows of tiles.
+const unsigned int DISTRIBUTED_BAND_HEIGHT = 2 * TILE_SIZE;
+
+// Seconds a worker keeps trying to reach a coordinator that isn't listening yet
+const int WORKER_CONNECT_TIMEOUT = 10;
+
+// What this process would render, for the coordinator to check a worker against
+void describeDistributedSettings (const char* scene, DistributedSettings& settings) {
+
+	memset (&settings, 0, sizeof (settings));
+	const Vector3* vectors[] = { &gViewEye, &gViewLookAt, &gViewUp };
+	double* fields[] = { settings.mEye, settings.mLookAt, settings.mUp };
+	for (int i = 0; i < 3; i++) {
+		fields[i][0] = vectors[i]->mX;
+		fields[i][1] = vectors[i]->mY;
+		fields[i][2] = vectors[i]->mZ;
+	}
+	settings.mFov = gViewFov;
+	settings.mAdaptiveThreshold = gAdaptiveThreshold;
+	settings.mLightCull = gLightCull;
+	settings.mWidth = gWidth;
+	settings.mHeight = gHeight;
+	settings.mSSAA = gUseAA ? 1 : 0;
+	settings.mAdaptive = gAdaptiveAA ? gAdaptiveSamples : 0;
+	settings.mPattern = gSamplePattern;
+	settings.mLightCut = gLightCut;
+	settings.mLightSamples = gLightSamples;
+	settings.mRealSize = sizeof (Real);
+
+	const char* name = strrchr (scene, '/');
+	snprintf (settings.mScene, sizeof (settings.mScene), "%s", (name != NULL) ? name + 1 : scene);
+}
+
+struct DistributedBand {
+	unsigned int mY0;
+	unsigned int mY1;
+	unsigned int mCopies;	// Copies being rendered right now
+	unsigned int mOrder;	// When the band was first handed out
+	bool mDone;
+};
+
+// Hands out the bands and collects the results into the framebuffer. Thread safe; every worker connection has a thread.
+class BandScheduler {
+private:
+	std::mutex mMutex;
+	std::condition_variable mChanged;
+	std::vector<DistributedBand> mBands;
+	std::deque<int> mPending;
+	unsigned int mDone;
+	unsigned int mHandedOut;
+	unsigned int mReassigned;
+	unsigned int mWorkers;
+
+public:
+	BandScheduler () : mDone (0), mHandedOut (0), mReassigned (0), mWorkers (0) {}
+
+	// Split rows [0, height) into bands
+	void init (unsigned int height);
+
+	// Next band for an idle worker: one nobody has had yet, else a copy of the unfinished band with the fewest copies
+	// out that was handed out first. Returns -1 once every band is done.
+	int next ();
+
+	// A copy of band came back. Returns whether it was the first, and so went into the framebuffer.
+	bool complete (int band, const unsigned char* pixels);
+
+	// A worker went away while rendering band. Returns whether the band still had to be done.
+	bool release (int band);
+
+	void addWorker ();
+	void removeWorker ();
+
+	// Wait up to milliseconds for the last band. Returns whether the image is complete.
+	bool waitUntilDone (int milliseconds);
+
+	inline unsigned int getBandCount () const { return (unsigned int)mBands.size (); }
+	inline unsigned int getReassigned () const { return mReassigned; }
+	unsigned int getWorkers ();
+
+	inline const DistributedBand& getBand (int band) const { return mBands[band]; }
+};
+
+void BandScheduler::init (unsigned int height) {
+
+	for (unsigned int y = 0; y < height; y += DISTRIBUTED_BAND_HEIGHT) {
+		DistributedBand band = { y, std::min (y + DISTRIBUTED_BAND_HEIGHT, height), 0, 0, false };
+		mPending.push_back ((int)mBands.size ());
+		mBands.push_back (band);
+	}
+}
+
+int BandScheduler::next () {
+
+	std::lock_guard<std::mutex> lock (mMutex);
+	if (!mPending.empty ()) {
+		int band = mPending.front ();
+		mPending.pop_front ();
+		if (mBands[band].mCopies == 0 && mBands[band].mOrder == 0) {
+			mBands[band].mOrder = ++mHandedOut;
+		}
+		mBands[band].mCopies++;
+		return band;
+	}
+
+	// Nothing left that nobody has; help with the bands that are still out
+	int best = -1;
+	for (size_t i = 0; i < mBands.size (); i++) {
+		const DistributedBand& band = mBands[i];
+		if (!band.mDone && (best < 0 || band.mCopies < mBands[best].mCopies
+			|| (band.mCopies == mBands[best].mCopies && band.mOrder < mBands[best].mOrder))) {
+			best = (int)i;
+		}
+	}
+
+	if (best >= 0) {
+		mBands[best].mCopies++;
+		mReassigned++;
+	}
+	return best;
+}
+
+bool BandScheduler::complete (int band, const unsigned char* pixels) {
+
+	std::lock_guard<std::mutex> lock (mMutex);
+	DistributedBand& record = mBands[band];
+	record.mCopies--;
+	if (record.mDone) {
+		return false;
+	}
+
+	memcpy (&buffer[(size_t)record.mY0 * gWidth * 3], pixels, (size_t)(record.mY1 - record.mY0) * gWidth * 3);
+	record.mDone = true;
+	mDone++;
+	mChanged.notify_all ();
+	return true;
+}
+
+bool BandScheduler::release (int band) {
+
+	std::lock_guard<std::mutex> lock (mMutex);
+	DistributedBand& record = mBands[band];
+	record.mCopies--;
+	if (!record.mDone && record.mCopies == 0) {
+		mPending.push_front (band);
+		mReassigned++;
+	}
+	return !record.mDone;
+}
+
+void BandScheduler::addWorker () {
+	std::lock_guard<std::mutex> lock (mMutex);
+	mWorkers++;
+}
+
+void BandScheduler::removeWorker () {
+	std::lock_guard<std::mutex> lock (mMutex);
+	mWorkers--;
+	mChanged.notify_all ();
+}
+
+unsigned int BandScheduler::getWorkers () {
+	std::lock_guard<std::mutex> lock (mMutex);
+	return mWorkers;
+}
+
+bool BandScheduler::waitUntilDone (int milliseconds) {
+
+	std::unique_lock<std::mutex> lock (mMutex);
+	mChanged.wait_for (lock, std::chrono::milliseconds (milliseconds), [this] { return mDone == mBands.size (); });
+	return mDone == mBands.size ();
+}
+
+// One connected worker, as the coordinator sees it
+struct WorkerRecord {
+	int mConnection;
+	std::string mName;
+	unsigned int mPid;
+	unsigned int mBands;		// Bands that went into the image
+	unsigned int mDiscarded;	// Copies that arrived after another
+	bool mFinished;				// Told that the image is complete
+};
+
+struct Coordinator {
+	BandScheduler mScheduler;
+	DistributedSettings mSettings;
+	int mListener;
+
+	// Guards mWorkers and mThreads, which the accepting thread adds to
+	std::mutex mMutex;
+	std::vector<WorkerRecord*> mWorkers;
+	std::vector<std::thread> mThreads;
+};
+
+// Worker connection thread body--check the worker's settings, then keep it busy until the image is done
+void coordinateWorker (Coordinator& coordinator, WorkerRecord& worker) {
+
+	setTraceThreadName ("worker connection");
+	uint32_t type;
+	std::vector<char> payload;
+	WorkerHello hello;
+	if (!receiveFrame (worker.mConnection, type, payload, sizeof (hello)) || type != FRAME_WORKER_HELLO
+		|| payload.size () != sizeof (hello)) {
+		printf ("Dropped a connection that didn't introduce itself as a worker\n");
+		shutdown (worker.mConnection, SHUT_RDWR);
+		return;
+	}
+
+	memcpy (&hello, &payload[0], sizeof (hello));
+	hello.mHost[sizeof (hello.mHost) - 1] = 0;
+	char name[128];
+	snprintf (name, sizeof (name), "%s:%u", hello.mHost, hello.mPid);
+	if (memcmp (&hello.mSettings, &coordinator.mSettings, sizeof (hello.mSettings)) != 0) {
+		printf ("Worker %s renders %s with other settings; turned away\n", name, hello.mSettings.mScene);
+		sendText (worker.mConnection, FRAME_ERROR, "Your scene, image size, camera, antialiasing, light options or precision differ from the coordinator's");
+		shutdown (worker.mConnection, SHUT_RDWR);
+		return;
+	}
+	worker.mName = name;
+	worker.mPid = hello.mPid;
+
+	printf ("Worker %s joined\n", name);
+	coordinator.mScheduler.addWorker ();
+	const size_t row = (size_t)gWidth * 3;
+	while (true) {
+		int band = coordinator.mScheduler.next ();
+		if (band < 0) {
+			worker.mFinished = sendFrame (worker.mConnection, FRAME_FINISHED, NULL, 0);
+			break;
+		}
+
+		const DistributedBand& record = coordinator.mScheduler.getBand (band);
+		BandHeader assignment = { (uint32_t)band, record.mY0, record.mY1 };
+		BandHeader result;
+		size_t expected = sizeof (result) + (record.mY1 - record.mY0) * row;
+		if (!sendFrame (worker.mConnection, FRAME_ASSIGN, &assignment, sizeof (assignment))
+			|| !receiveFrame (worker.mConnection, type, payload, (uint32_t)expected) || type != FRAME_BAND || payload.size () != expected
+			|| memcmp (&payload[0], &assignment, sizeof (assignment)) != 0) {
+			// Workers still busy with a copy of a finished band are cut off once the image is done
+			if (coordinator.mScheduler.release (band)) {
+				printf ("Lost worker %s; its band goes back to the others\n", name);
+			}
+			break;
+		}
+
+		if (coordinator.mScheduler.complete (band, (const unsigned char*)&payload[sizeof (result)])) {
+			worker.mBands++;
+		}
+
+		else {
+			worker.mDiscarded++;
+		}
+	}
+	coordinator.mScheduler.removeWorker ();
+}
+
+// Accept workers until the listening socket is shut down
+void acceptWorkers (Coordinator& coordinator) {
+
+	while (true) {
+		int connection = accept (coordinator.mListener, NULL, NULL);
+		if (connection < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		int noDelay = 1;
+		setsockopt (connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay));
+		WorkerRecord* worker = new WorkerRecord ();
+		worker->mConnection = connection;
+		worker->mPid = 0;
+		worker->mBands = 0;
+		worker->mDiscarded = 0;
+		worker->mFinished = false;
+
+		std::lock_guard<std::mutex> lock (coordinator.mMutex);
+		coordinator.mWorkers.push_back (worker);
+		coordinator.mThreads.push_back (std::thread (coordinateWorker, std::ref (coordinator), std::ref (*worker)));
+	}
+}
+
+// Quote an argument for the remote shell
+std::string shellQuote (const std::string& text) {
+
+	std::string quoted = "'";
+	for (size_t i = 0; i < text.size (); i++) {
+		quoted += (text[i] == '\'') ? std::string ("'\\''") : std::string (1, text[i]);
+	}
+	return quoted + "'";
+}
+
+// The coordinator's command line for its workers: everything but the distribution and trace options
+std::vector<std::string> workerArguments (int argc, char** argv) {
+
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++) {
+		if ((strcmp (argv[i], "--distribute") == 0 || strcmp (argv[i], "--spawn") == 0 || strcmp (argv[i], "--ssh") == 0
+			|| strcmp (argv[i], "--trace") == 0) && i + 1 < argc) {
+			i++;
+			continue;
+		}
+		args.push_back (argv[i]);
+	}
+	return args;
+}
+
+// Start a worker that connects back to address: this binary on this machine, or over ssh on host. Relative paths are
+// resolved against the current directory, which the remote side changes to first. Returns the child's pid, or -1 if
+// no process could be started.
+pid_t launchWorker (const char* program, std::vector<std::string> args, const char* host, const std::string& address) {
+
+	args.push_back ("--worker");
+	args.push_back (address);
+
+	std::vector<std::string> command;
+	if (host == NULL) {
+		command.push_back (program);
+		command.insert (command.end (), args.begin (), args.end ());
+	}
+
+	else {
+		char directory[4096];
+		std::string cwd = (getcwd (directory, sizeof (directory)) != NULL) ? directory : ".";
+		std::string binary = program;
+		if (binary.find ('/') != std::string::npos && binary[0] != '/') {
+			binary = cwd + "/" + binary;
+		}
+
+		std::string remote = "cd " + shellQuote (cwd) + " && " + shellQuote (binary);
+		for (size_t i = 0; i < args.size (); i++) {
+			remote += " " + shellQuote (args[i]);
+		}
+		command.push_back ("ssh");
+		command.push_back (host);
+		command.push_back (remote);
+	}
+
+	std::vector<char*> argv;
+	for (size_t i = 0; i < command.size (); i++) {
+		argv.push_back ((char*)command[i].c_str ());
+	}
+	argv.push_back (NULL);
+
+	fflush (stdout);
+	pid_t pid = fork ();
+	if (pid < 0) {
+		printf ("Unable to start a worker process: %s\n", strerror (errno));
+		return -1;
+	}
+	if (pid == 0) {
+		execvp (argv[0], &argv[0]);
+		printf ("Unable to start %s: %s\n", argv[0], strerror (errno));
+		_exit (127);
+	}
+	return pid;
+}
+
+// Hand the bands out to workers, assemble the image and save it
+int runCoordinator (int argc, char** argv, const char* scene) {
+
+	Coordinator coordinator;
+	describeDistributedSettings (scene, coordinator.mSettings);
+	coordinator.mScheduler.init (gHeight);
+
+	// The port is unauthenticated, so it is only opened to other machines when workers are expected from them
+	bool localOnly = gSpawnWorkers > 0 && gWorkerHosts == NULL;
+	sockaddr_in address;
+	memset (&address, 0, sizeof (address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl (localOnly ? INADDR_LOOPBACK : INADDR_ANY);
+	address.sin_port = htons ((uint16_t)gDistributePort);
+	socklen_t length = sizeof (address);
+	int reuse = 1;
+	coordinator.mListener = socket (AF_INET, SOCK_STREAM, 0);
+	if (coordinator.mListener < 0 || setsockopt (coordinator.mListener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof (reuse)) != 0
+		|| bind (coordinator.mListener, (sockaddr*)&address, sizeof (address)) != 0 || listen (coordinator.mListener, 64) != 0
+		|| getsockname (coordinator.mListener, (sockaddr*)&address, &length) != 0) {
+		printf ("Unable to listen on port %i: %s\n", gDistributePort, strerror (errno));
+		exit(1);
+	}
+	fcntl (coordinator.mListener, F_SETFD, FD_CLOEXEC);
+	unsigned int port = ntohs (address.sin_port);
+
+	char host[256] = "localhost";
+	gethostname (host, sizeof (host) - 1);
+	printf ("Coordinating %ux%u in %u bands of %u rows on port %u\n", gWidth, gHeight, coordinator.mScheduler.getBandCount (),
+		DISTRIBUTED_BAND_HEIGHT, port);
+
+	// Local workers split the cores between them unless --threads says otherwise
+	std::vector<std::string> args = workerArguments (argc, argv);
+	std::vector<pid_t> launched;
+	char local[64];
+	snprintf (local, sizeof (local), "127.0.0.1:%u", port);
+	std::vector<std::string> localArgs = args;
+	if (gNumThreads == 0 && gSpawnWorkers > 0) {
+		char threads[32];
+		snprintf (threads, sizeof (threads), "%u", std::max (1u, std::thread::hardware_concurrency () / gSpawnWorkers));
+		localArgs.push_back ("--threads");
+		localArgs.push_back (threads);
+	}
+	// Only started workers go into launched, so every pid waited for or stopped below is a child of this process
+	unsigned int attempted = 0;
+	for (unsigned int i = 0; i < gSpawnWorkers; i++) {
+		pid_t pid = launchWorker (argv[0], localArgs, NULL, local);
+		if (pid > 0) {
+			launched.push_back (pid);
+		}
+		attempted++;
+	}
+
+	char remote[320];
+	snprintf (remote, sizeof (remote), "%s:%u", host, port);
+	std::string hosts = (gWorkerHosts != NULL) ? gWorkerHosts : "";
+	for (size_t begin = 0; begin < hosts.size (); ) {
+		size_t end = std::min (hosts.find (',', begin), hosts.size ());
+		if (end > begin) {
+			pid_t pid = launchWorker (argv[0], args, hosts.substr (begin, end - begin).c_str (), remote);
+			if (pid > 0) {
+				launched.push_back (pid);
+			}
+			attempted++;
+		}
+		begin = end + 1;
+	}
+
+	if (attempted > 0 && launched.empty ()) {
+		printf ("None of the %u worker(s) could be started\n", attempted);
+		exit(1);
+	}
+	if (launched.empty ()) {
+		printf ("Waiting for workers: run the same scene and options with --worker %s\n", remote);
+	}
+	fflush (stdout);
+
+	// A worker that hangs up mid-band must not take the coordinator down
+	signal (SIGPIPE, SIG_IGN);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	std::thread acceptor (acceptWorkers, std::ref (coordinator));
+
+	// Give up if every launched worker has exited with bands left and nobody else is connected
+	std::vector<bool> exited (launched.size (), false);
+	while (!coordinator.mScheduler.waitUntilDone (1000)) {
+		bool running = false;
+		for (size_t i = 0; i < launched.size (); i++) {
+			exited[i] = exited[i] || launched[i] <= 0 || (waitpid (launched[i], NULL, WNOHANG) != 0);
+			running = running || !exited[i];
+		}
+		if (!launched.empty () && !running && coordinator.mScheduler.getWorkers () == 0) {
+			printf ("Every worker exited before the image was finished\n");
+			exit(1);
+		}
+	}
+	double elapsed = std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+
+	// Stop accepting, and stop waiting for the workers still busy with copies of finished bands. Only the reading side
+	// is shut down, so the connection threads that are telling their workers the image is done still can.
+	shutdown (coordinator.mListener, SHUT_RDWR);
+	acceptor.join ();
+	{
+		std::lock_guard<std::mutex> lock (coordinator.mMutex);
+		for (size_t i = 0; i < coordinator.mWorkers.size (); i++) {
+			shutdown (coordinator.mWorkers[i]->mConnection, SHUT_RD);
+		}
+	}
+	for (size_t i = 0; i < coordinator.mThreads.size (); i++) {
+		coordinator.mThreads[i].join ();
+	}
+	close (coordinator.mListener);
+
+	unsigned int joined = 0;
+	for (size_t i = 0; i < coordinator.mWorkers.size (); i++) {
+		joined += coordinator.mWorkers[i]->mPid != 0;
+	}
+	printf ("Rendered %ux%u in %.3f ms on %u worker(s): %u bands, %u handed out again\n", gWidth, gHeight, elapsed, joined,
+		coordinator.mScheduler.getBandCount (), coordinator.mScheduler.getReassigned ());
+	for (size_t i = 0; i < coordinator.mWorkers.size (); i++) {
+		const WorkerRecord& worker = *coordinator.mWorkers[i];
+		if (worker.mPid != 0) {
+			printf ("  Worker %s: %u band(s)%s\n", worker.mName.c_str (), worker.mBands,
+				(worker.mDiscarded > 0) ? ", plus copies that came too late" : "");
+		}
+	}
+
+	save_jpg ();
+	if (gCompareFile != NULL) {
+		compareWithReference ();
+	}
+
+	// Workers that were told the image is done exit on their own; the rest see the connection close, or are stopped
+	for (size_t i = 0; i < coordinator.mWorkers.size (); i++) {
+		close (coordinator.mWorkers[i]->mConnection);
+	}
+	for (size_t i = 0; i < launched.size (); i++) {
+		bool finished = false;
+		for (size_t j = 0; j < coordinator.mWorkers.size (); j++) {
+			finished = finished || (coordinator.mWorkers[j]->mPid == (unsigned int)launched[i] && coordinator.mWorkers[j]->mFinished);
+		}
+		if (launched[i] <= 0) {
+			continue;
+		}
+		if (!exited[i] && !finished) {
+			kill (launched[i], SIGKILL);
+		}
+		if (!exited[i]) {
+			waitpid (launched[i], NULL, 0);
+		}
+	}
+	for (size_t i = 0; i < coordinator.mWorkers.size (); i++) {
+		delete coordinator.mWorkers[i];
+	}
+	return 0;
+}
+
+// Connect to the coordinator at HOST:PORT, retrying while it starts up. Returns -1 on failure.
+int connectToCoordinator (const char* address) {
+
+	std::string text = address;
+	size_t colon = text.find_last_of (':');
+	if (colon == std::string::npos) {
+		return -1;
+	}
+	std::string host = text.substr (0, colon);
+	std::string port = text.substr (colon + 1);
+
+	addrinfo hints;
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for (int attempt = 0; attempt < WORKER_CONNECT_TIMEOUT * 10; attempt++) {
+		addrinfo* addresses;
+		if (getaddrinfo (host.c_str (), port.c_str (), &hints, &addresses) == 0) {
+			for (addrinfo* candidate = addresses; candidate != NULL; candidate = candidate->ai_next) {
+				int connection = socket (candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+				if (connection >= 0 && connect (connection, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+					freeaddrinfo (addresses);
+					int noDelay = 1;
+					setsockopt (connection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof (noDelay));
+					return connection;
+				}
+				if (connection >= 0) {
+					close (connection);
+				}
+			}
+			freeaddrinfo (addresses);
+		}
+		std::this_thread::sleep_for (std::chrono::milliseconds (100));
+	}
+	return -1;
+}
+
+// Render the bands the coordinator hands out until it says the image is done
+int runWorker (const char* scene) {
+
+	int connection = connectToCoordinator (gWorkerAddress);
+	if (connection < 0) {
+		printf ("Unable to reach the coordinator at %s\n", gWorkerAddress);
+		return 1;
+	}
+
+	WorkerHello hello;
+	memset (&hello, 0, sizeof (hello));
+	describeDistributedSettings (scene, hello.mSettings);
+	hello.mPid = (uint32_t)getpid ();
+	gethostname (hello.mHost, sizeof (hello.mHost) - 1);
+	signal (SIGPIPE, SIG_IGN);
+	if (!sendFrame (connection, FRAME_WORKER_HELLO, &hello, sizeof (hello))) {
+		printf ("The coordinator at %s hung up\n", gWorkerAddress);
+		return 1;
+	}
+
+	selectRenderKernel ();
+	unsigned int threads = (gNumThreads == 0) ? std::max (1u, std::thread::hardware_concurrency ()) : gNumThreads;
+	std::vector<unsigned char> pixels;
+	unsigned int bands = 0;
+	bool finished = false;
+	uint32_t type;
+	std::vector<char> payload;
+	while (receiveFrame (connection, type, payload)) {
+		if (type == FRAME_ASSIGN && payload.size () == sizeof (BandHeader)) {
+			BandHeader band;
+			memcpy (&band, &payload[0], sizeof (band));
+			if (band.mY0 >= band.mY1 || band.mY1 > gHeight) {
+				break;
+			}
+
+			TraceScope trace ("band", "y0", band.mY0);
+			pixels.assign ((size_t)(band.mY1 - band.mY0) * gWidth * 3, 0);
+			gTarget = &pixels[0];
+			gTargetY0 = band.mY0;
+			draw_rows (band.mY0, band.mY1, threads);
+			gTarget = NULL;
+			if (!sendFrame (connection, FRAME_BAND, &band, sizeof (band), &pixels[0], pixels.size ())) {
+				break;
+			}
+			bands++;
+		}
+
+		else if (type == FRAME_FINISHED) {
+			finished = true;
+			break;
+		}
+
+		else if (type == FRAME_ERROR) {
+			printf ("Turned away by the coordinator: %s\n", std::string (payload.begin (), payload.end ()).c_str ());
+			close (connection);
+			return 1;
+		}
+
+		else {
+			break;
+		}
+	}
+	close (connection);
+
+	printf ("Worker rendered %u band(s)%s\n", bands, finished ? "" : "; the coordinator hung up");
+	reportTraversalStats ();
+	return finished ? 0 : 1;
+}
+#endif
+
+// The benchmark build (make benchmark) includes this file and brings its own main
+#ifndef HW3_BENCHMARK
+/*************************************************************/
+// Main Function
+/*************************************************************/
+// Most render threads --threads accepts
+const long MAX_THREADS = 1024;
+
+// Parse a whole number in [low, high] as an option value. Fails on anything else, including trailing characters.
+bool parseOptionValue (const char* text, long low, long high, long& value) {
+
+	char* end;
+	errno = 0;
+	long parsed = strtol (text, &end, 10);
+	if (end == text || *end != 0 || errno != 0 || parsed < low || parsed > high) {
+		return false;
+	}
+	value = parsed;
+	return true;
+}
+
+// Parse a finite real number as an option value. Fails on anything else, including trailing characters.
+bool parseOptionReal (const char* text, double& value) {
+
+	char* end;
+	errno = 0;
+	double parsed = strtod (text, &end);
+	if (end == text || *end != 0 || errno != 0 || !std::isfinite (parsed)) {
+		return false;
+	}
+	value = parsed;
+	return true;
+}
+
+int main(int argc, char ** argv)
 {
-	if ((argc < 2) || (argc > 4))
+	// Camera defaults: at the origin, looking down -Z
+	Vector3 eye (0, 0, 0);
+	Vector3 lookAt (0, 0, -1);
+	Vector3 up (0, 1, 0);
+	double fov = 60.0;
+
+	// Separate the options from the positional arguments
+	std::vector<char*> args;
+	args.push_back(argv[0]);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--threads") == 0 && i + 1 < argc) {
+			long threads;
+			if (!parseOptionValue (argv[++i], 1, MAX_THREADS, threads)) {
+				printf ("--threads takes a thread count from 1 to %li\n", MAX_THREADS);
+				exit(0);
+			}
+			gNumThreads = (unsigned int)threads;
+		}
+		else if (strcmp (argv[i], "--packets") == 0) {
+			gUsePackets = true;
+		}
+		else if (strcmp (argv[i], "--no-simd") == 0) {
+			gAllowSIMD = false;
+		}
+		else if (strcmp (argv[i], "--generic-kernel") == 0) {
+			gSpecializedKernels = false;
+		}
+#ifndef WIN32
+		else if (strcmp (argv[i], "--serve") == 0 && i + 1 < argc) {
+			gServeSocket = argv[++i];
+		}
+		else if (strcmp (argv[i], "--distribute") == 0 && i + 1 < argc) {
+			long port;
+			if (!parseOptionValue (argv[++i], 0, 65535, port)) {
+				printf ("--distribute takes a TCP port from 0 (any free port) to 65535\n");
+				exit(0);
+			}
+			gDistributePort = (int)port;
+		}
+		else if (strcmp (argv[i], "--spawn") == 0 && i + 1 < argc) {
+			long workers;
+			if (!parseOptionValue (argv[++i], 1, MAX_SPAWN_WORKERS, workers)) {
+				printf ("--spawn takes 1 to %li workers\n", MAX_SPAWN_WORKERS);
+				exit(0);
+			}
+			gSpawnWorkers = (unsigned int)workers;
+		}
+		else if (strcmp (argv[i], "--ssh") == 0 && i + 1 < argc) {
+			gWorkerHosts = argv[++i];
+		}
+		else if (strcmp (argv[i], "--worker") == 0 && i + 1 < argc) {
+			gWorkerAddress = argv[++i];
+		}
+#endif
+		else if (strcmp (argv[i], "--cache") == 0) {
+			gUseSceneCache = true;
+		}
+		else if (strcmp (argv[i], "--verbose") == 0) {
+			gVerboseParse = true;
+		}
+		else if (strcmp (argv[i], "--adaptive") == 0 && i + 1 < argc) {
+			gAdaptiveAA = true;
+			gAdaptiveSamples = atoi (argv[++i]);
+			if (gAdaptiveSamples != 4 && gAdaptiveSamples != 8 && gAdaptiveSamples != 16) {
+				printf ("--adaptive takes 4, 8 or 16 samples\n");
+				exit(0);
+			}
+		}
+		else if (strcmp (argv[i], "--pattern") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp (argv[i], "rgss") == 0) {
+				gSamplePattern = PATTERN_ROTATED_GRID;
+			}
+			else if (strcmp (argv[i], "stratified") == 0) {
+				gSamplePattern = PATTERN_STRATIFIED;
+			}
+			else {
+				printf ("--pattern takes rgss or stratified\n");
+				exit(0);
+			}
+		}
+		else if (strcmp (argv[i], "--aa-threshold") == 0 && i + 1 < argc) {
+			if (!parseOptionReal (argv[++i], gAdaptiveThreshold) || gAdaptiveThreshold < 0) {
+				printf ("--aa-threshold takes a color difference of 0 or more\n");
+				exit(0);
+			}
+		}
+		else if (strcmp (argv[i], "--stream") == 0) {
+			gStreamOutput = true;
+		}
+		else if (strcmp (argv[i], "--progressive") == 0) {
+			gProgressive = true;
+		}
+		else if (strcmp (argv[i], "--budget") == 0 && i + 1 < argc) {
+			if (!parseOptionReal (argv[++i], gBudget) || gBudget <= 0) {
+				printf ("--budget takes a time limit in milliseconds above 0\n");
+				exit(0);
+			}
+			gProgressive = true;
+		}
+		else if (strcmp (argv[i], "--light-tree") == 0 && i + 1 < argc) {
+			long cut;
+			if (!parseOptionValue (argv[++i], 1, LIGHT_CUT_MAX, cut)) {
+				printf ("--light-tree takes a cut of 1 to %u clusters\n", LIGHT_CUT_MAX);
+				exit(0);
+			}
+			gLightCut = (unsigned int)cut;
+		}
+		else if (strcmp (argv[i], "--light-samples") == 0 && i + 1 < argc) {
+			long samples;
+			if (!parseOptionValue (argv[++i], 1, LIGHT_SAMPLES_MAX, samples)) {
+				printf ("--light-samples takes 1 to %u samples\n", LIGHT_SAMPLES_MAX);
+				exit(0);
+			}
+			gLightSamples = (unsigned int)samples;
+		}
+		else if (strcmp (argv[i], "--light-cull") == 0 && i + 1 < argc) {
+			if (!parseOptionReal (argv[++i], gLightCull) || gLightCull < 0) {
+				printf ("--light-cull takes a contribution threshold of 0 or more\n");
+				exit(0);
+			}
+		}
+		else if (strcmp (argv[i], "--trace") == 0 && i + 1 < argc) {
+			gTraceFile = argv[++i];
+			gTraceEnabled = true;
+		}
+		else if (strcmp (argv[i], "--heatmap") == 0 && i + 1 < argc) {
+			gHeatmapFile = argv[++i];
+		}
+		else if (strcmp (argv[i], "--compare") == 0 && i + 1 < argc) {
+			gCompareFile = argv[++i];
+		}
+		else if (strcmp (argv[i], "--heatmap-counter") == 0 && i + 1 < argc) {
+			const char* names[] = { "primary", "shadow", "tests", "hits", "shading" };
+			int counter = 0;
+			i++;
+			while (counter < 5 && strcmp (argv[i], names[counter]) != 0) {
+				counter++;
+			}
+			if (counter == 5) {
+				printf ("--heatmap-counter takes primary, shadow, tests, hits or shading\n");
+				exit(0);
+			}
+			gHeatmapCounter = (CostCounter)counter;
+		}
+		else if (strcmp (argv[i], "--size") == 0 && i + 1 < argc) {
+			if (sscanf (argv[++i], "%ux%u", &gWidth, &gHeight) != 2 || gWidth == 0 || gHeight == 0) {
+				printf ("--size takes the image size as WIDTHxHEIGHT\n");
+				exit(0);
+			}
+			if (gWidth > MAX_IMAGE_SIZE || gHeight > MAX_IMAGE_SIZE || (size_t)gWidth * gHeight > MAX_IMAGE_PIXELS) {
+				printf ("--size takes at most %u pixels a side and %lu pixels in all\n", MAX_IMAGE_SIZE, (unsigned long)MAX_IMAGE_PIXELS);
+				exit(0);
+			}
+		}
+		else if (strcmp (argv[i], "--fov") == 0 && i + 1 < argc) {
+			fov = atof (argv[++i]);
+			if (fov <= 0 || fov >= 180) {
+				printf ("--fov takes a vertical field of view between 0 and 180 degrees\n");
+				exit(0);
+			}
+		}
+		else if ((strcmp (argv[i], "--eye") == 0 || strcmp (argv[i], "--look-at") == 0 || strcmp (argv[i], "--up") == 0) && i + 1 < argc) {
+			Vector3& target = (argv[i][2] == 'e') ? eye : ((argv[i][2] == 'l') ? lookAt : up);
+			double x, y, z;
+			if (sscanf (argv[i + 1], "%lf,%lf,%lf", &x, &y, &z) != 3) {
+				printf ("%s takes a point as x,y,z\n", argv[i]);
+				exit(0);
+			}
+			target = Vector3 (x, y, z);
+			i++;
+		}
+		else {
+			args.push_back (argv[i]);
+		}
+	}
+	int nargs = (int)args.size();
+	gViewEye = eye;
+	gViewLookAt = lookAt;
+	gViewUp = up;
+	gViewFov = fov;
+
+#ifndef WIN32
+	// Server mode: every positional argument is a scene to keep resident
+	if (gServeSocket != NULL && nargs >= 2)
+	{
+		if (gStreamOutput || gProgressive || gCompareFile != NULL || gHeatmapFile != NULL) {
+			printf ("--serve can't be combined with --stream, --progressive, --compare or --heatmap\n");
+			exit(0);
+		}
+		if (gLightCut > 0 && gLightSamples > 0) {
+			printf ("--light-tree and --light-samples are alternatives; pick one\n");
+			exit(0);
+		}
+		if (!gCamera.setup (eye, lookAt, up, fov, gWidth, gHeight)) {
+			printf ("The camera needs a look-at point away from the eye and an up vector that is not parallel to the view\n");
+			exit(0);
+		}
+		if (gTraceEnabled) {
+			setTraceThreadName ("server");
+			atexit (writeTrace);
+		}
+		return runServer (std::vector<char*> (args.begin () + 1, args.end ()));
+	}
+#endif
+
+	if ((nargs < 2) || (nargs > 4))
 	{	
-		printf ("Usage: %s <input scenefile> [output jpegname]\n", argv[0]);
+		printf ("Usage: %s <input scenefile> [output jpegname] [ssaa] [--threads N] [--packets] [--no-simd] [--generic-kernel] [--cache] [--verbose]\n"
+			"       [--adaptive 4|8|16] [--pattern rgss|stratified] [--aa-threshold T]\n"
+			"       [--progressive] [--budget ms] [--stream] [--heatmap file] [--heatmap-counter name] [--trace file]\n"
+			"       [--compare image] [--light-tree N | --light-samples K] [--light-cull T] [--size WxH] [--fov degrees] [--eye x,y,z] [--look-at x,y,z] [--up x,y,z]\n"
+			"       %s --serve socket <scenefile>... [options]\n"
+			"       %s <input scenefile> <output jpegname> [ssaa] --distribute port [--spawn N] [--ssh host,...] [options]\n"
+			"       %s <input scenefile> [output jpegname] [ssaa] --worker host:port [options]\n", argv[0], argv[0], argv[0], argv[0]);
 		exit(0);
 	}
 	// If there are four arguments, check to see if we should use SSAA
-	if(argc == 4) {
-		std::string aa (argv[3]); 
+	if(nargs == 4) {
+		std::string aa (args[3]); 
 		if (aa != "ssaa") {
 			exit (0);
 		}
@@ -994,28 +5887,118 @@ int main(int argc, char ** argv)
 			gUseAA = true;
 		}
 		mode = MODE_JPEG;
-		filename = argv[2];
+		filename = args[2];
 	}
 
 	// Otherwise, proceed as normal
-	if(argc == 3)
+	if(nargs == 3)
 	{
 		mode = MODE_JPEG;
-		filename = argv[2];
+		filename = args[2];
 	}
-	else if(argc == 2)
+	else if(nargs == 2)
 		mode = MODE_DISPLAY;
 
+	if (!gCamera.setup (eye, lookAt, up, fov, gWidth, gHeight)) {
+		printf ("The camera needs a look-at point away from the eye and an up vector that is not parallel to the view\n");
+		exit(0);
+	}
+	// Streamed images only ever hold a few bands
+	if (gStreamOutput && mode != MODE_JPEG) {
+		printf ("--stream needs an output file\n");
+		exit(0);
+	}
+	if (gStreamOutput && gCompareFile != NULL) {
+		printf ("--compare needs the whole image, so it can't be combined with --stream\n");
+		exit(0);
+	}
+	if (gLightCut > 0 && gLightSamples > 0) {
+		printf ("--light-tree and --light-samples are alternatives; pick one\n");
+		exit(0);
+	}
+	// Progressive rendering refines the framebuffer in place and ends with its own supersampling pass
+	if (gProgressive && (gStreamOutput || gAdaptiveAA)) {
+		printf ("--progressive can't be combined with --stream or --adaptive\n");
+		exit(0);
+	}
+	if (gProgressive) {
+		gUseAA = false;
+	}
+#ifndef WIN32
+	// Starting workers implies coordinating them, on any free port unless --distribute names one
+	if ((gSpawnWorkers > 0 || gWorkerHosts != NULL) && gDistributePort < 0) {
+		gDistributePort = 0;
+	}
+	if ((gDistributePort >= 0 || gWorkerAddress != NULL) && (gStreamOutput || gProgressive || gHeatmapFile != NULL)) {
+		printf ("--distribute and --worker can't be combined with --stream, --progressive or --heatmap\n");
+		exit(0);
+	}
+	if (gDistributePort >= 0 && gWorkerAddress != NULL) {
+		printf ("A process is either the coordinator (--distribute) or a worker (--worker)\n");
+		exit(0);
+	}
+	if (gDistributePort >= 0 && mode != MODE_JPEG) {
+		printf ("--distribute needs an output jpegname\n");
+		exit(0);
+	}
+#endif
+	// Workers only ever hold the bands they are given
+	if (!gStreamOutput && gWorkerAddress == NULL) {
+		buffer.assign ((size_t)gWidth * gHeight * 3, 0);
+	}
+	if (gTraceEnabled) {
+		setTraceThreadName ("main");
+		atexit (writeTrace);
+	}
+#ifdef HW3_COST_COUNTERS
+	gPixelCosts.assign ((size_t)gWidth * gHeight, PixelCost ());
+#else
+	if (gHeatmapFile != NULL) {
+		printf ("--heatmap needs a build with the cost counters (make COST_COUNTERS=1)\n");
+		exit(0);
+	}
+#endif
+
+#ifndef WIN32
+	// Distributed rendering: the coordinator never loads the scene, the workers render the bands it hands out
+	if (gDistributePort >= 0) {
+		return runCoordinator (argc, argv, args[1]);
+	}
+	if (gWorkerAddress != NULL) {
+		loadScene(args[1]);
+		buildAccelerationStructures();
+		selectSIMDKernels();
+		return runWorker (args[1]);
+	}
+#endif
+
+#ifdef HW3_HEADLESS
+	// There is no window to draw to, so render straight into the framebuffer, save it and exit
+	if(mode != MODE_JPEG)
+	{
+		printf ("The headless renderer needs an output jpegname\n");
+		exit(0);
+	}
+
+	loadScene(args[1]);
+	buildAccelerationStructures();
+	selectSIMDKernels();
+	render_frame();
+	return 0;
+#else
 	glutInit(&argc,argv);
-	loadScene(argv[1]);
+	loadScene(args[1]);
+	buildAccelerationStructures();
+	selectSIMDKernels();
 
 	glutInitDisplayMode(GLUT_RGBA | GLUT_SINGLE);
 	glutInitWindowPosition(0,0);
-	glutInitWindowSize(WIDTH,HEIGHT);
+	glutInitWindowSize(gWidth,gHeight);
 	int window = glutCreateWindow("Ray Tracer");
 	glutDisplayFunc(display);
 	glutIdleFunc(idle);
 	init();
 	glutMainLoop();
+#endif
 }
-
+#endif
@@ -0,0 +1,622 @@
+/* **************************
+ * CSCI 420
+ * Assignment 3 Raytracer -- kernel microbenchmarks
+ * *************************
+*/
+
+// Built by make benchmark. The renderer is compiled in headless and without its main, so the kernels measured here are
+// exactly the ones hw3 runs.
+#include "hw3.cpp"
+
+#include <random>
+
+/*************************************************************/
+// Inputs
+/*************************************************************/
+// Every kernel cycles through BENCHMARK_INPUTS prepared inputs, few enough to stay in cache so the numbers measure the
+// arithmetic rather than memory. Must be a power of two.
+const unsigned int BENCHMARK_INPUTS = 4096;
+
+// Lights shaded at every point by the multi-light kernels
+const int BENCHMARK_LIGHTS = 8;
+
+// Spheres in the scene the render kernels trace. Few enough that the per-sample overhead, not the hierarchy, dominates.
+const int BENCHMARK_SCENE_SPHERES = 16;
+
+// Light distance of the occlusion kernels: past every primitive, so a ray that hits one is occluded by it
+const double BENCHMARK_LIGHT_DISTANCE = HUGE_VAL;
+
+// Which rays a primitive benchmark traces
+enum RayDistribution {
+	RAYS_HIT,
+	RAYS_MISS,
+	RAYS_MIXED
+};
+
+// Random primitives in front of the origin, and rays from near the origin that are known to hit or miss them. Input i of
+// every array belongs to primitive i.
+struct BenchmarkInputs {
+	std::vector<Sphere> mSpheres;
+	std::vector<Triangle> mTriangles;
+	std::vector<TriangleRecord> mRecords;
+	std::vector<MeshTriangle> mMeshTriangles;
+	std::vector<Light> mLights;
+
+	std::vector<Ray> mSphereRays[3];
+	std::vector<Ray> mTriangleRays[3];
+
+	// Points where the hit rays meet the primitive, for the shading kernels
+	std::vector<Vector3> mSpherePoints;
+	std::vector<Vector3> mTrianglePoints;
+
+	// Unit vectors for computeLightMagnitude and computeReflectionMagnitude
+	std::vector<Vector3> mLightDirections;
+	std::vector<Vector3> mNormals;
+
+	// Pixels for the camera ray generators
+	std::vector<unsigned int> mPixelX;
+	std::vector<unsigned int> mPixelY;
+
+	// Indices of the BENCHMARK_LIGHTS scene lights, for shadeLightBatch
+	int mLit[BENCHMARK_LIGHTS];
+};
+
+BenchmarkInputs gInputs;
+
+// Sink for kernel results, so the compiler can't drop the work
+volatile double gBenchmarkSink;
+
+std::mt19937 gRandom (420);
+
+double randomDouble (double min, double max) {
+	return std::uniform_real_distribution<double> (min, max) (gRandom);
+}
+
+Vector3 randomVector (double min, double max) {
+	double x = randomDouble (min, max);
+	double y = randomDouble (min, max);
+	double z = randomDouble (min, max);
+	return Vector3 (x, y, z);
+}
+
+Vector3 randomDirection () {
+	Vector3 direction;
+	while (direction.distance () < 1e-6) {
+		direction = randomVector (-1, 1);
+	}
+	return direction.normalize ();
+}
+
+Ray rayTowards (const Vector3& origin, const Vector3& target) {
+	Vector3 direction = target - origin;
+	return Ray (origin, direction.normalize ());
+}
+
+void setVertex (Vertex& vertex, const Vector3& position, const Vector3& normal) {
+	vertex.position[0] = position.mX;
+	vertex.position[1] = position.mY;
+	vertex.position[2] = position.mZ;
+	vertex.normal[0] = normal.mX;
+	vertex.normal[1] = normal.mY;
+	vertex.normal[2] = normal.mZ;
+	for (int i = 0; i < 3; i++) {
+		vertex.color_diffuse[i] = randomDouble (0, 1);
+		vertex.color_specular[i] = randomDouble (0, 1);
+	}
+	vertex.shininess = randomDouble (1, 50);
+}
+
+// Fill gInputs, and the scene arrays calculateTriangleLighting reads. Primitives sit around z = -5 and ray origins in the
+// unit cube around the origin, so every origin is well outside every primitive.
+void generateInputs () {
+
+	for (unsigned int i = 0; i < BENCHMARK_INPUTS; i++) {
+		Vector3 origin = randomVector (-1, 1);
+
+		// Sphere. Hits aim inside the silhouette; misses aim 3 radii off the center, sideways to the view, which keeps
+		// the closest approach beyond 2 radii.
+		Sphere sphere;
+		Vector3 center = Vector3 (0, 0, -5) + randomVector (-1, 1);
+		sphere.position[0] = center.mX;
+		sphere.position[1] = center.mY;
+		sphere.position[2] = center.mZ;
+		sphere.radius = randomDouble (0.2, 1.0);
+		for (int j = 0; j < 3; j++) {
+			sphere.color_diffuse[j] = randomDouble (0, 1);
+			sphere.color_specular[j] = randomDouble (0, 1);
+		}
+		sphere.shininess = randomDouble (1, 50);
+		gInputs.mSpheres.push_back (sphere);
+
+		Ray sphereHit = rayTowards (origin, center + randomDirection () * (sphere.radius * 0.9 * randomDouble (0, 1)));
+		Vector3 side = Vector3::cross (center - origin, randomDirection ()).normalize ();
+		Ray sphereMiss = rayTowards (origin, center + side * (sphere.radius * 3));
+		gInputs.mSphereRays[RAYS_HIT].push_back (sphereHit);
+		gInputs.mSphereRays[RAYS_MISS].push_back (sphereMiss);
+		gInputs.mSphereRays[RAYS_MIXED].push_back ((gRandom () & 1) ? sphereHit : sphereMiss);
+
+		Vector3 spherePoint;
+		sphereHit.intersects (sphere, spherePoint);
+		gInputs.mSpherePoints.push_back (spherePoint);
+
+		// Triangle. Hits aim at a point well inside it; misses aim at a point in its plane, outside one of its edges.
+		Vector3 corners[3];
+		for (int j = 0; j < 3; j++) {
+			corners[j] = Vector3 (0, 0, -5) + randomVector (-1, 1);
+		}
+		Triangle triangle;
+		Vector3 planar = Vector3::cross (corners[1] - corners[0], corners[2] - corners[0]);
+		for (int j = 0; j < 3; j++) {
+			setVertex (triangle.v[j], corners[j], (planar + randomVector (-0.2, 0.2) * planar.magnitude ()).normalize ());
+		}
+		gInputs.mTriangles.push_back (triangle);
+
+		TriangleRecord record;
+		record.mVertex = corners[0];
+		record.mEdge1 = corners[1] - corners[0];
+		record.mEdge2 = corners[2] - corners[0];
+		gInputs.mRecords.push_back (record);
+
+		double u = randomDouble (0.1, 0.8);
+		double v = randomDouble (0.1, 0.9 - u);
+		Vector3 inside = corners[0] + record.mEdge1 * u + record.mEdge2 * v;
+		Vector3 outside = corners[0] + record.mEdge1 * randomDouble (-1.0, -0.2) + record.mEdge2 * randomDouble (0, 1);
+		Ray triangleHit = rayTowards (origin, inside);
+		Ray triangleMiss = rayTowards (origin, outside);
+		gInputs.mTriangleRays[RAYS_HIT].push_back (triangleHit);
+		gInputs.mTriangleRays[RAYS_MISS].push_back (triangleMiss);
+		gInputs.mTriangleRays[RAYS_MIXED].push_back ((gRandom () & 1) ? triangleHit : triangleMiss);
+		gInputs.mTrianglePoints.push_back (inside);
+
+		// The same triangle in the indexed mesh, one material per corner
+		MeshTriangle meshTriangle;
+		for (int j = 0; j < 3; j++) {
+			MeshVertex meshVertex;
+			Material material;
+			memcpy (meshVertex.position, triangle.v[j].position, sizeof (meshVertex.position));
+			memcpy (meshVertex.normal, triangle.v[j].normal, sizeof (meshVertex.normal));
+			memcpy (material.color_diffuse, triangle.v[j].color_diffuse, sizeof (material.color_diffuse));
+			memcpy (material.color_specular, triangle.v[j].color_specular, sizeof (material.color_specular));
+			material.shininess = triangle.v[j].shininess;
+			meshTriangle.v[j] = vertices.getSize ();
+			vertices.push (meshVertex);
+			materials.push (material);
+		}
+		TriangleMaterial corner = { { 3 * i, 3 * i + 1, 3 * i + 2 } };
+		meshTriangle.material = triangleMaterials.getSize ();
+		triangleMaterials.push (corner);
+		gInputs.mMeshTriangles.push_back (meshTriangle);
+
+		// A light somewhere behind the camera
+		Light light;
+		Vector3 lightPosition = randomVector (-5, 5) + Vector3 (0, 0, 5);
+		light.position[0] = lightPosition.mX;
+		light.position[1] = lightPosition.mY;
+		light.position[2] = lightPosition.mZ;
+		for (int j = 0; j < 3; j++) {
+			light.color[j] = randomDouble (0, 1);
+		}
+		gInputs.mLights.push_back (light);
+
+		gInputs.mLightDirections.push_back (randomDirection ());
+		gInputs.mNormals.push_back (randomDirection ());
+		gInputs.mPixelX.push_back (gRandom () % gWidth);
+		gInputs.mPixelY.push_back (gRandom () % gHeight);
+	}
+
+	// The first few lights also go into the scene, for the multi-light kernels
+	for (int j = 0; j < BENCHMARK_LIGHTS; j++) {
+		lights.push (gInputs.mLights[j]);
+		gInputs.mLit[j] = j;
+	}
+	buildLightArrays ();
+
+	// The first few spheres make the scene for the render kernels
+	std::vector<AABB> bounds;
+	for (int i = 0; i < BENCHMARK_SCENE_SPHERES; i++) {
+		const Sphere& sphere = gInputs.mSpheres[i];
+		spheres.push (sphere);
+		Vector3 center (sphere.position[0], sphere.position[1], sphere.position[2]);
+		Vector3 radius (sphere.radius, sphere.radius, sphere.radius);
+		bounds.push_back (AABB (center - radius, center + radius));
+	}
+	gSphereBVH.build (bounds);
+}
+
+// Fraction of the rays of a distribution that hit their primitive, as a check on the generator, and that the occlusion
+// kernels find occluded, which should be the same
+void measureHitRates (RayDistribution distribution, double& sphereRate, double& triangleRate, double& sphereOccluded,
+	double& triangleOccluded) {
+
+	unsigned int sphereHits = 0;
+	unsigned int triangleHits = 0;
+	unsigned int sphereShadows = 0;
+	unsigned int triangleShadows = 0;
+	for (unsigned int i = 0; i < BENCHMARK_INPUTS; i++) {
+		double t;
+		const Ray& sphereRay = gInputs.mSphereRays[distribution][i];
+		const Ray& triangleRay = gInputs.mTriangleRays[distribution][i];
+		sphereHits += sphereRay.intersects (gInputs.mSpheres[i], t);
+		triangleHits += triangleRay.intersects (gInputs.mRecords[i], t);
+		sphereShadows += sphereRay.occludedBy (gInputs.mSpheres[i], BENCHMARK_LIGHT_DISTANCE);
+		triangleShadows += triangleRay.occludedBy (gInputs.mRecords[i], BENCHMARK_LIGHT_DISTANCE);
+	}
+	sphereRate = 100.0 * sphereHits / BENCHMARK_INPUTS;
+	triangleRate = 100.0 * triangleHits / BENCHMARK_INPUTS;
+	sphereOccluded = 100.0 * sphereShadows / BENCHMARK_INPUTS;
+	triangleOccluded = 100.0 * triangleShadows / BENCHMARK_INPUTS;
+}
+
+/*************************************************************/
+// Kernels
+/*************************************************************/
+// Each kernel runs its operation iterations times over the inputs and returns a checksum of the results
+typedef double (*BenchmarkKernel) (unsigned int iterations, RayDistribution distribution);
+
+double benchmarkSphereIntersection (unsigned int iterations, RayDistribution distribution) {
+
+	const std::vector<Ray>& rays = gInputs.mSphereRays[distribution];
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		double t;
+		if (rays[index].intersects (gInputs.mSpheres[index], t)) {
+			sum += t;
+		}
+	}
+	return sum;
+}
+
+double benchmarkTriangleIntersection (unsigned int iterations, RayDistribution distribution) {
+
+	const std::vector<Ray>& rays = gInputs.mTriangleRays[distribution];
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		double t;
+		if (rays[index].intersects (gInputs.mTriangles[index], t)) {
+			sum += t;
+		}
+	}
+	return sum;
+}
+
+double benchmarkRecordIntersection (unsigned int iterations, RayDistribution distribution) {
+
+	const std::vector<Ray>& rays = gInputs.mTriangleRays[distribution];
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		double t;
+		if (rays[index].intersects (gInputs.mRecords[index], t)) {
+			sum += t;
+		}
+	}
+	return sum;
+}
+
+double benchmarkSphereOcclusion (unsigned int iterations, RayDistribution distribution) {
+
+	const std::vector<Ray>& rays = gInputs.mSphereRays[distribution];
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		sum += rays[index].occludedBy (gInputs.mSpheres[index], BENCHMARK_LIGHT_DISTANCE);
+	}
+	return sum;
+}
+
+double benchmarkRecordOcclusion (unsigned int iterations, RayDistribution distribution) {
+
+	const std::vector<Ray>& rays = gInputs.mTriangleRays[distribution];
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		sum += rays[index].occludedBy (gInputs.mRecords[index], BENCHMARK_LIGHT_DISTANCE);
+	}
+	return sum;
+}
+
+double benchmarkLightMagnitude (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		sum += computeLightMagnitude (gInputs.mLightDirections[index], gInputs.mNormals[index]);
+	}
+	return sum;
+}
+
+double benchmarkReflectionMagnitude (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		const Vector3& lightDirection = gInputs.mLightDirections[index];
+		const Vector3& normal = gInputs.mNormals[index];
+		sum += computeReflectionMagnitude (lightDirection.dot (normal), lightDirection, gInputs.mSpherePoints[index], normal);
+	}
+	return sum;
+}
+
+double benchmarkSphereLighting (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		Color color = calculateSphereLighting (gInputs.mSpheres[index], gInputs.mLights[index], gInputs.mSpherePoints[index]);
+		sum += color.mR + color.mG + color.mB;
+	}
+	return sum;
+}
+
+double benchmarkTriangleLighting (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		Color color = calculateTriangleLighting (gInputs.mMeshTriangles[index], gInputs.mLights[index], gInputs.mTrianglePoints[index]);
+		sum += color.mR + color.mG + color.mB;
+	}
+	return sum;
+}
+
+// Every scene light at a triangle point, one calculateTriangleLighting call per light
+double benchmarkTriangleLightsEach (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		Color color;
+		for (int j = 0; j < BENCHMARK_LIGHTS; j++) {
+			color += calculateTriangleLighting (gInputs.mMeshTriangles[index], lights[j], gInputs.mTrianglePoints[index]);
+		}
+		sum += color.mR + color.mG + color.mB;
+	}
+	return sum;
+}
+
+// The same with the interpolation done once and the lights shaded as a batch
+double benchmarkTriangleLightBatch (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		ShadingPoint point;
+		describeTriangleHit (gInputs.mMeshTriangles[index], gInputs.mTrianglePoints[index], point);
+		Color color;
+		shadeLightBatch (point, gInputs.mLit, BENCHMARK_LIGHTS, color);
+		sum += color.mR + color.mG + color.mB;
+	}
+	return sum;
+}
+
+// The batch with the scalar kernel, as --no-simd runs it
+double benchmarkTriangleLightBatchScalar (unsigned int iterations, RayDistribution distribution) {
+
+	bool avx2 = gLightBatchAVX2;
+	gLightBatchAVX2 = false;
+	double sum = benchmarkTriangleLightBatch (iterations, distribution);
+	gLightBatchAVX2 = avx2;
+	return sum;
+}
+
+double benchmarkCameraRay (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		Ray ray = calculateRayFromCamera (gInputs.mPixelX[index], gInputs.mPixelY[index]);
+		sum += ray.getDirection ().mZ;
+	}
+	return sum;
+}
+
+double benchmarkCameraRaysSSAA (unsigned int iterations, RayDistribution) {
+
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		Ray rays[SSAA_SAMPLES];
+		calculateRaysFromCamera (gInputs.mPixelX[index], gInputs.mPixelY[index], rays);
+		sum += rays[0].getDirection ().mZ + rays[SSAA_SAMPLES - 1].getDirection ().mZ;
+	}
+	return sum;
+}
+
+// One pixel of the sphere scene with the given kernel, lit by every light or only the first
+double benchmarkRender (unsigned int iterations, RenderKernel kernel, bool singleLight) {
+
+	if (singleLight) {
+		lights.resize (1);
+	}
+
+	RenderContext context;
+	double sum = 0;
+	for (unsigned int i = 0; i < iterations; i++) {
+		unsigned int index = i & (BENCHMARK_INPUTS - 1);
+		Color color;
+		kernel (&gInputs.mPixelX[index], &gInputs.mPixelY[index], 1, &color, context);
+		sum += color.mR + color.mG + color.mB;
+	}
+
+	lights.resize (BENCHMARK_LIGHTS);
+	return sum;
+}
+
+// renderPixels decides on every pixel what the specialized kernels settle at compile time
+double benchmarkRenderGeneric (unsigned int iterations, RayDistribution) {
+	return benchmarkRender (iterations, renderPixels, false);
+}
+
+double benchmarkRenderSpecialized (unsigned int iterations, RayDistribution) {
+	return benchmarkRender (iterations, renderPixelsSpecialized<false, GEOMETRY_SPHERES, false>, false);
+}
+
+double benchmarkRenderGenericOneLight (unsigned int iterations, RayDistribution) {
+	return benchmarkRender (iterations, renderPixels, true);
+}
+
+double benchmarkRenderSpecializedOneLight (unsigned int iterations, RayDistribution) {
+	return benchmarkRender (iterations, renderPixelsSpecialized<false, GEOMETRY_SPHERES, true>, true);
+}
+
+// SSAA, one light
+double benchmarkRenderGenericSSAA (unsigned int iterations, RayDistribution) {
+
+	gUseAA = true;
+	double sum = benchmarkRender (iterations, renderPixels, true);
+	gUseAA = false;
+	return sum;
+}
+
+double benchmarkRenderSpecializedSSAA (unsigned int iterations, RayDistribution) {
+	return benchmarkRender (iterations, renderPixelsSpecialized<true, GEOMETRY_SPHERES, true>, true);
+}
+
+struct Benchmark {
+	const char* mName;
+	BenchmarkKernel mKernel;
+	RayDistribution mDistribution;
+
+	// Rays handled by one operation; 0 for the shading kernels, which don't trace
+	unsigned int mRaysPerOp;
+};
+
+const Benchmark BENCHMARKS[] = {
+	{ "sphere/intersect/hit", benchmarkSphereIntersection, RAYS_HIT, 1 },
+	{ "sphere/intersect/miss", benchmarkSphereIntersection, RAYS_MISS, 1 },
+	{ "sphere/intersect/mixed", benchmarkSphereIntersection, RAYS_MIXED, 1 },
+	{ "sphere/occluded/mixed", benchmarkSphereOcclusion, RAYS_MIXED, 1 },
+	{ "triangle/intersect/hit", benchmarkTriangleIntersection, RAYS_HIT, 1 },
+	{ "triangle/intersect/miss", benchmarkTriangleIntersection, RAYS_MISS, 1 },
+	{ "triangle/intersect/mixed", benchmarkTriangleIntersection, RAYS_MIXED, 1 },
+	{ "record/intersect/hit", benchmarkRecordIntersection, RAYS_HIT, 1 },
+	{ "record/intersect/miss", benchmarkRecordIntersection, RAYS_MISS, 1 },
+	{ "record/intersect/mixed", benchmarkRecordIntersection, RAYS_MIXED, 1 },
+	{ "record/occluded/mixed", benchmarkRecordOcclusion, RAYS_MIXED, 1 },
+	{ "shade/light-magnitude", benchmarkLightMagnitude, RAYS_HIT, 0 },
+	{ "shade/reflection-magnitude", benchmarkReflectionMagnitude, RAYS_HIT, 0 },
+	{ "shade/sphere-lighting", benchmarkSphereLighting, RAYS_HIT, 0 },
+	{ "shade/triangle-lighting", benchmarkTriangleLighting, RAYS_HIT, 0 },
+	{ "shade/8-lights/each", benchmarkTriangleLightsEach, RAYS_HIT, 0 },
+	{ "shade/8-lights/batch-scalar", benchmarkTriangleLightBatchScalar, RAYS_HIT, 0 },
+	{ "shade/8-lights/batch", benchmarkTriangleLightBatch, RAYS_HIT, 0 },
+	{ "camera/ray", benchmarkCameraRay, RAYS_HIT, 1 },
+	{ "camera/ssaa-rays", benchmarkCameraRaysSSAA, RAYS_HIT, SSAA_SAMPLES },
+	{ "render/8-lights/generic", benchmarkRenderGeneric, RAYS_HIT, 1 },
+	{ "render/8-lights/specialized", benchmarkRenderSpecialized, RAYS_HIT, 1 },
+	{ "render/1-light/generic", benchmarkRenderGenericOneLight, RAYS_HIT, 1 },
+	{ "render/1-light/specialized", benchmarkRenderSpecializedOneLight, RAYS_HIT, 1 },
+	{ "render/ssaa/generic", benchmarkRenderGenericSSAA, RAYS_HIT, SSAA_SAMPLES },
+	{ "render/ssaa/specialized", benchmarkRenderSpecializedSSAA, RAYS_HIT, SSAA_SAMPLES }
+};
+
+/*************************************************************/
+// Measurement
+/*************************************************************/
+unsigned int gRepetitions = 15;
+double gMinTime = 20.0;		// Milliseconds per repetition
+const char* gFilter = NULL;
+bool gCSV = false;
+
+double timeKernel (const Benchmark& benchmark, unsigned int iterations) {
+
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now ();
+	gBenchmarkSink = gBenchmarkSink + benchmark.mKernel (iterations, benchmark.mDistribution);
+	return std::chrono::duration<double, std::milli> (std::chrono::high_resolution_clock::now () - start).count ();
+}
+
+// Run a benchmark gRepetitions times and print the spread of ns/op. The iteration count is doubled until one repetition
+// takes gMinTime, which also warms up the caches and branch predictors.
+void runBenchmark (const Benchmark& benchmark) {
+
+	unsigned int iterations = BENCHMARK_INPUTS;
+	while (timeKernel (benchmark, iterations) < gMinTime && iterations < (1u << 30)) {
+		iterations *= 2;
+	}
+
+	std::vector<double> samples;
+	for (unsigned int i = 0; i < gRepetitions; i++) {
+		samples.push_back (timeKernel (benchmark, iterations) * 1e6 / iterations);
+	}
+	std::sort (samples.begin (), samples.end ());
+
+	double mean = 0;
+	for (size_t i = 0; i < samples.size (); i++) {
+		mean += samples[i];
+	}
+	mean /= samples.size ();
+	double variance = 0;
+	for (size_t i = 0; i < samples.size (); i++) {
+		variance += (samples[i] - mean) * (samples[i] - mean);
+	}
+	double deviation = std::sqrt (variance / samples.size ());
+	double median = samples[samples.size () / 2];
+	double raysPerSecond = benchmark.mRaysPerOp * 1e9 / median;
+
+	if (gCSV) {
+		printf ("%s,%u,%u,%.3f,%.3f,%.3f,%.3f,%.0f\n", benchmark.mName, iterations, gRepetitions, median, samples[0], mean, deviation,
+			raysPerSecond);
+	}
+
+	else if (benchmark.mRaysPerOp > 0) {
+		printf ("%-28s %10.2f %10.2f %9.1f%% %12.2f\n", benchmark.mName, median, samples[0], 100.0 * deviation / mean, raysPerSecond / 1e6);
+	}
+
+	else {
+		printf ("%-28s %10.2f %10.2f %9.1f%% %12s\n", benchmark.mName, median, samples[0], 100.0 * deviation / mean, "-");
+	}
+}
+
+int main (int argc, char** argv) {
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--repetitions") == 0 && i + 1 < argc) {
+			gRepetitions = std::max (1, atoi (argv[++i]));
+		}
+		else if (strcmp (argv[i], "--min-time") == 0 && i + 1 < argc) {
+			gMinTime = atof (argv[++i]);
+		}
+		else if (strcmp (argv[i], "--filter") == 0 && i + 1 < argc) {
+			gFilter = argv[++i];
+		}
+		else if (strcmp (argv[i], "--csv") == 0) {
+			gCSV = true;
+		}
+		else {
+			printf ("Usage: %s [--repetitions N] [--min-time ms] [--filter text] [--csv]\n", argv[0]);
+			exit(0);
+		}
+	}
+
+	generateInputs ();
+	selectSIMDKernels ();
+
+	if (gCSV) {
+		printf ("kernel,iterations,repetitions,median_ns,min_ns,mean_ns,stddev_ns,rays_per_sec\n");
+	}
+
+	else {
+		printf ("%u repetitions of at least %.0f ms each, over %u inputs\n", gRepetitions, gMinTime, BENCHMARK_INPUTS);
+		const char* names[] = { "hit", "miss", "mixed" };
+		for (int i = RAYS_HIT; i <= RAYS_MIXED; i++) {
+			double sphereRate, triangleRate, sphereOccluded, triangleOccluded;
+			measureHitRates ((RayDistribution)i, sphereRate, triangleRate, sphereOccluded, triangleOccluded);
+			printf ("%-5s rays: %.1f%% of sphere rays and %.1f%% of triangle rays hit, %.1f%% and %.1f%% are occluded\n", names[i],
+				sphereRate, triangleRate, sphereOccluded, triangleOccluded);
+			if (sphereOccluded != sphereRate || triangleOccluded != triangleRate) {
+				printf ("Warning: the occlusion kernels disagree with the intersection kernels\n");
+			}
+		}
+		printf ("\n");
+		printf ("%-28s %10s %10s %10s %12s\n", "kernel", "median ns", "min ns", "stddev", "Mrays/s");
+	}
+
+	for (size_t i = 0; i < sizeof (BENCHMARKS) / sizeof (BENCHMARKS[0]); i++) {
+		if (gFilter == NULL || strstr (BENCHMARKS[i].mName, gFilter) != NULL) {
+			runBenchmark (BENCHMARKS[i]);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,186 @@
+/* **************************
+ * CSCI 420
+ * Assignment 3 Raytracer -- render server client
+ * *************************
+*/
+
+// Built by make client. Sends one request to a render server started with hw3-headless --serve and prints the answer.
+// The server writes the image itself, unless --raw asks for the pixels, which are then saved here as a binary PPM.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "hw3_protocol.h"
+
+/*************************************************************/
+// Options
+/*************************************************************/
+const char* gSocket = NULL;
+const char* gScene = NULL;
+const char* gOutput = NULL;
+unsigned int gWidth = 640;
+unsigned int gHeight = 480;
+unsigned int gSSAA = 0;
+unsigned int gAdaptive = 0;
+bool gRaw = false;
+uint32_t gCommand = FRAME_RENDER;
+
+void usage (const char* program) {
+	printf ("Usage: %s <socket> <scene> <output> [ssaa] [--adaptive 4|8|16] [--size WxH] [--raw]\n"
+		"       %s <socket> --list | --stop\n"
+		"A scene is named by its path as given to the server, its file name, or its position (0, 1, ...).\n", program, program);
+	exit(0);
+}
+
+double now () {
+	struct timeval time;
+	gettimeofday (&time, NULL);
+	return time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+}
+
+/*************************************************************/
+// Requests
+/*************************************************************/
+// The server may run in another directory, so the output path is sent as an absolute one
+std::string absolutePath (const char* path) {
+
+	if (path[0] == '/') {
+		return path;
+	}
+
+	char directory[4096];
+	if (getcwd (directory, sizeof (directory)) == NULL) {
+		return path;
+	}
+	return std::string (directory) + "/" + path;
+}
+
+// Pixels of a FRAME_IMAGE reply, top row first, as a binary PPM
+bool writePPM (const char* path, const std::vector<char>& payload) {
+
+	RenderImageHeader header;
+	if (payload.size () < sizeof (header)) {
+		return false;
+	}
+	memcpy (&header, &payload[0], sizeof (header));
+	size_t bytes = (size_t)header.mWidth * header.mHeight * 3;
+	if (payload.size () != sizeof (header) + bytes) {
+		return false;
+	}
+
+	FILE* file = fopen (path, "wb");
+	if (file == NULL) {
+		return false;
+	}
+	fprintf (file, "P6 %u %u 255\n", header.mWidth, header.mHeight);
+	bool ok = fwrite (&payload[sizeof (header)], 1, bytes, file) == bytes;
+	return (fclose (file) == 0) && ok;
+}
+
+int main (int argc, char** argv) {
+
+	std::vector<char*> args;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--size") == 0 && i + 1 < argc) {
+			if (sscanf (argv[++i], "%ux%u", &gWidth, &gHeight) != 2 || gWidth == 0 || gHeight == 0) {
+				printf ("--size takes the image size as WIDTHxHEIGHT\n");
+				exit(0);
+			}
+		}
+		else if (strcmp (argv[i], "--adaptive") == 0 && i + 1 < argc) {
+			gAdaptive = atoi (argv[++i]);
+		}
+		else if (strcmp (argv[i], "--raw") == 0) {
+			gRaw = true;
+		}
+		else if (strcmp (argv[i], "--list") == 0) {
+			gCommand = FRAME_LIST;
+		}
+		else if (strcmp (argv[i], "--stop") == 0) {
+			gCommand = FRAME_STOP;
+		}
+		else if (strcmp (argv[i], "ssaa") == 0) {
+			gSSAA = 1;
+		}
+		else if (argv[i][0] == '-') {
+			usage (argv[0]);
+		}
+		else {
+			args.push_back (argv[i]);
+		}
+	}
+
+	if (args.size () != ((gCommand == FRAME_RENDER) ? 3u : 1u)) {
+		usage (argv[0]);
+	}
+	gSocket = args[0];
+	if (gCommand == FRAME_RENDER) {
+		gScene = args[1];
+		gOutput = args[2];
+	}
+
+	int connection = socket (AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address;
+	if (!unixSocketAddress (gSocket, address)) {
+		printf ("The socket path %s is too long\n", gSocket);
+		return 1;
+	}
+	if (connection < 0 || connect (connection, (sockaddr*)&address, sizeof (address)) != 0) {
+		printf ("Unable to connect to %s: %s\n", gSocket, strerror (errno));
+		return 1;
+	}
+	signal (SIGPIPE, SIG_IGN);
+
+	double start = now ();
+	bool sent;
+	if (gCommand == FRAME_RENDER) {
+		std::string output = gRaw ? std::string () : absolutePath (gOutput);
+		RenderRequest request = { gWidth, gHeight, gSSAA, gAdaptive, (uint32_t)strlen (gScene), (uint32_t)output.size () };
+		std::vector<char> payload (sizeof (request));
+		memcpy (&payload[0], &request, sizeof (request));
+		payload.insert (payload.end (), gScene, gScene + request.mSceneLength);
+		payload.insert (payload.end (), output.begin (), output.end ());
+		sent = sendFrame (connection, FRAME_RENDER, &payload[0], payload.size ());
+	}
+
+	else {
+		sent = sendFrame (connection, gCommand, NULL, 0);
+	}
+
+	uint32_t type;
+	std::vector<char> reply;
+	if (!sent || !receiveFrame (connection, type, reply)) {
+		printf ("The server closed the connection\n");
+		return 1;
+	}
+	close (connection);
+
+	double elapsed = now () - start;
+	std::string text (reply.begin (), reply.end ());
+	if (type == FRAME_IMAGE) {
+		if (!writePPM (gOutput, reply)) {
+			printf ("Unable to write %s\n", gOutput);
+			return 1;
+		}
+		printf ("Received %lu bytes of pixels and saved %s (%.3f ms round trip)\n", (unsigned long)reply.size (), gOutput, elapsed);
+	}
+
+	else if (type == FRAME_DONE) {
+		printf ("%s", text.c_str ());
+		if (gCommand == FRAME_RENDER) {
+			printf (" (%.3f ms round trip)\n", elapsed);
+		}
+		else if (!text.empty () && text[text.size () - 1] != '\n') {
+			printf ("\n");
+		}
+	}
+
+	else {
+		printf ("Server error: %s\n", text.c_str ());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,177 @@
+/* **************************
+ * CSCI 420
+ * Assignment 3 Raytracer -- render server and distributed rendering protocol
+ * *************************
+*/
+
+// Shared by the render server (hw3-headless --serve), hw3-client, and the coordinator and workers of distributed rendering
+// (--distribute, --worker). Every message is a frame: a RenderFrameHeader, then mLength bytes of payload. Fields are in
+// host byte order. Distributed rendering can span machines, which then have to share a byte order; the magic number of
+// the first frame tells when they don't.
+
+#ifndef HW3_PROTOCOL_H
+#define HW3_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+const uint32_t RENDER_PROTOCOL_MAGIC = 0x33574852;
+
+// Largest payload either end accepts: a 16384x16384 image and its header
+const uint32_t RENDER_MAX_PAYLOAD = 16384u * 16384u * 3u + 64u;
+
+enum RenderFrameType {
+	// Client to server
+	FRAME_RENDER = 1,	// RenderRequest, then the scene id and the output path, without terminators
+	FRAME_LIST = 2,		// No payload; answered with FRAME_DONE listing the resident scenes
+	FRAME_STOP = 3,		// No payload; the server finishes the frame in progress, answers FRAME_DONE and exits
+
+	// Server to client
+	FRAME_DONE = 16,	// Text for the user
+	FRAME_IMAGE = 17,	// RenderImageHeader, then the pixels as RGB, top row first
+	FRAME_ERROR = 18,	// Text for the user; also sent to a worker that is turned away
+
+	// Distributed rendering
+	FRAME_WORKER_HELLO = 32,	// Worker to coordinator: WorkerHello
+	FRAME_ASSIGN = 33,			// Coordinator to worker: BandHeader of the rows to render
+	FRAME_BAND = 34,			// Worker to coordinator: BandHeader, then the rows as RGB, bottom row first
+	FRAME_FINISHED = 35			// Coordinator to worker: no payload; every band is done
+};
+
+struct RenderFrameHeader {
+	uint32_t mMagic;
+	uint32_t mType;
+	uint32_t mLength;
+};
+
+// A scene id is the scene's path as given to the server, its file name, or its position on the server's command line.
+// An empty output path asks for the pixels in the reply instead of a file written by the server.
+struct RenderRequest {
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mSSAA;			// 1 for the fixed 4x SSAA
+	uint32_t mAdaptive;		// 0, or 4, 8 or 16 adaptive samples
+	uint32_t mSceneLength;
+	uint32_t mOutputLength;
+};
+
+struct RenderImageHeader {
+	uint32_t mWidth;
+	uint32_t mHeight;
+};
+
+// Everything that decides the pixels of a distributed render. A worker's must match the coordinator's exactly, so every
+// band comes out as the coordinator would have rendered it. Zeroed before it is filled in, so it compares with memcmp.
+struct DistributedSettings {
+	double mEye[3];
+	double mLookAt[3];
+	double mUp[3];
+	double mFov;
+	double mAdaptiveThreshold;
+	double mLightCull;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mSSAA;
+	uint32_t mAdaptive;		// 0, or 4, 8 or 16 adaptive samples
+	uint32_t mPattern;
+	uint32_t mLightCut;
+	uint32_t mLightSamples;
+	uint32_t mRealSize;		// sizeof (Real): 4 for the float build, 8 otherwise
+	char mScene[256];		// The scene's file name, without its directory
+};
+
+struct WorkerHello {
+	DistributedSettings mSettings;
+	uint32_t mPid;
+	char mHost[64];
+};
+
+// Rows [mY0, mY1) of the image, band mBand of the coordinator's list
+struct BandHeader {
+	uint32_t mBand;
+	uint32_t mY0;
+	uint32_t mY1;
+};
+
+// Write or read exactly size bytes. Both give up on an error or a closed connection.
+inline bool sendAll (int fd, const void* data, size_t size) {
+
+	const char* bytes = (const char*)data;
+	while (size > 0) {
+		ssize_t sent = send (fd, bytes, size, 0);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return false;
+		}
+		bytes += sent;
+		size -= (size_t)sent;
+	}
+	return true;
+}
+
+inline bool receiveAll (int fd, void* data, size_t size) {
+
+	char* bytes = (char*)data;
+	while (size > 0) {
+		ssize_t received = recv (fd, bytes, size, 0);
+		if (received < 0 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		bytes += received;
+		size -= (size_t)received;
+	}
+	return true;
+}
+
+// Send a frame whose payload is the concatenation of two buffers, so a header and bulk data need no extra copy
+inline bool sendFrame (int fd, uint32_t type, const void* first, size_t firstSize, const void* second = NULL, size_t secondSize = 0) {
+
+	RenderFrameHeader header = { RENDER_PROTOCOL_MAGIC, type, (uint32_t)(firstSize + secondSize) };
+	return sendAll (fd, &header, sizeof (header)) && sendAll (fd, first, firstSize) && sendAll (fd, second, secondSize);
+}
+
+inline bool sendText (int fd, uint32_t type, const std::string& text) {
+	return sendFrame (fd, type, text.data (), text.size ());
+}
+
+// Receive one frame. Fails on a closed connection, a bad magic number or a payload over maxLength, which is checked before
+// anything is allocated, so a peer can't make the receiver reserve more than the frame it expects.
+inline bool receiveFrame (int fd, uint32_t& type, std::vector<char>& payload, uint32_t maxLength = RENDER_MAX_PAYLOAD) {
+
+	RenderFrameHeader header;
+	if (!receiveAll (fd, &header, sizeof (header)) || header.mMagic != RENDER_PROTOCOL_MAGIC || header.mLength > maxLength
+		|| header.mLength > RENDER_MAX_PAYLOAD) {
+		return false;
+	}
+
+	type = header.mType;
+	payload.resize (header.mLength);
+	return header.mLength == 0 || receiveAll (fd, &payload[0], header.mLength);
+}
+
+// Fill in the address of a Unix-domain socket. Fails if the path is too long for sockaddr_un.
+inline bool unixSocketAddress (const char* path, sockaddr_un& address) {
+
+	memset (&address, 0, sizeof (address));
+	address.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (address.sun_path)) {
+		return false;
+	}
+	strcpy (address.sun_path, path);
+	return true;
+}
+
+#endif
@@ -0,0 +1,434 @@
+/* **************************
+ * CSCI 420
+ * Assignment 3 Raytracer -- scene scaling benchmark
+ * *************************
+*/
+
+// Built by make scaling. Renders every bundled scene, then generated scenes of growing triangle, sphere and light
+// counts, each with the headless renderer in a child process, and reports one row per render as CSV or JSON. The
+// renderer's own log supplies the load, BVH build and render times and the ray counts; the peak RSS of the child comes
+// from the operating system.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+/*************************************************************/
+// Options
+/*************************************************************/
+const char* gRenderer = "./hw3-headless";
+const char* gBundledDir = ".";
+const char* gSceneDir = "scaling-scenes";
+bool gJSON = false;
+bool gRunBundled = true;
+bool gRunGenerated = true;
+unsigned int gMaxTriangles = 1000000;
+
+// Arguments passed through to every render, e.g. --threads or --size
+std::vector<const char*> gRenderArgs;
+
+// The sweeps. The light sweep stops at 100, the old fixed MAX_LIGHTS.
+const unsigned int TRIANGLE_COUNTS[] = { 1000, 10000, 100000, 1000000 };
+const unsigned int SPHERE_COUNTS[] = { 10, 100, 1000, 10000, 100000 };
+const unsigned int LIGHT_COUNTS[] = { 1, 2, 4, 8, 16, 32, 64, 100 };
+
+// Scene the light sweep adds its lights to
+const unsigned int LIGHT_SWEEP_TRIANGLES = 10000;
+const unsigned int LIGHT_SWEEP_SPHERES = 16;
+
+/*************************************************************/
+// Scene Generator
+/*************************************************************/
+// Generated scenes use the text format and are only written if they don't exist yet, so they are shared between runs
+// and builds. The output is fully determined by the counts.
+
+void writeLight (FILE* file, double x, double y, double z, double intensity) {
+	fprintf (file, "light\npos: %.6g %.6g %.6g\ncol: %.6g %.6g %.6g\n", x, y, z, intensity, intensity, intensity);
+}
+
+void writeSphere (FILE* file, double x, double y, double z, double radius, double r, double g, double b) {
+	fprintf (file, "sphere\npos: %.6g %.6g %.6g\nrad: %.6g\ndif: %.6g %.6g %.6g\nspe: 0.3 0.3 0.3\nshi: 20\n", x, y, z, radius, r, g, b);
+}
+
+// Height of the terrain below the camera at (x, z), and its normal
+double terrainHeight (double x, double z) {
+	return -2.0 + 0.4 * sin (x * 1.7) * cos (z * 1.3);
+}
+
+void terrainNormal (double x, double z, double normal[3]) {
+	double dx = 0.4 * 1.7 * cos (x * 1.7) * cos (z * 1.3);
+	double dz = -0.4 * 1.3 * sin (x * 1.7) * sin (z * 1.3);
+	double length = sqrt (dx * dx + 1 + dz * dz);
+	normal[0] = -dx / length;
+	normal[1] = 1 / length;
+	normal[2] = -dz / length;
+}
+
+void writeTerrainVertex (FILE* file, double x, double z, int material) {
+	double normal[3];
+	terrainNormal (x, z, normal);
+	const char* diffuse = (material == 0) ? "0.2 0.5 0.2" : "0.5 0.45 0.3";
+	fprintf (file, "pos: %.6g %.6g %.6g\nnor: %.6g %.6g %.6g\ndif: %s\nspe: 0.1 0.1 0.1\nshi: 5\n", x, terrainHeight (x, z), z,
+		normal[0], normal[1], normal[2], diffuse);
+}
+
+// Smooth-shaded rolling terrain filling the lower half of the view, as a grid of quads split into two triangles. The
+// grid is twice as wide as it is deep, with about count triangles in all.
+unsigned int countTerrainTriangles (unsigned int count) {
+	unsigned int columns = std::max (1u, (unsigned int)sqrt (count));
+	unsigned int rows = std::max (1u, count / (2 * columns));
+	return 2 * rows * columns;
+}
+
+void writeTerrain (FILE* file, unsigned int count) {
+
+	unsigned int columns = std::max (1u, (unsigned int)sqrt (count));
+	unsigned int rows = std::max (1u, count / (2 * columns));
+	double x0 = -12, x1 = 12;
+	double z0 = -3, z1 = -25;
+	for (unsigned int j = 0; j < rows; j++) {
+		for (unsigned int i = 0; i < columns; i++) {
+			double xa = x0 + (x1 - x0) * i / columns;
+			double xb = x0 + (x1 - x0) * (i + 1) / columns;
+			double za = z0 + (z1 - z0) * j / rows;
+			double zb = z0 + (z1 - z0) * (j + 1) / rows;
+			int material = (i / 8 + j / 8) % 2;
+
+			// Counter-clockwise seen from above
+			fprintf (file, "triangle\n");
+			writeTerrainVertex (file, xa, za, material);
+			writeTerrainVertex (file, xb, za, material);
+			writeTerrainVertex (file, xb, zb, material);
+			fprintf (file, "triangle\n");
+			writeTerrainVertex (file, xa, za, material);
+			writeTerrainVertex (file, xb, zb, material);
+			writeTerrainVertex (file, xa, zb, material);
+		}
+	}
+}
+
+// A block of count spheres in front of the camera, on a regular grid with a small gap between neighbours
+void writeSphereGrid (FILE* file, unsigned int count) {
+
+	unsigned int side = (unsigned int)ceil (cbrt ((double)count));
+	double spacing = 6.0 / side;
+	unsigned int written = 0;
+	for (unsigned int k = 0; k < side && written < count; k++) {
+		for (unsigned int j = 0; j < side && written < count; j++) {
+			for (unsigned int i = 0; i < side && written < count; i++) {
+				double x = -3 + spacing * (i + 0.5);
+				double y = -2 + spacing * 0.66 * (j + 0.5);
+				double z = -7 - spacing * (k + 0.5);
+				writeSphere (file, x, y, z, spacing * 0.3, (double)i / side, (double)j / side, (double)k / side);
+				written++;
+			}
+		}
+	}
+}
+
+// count lights spread over a ring above and behind the camera. The total intensity stays the same however many there are.
+void writeLightRing (FILE* file, unsigned int count) {
+
+	for (unsigned int i = 0; i < count; i++) {
+		double angle = 2 * M_PI * i / count;
+		writeLight (file, 6 * cos (angle), 6 + sin (angle * 3), 2 + 6 * sin (angle), 1.0 / count);
+	}
+}
+
+// Generate a scene with the given object counts, unless it exists already. Returns false if it can't be written.
+bool generateScene (const std::string& path, unsigned int triangles, unsigned int spheres, unsigned int lights) {
+
+	struct stat info;
+	if (stat (path.c_str (), &info) == 0) {
+		return true;
+	}
+
+	// Write to a temporary name first, so an interrupted run never leaves a truncated scene behind
+	std::string temporary = path + ".tmp";
+	FILE* file = fopen (temporary.c_str (), "w");
+	if (file == NULL) {
+		return false;
+	}
+
+	unsigned int objects = ((triangles > 0) ? countTerrainTriangles (triangles) : 0) + spheres + lights;
+	fprintf (file, "%u\namb: 0.1 0.1 0.1\n", objects);
+	writeLightRing (file, lights);
+	writeSphereGrid (file, spheres);
+	if (triangles > 0) {
+		writeTerrain (file, triangles);
+	}
+
+	bool ok = (ferror (file) == 0);
+	ok = (fclose (file) == 0) && ok;
+	return ok && rename (temporary.c_str (), path.c_str ()) == 0;
+}
+
+/*************************************************************/
+// Running the Renderer
+/*************************************************************/
+// One row of the report
+struct Result {
+	std::string mGroup;
+	std::string mScene;
+	bool mOK;
+	int mTriangles;
+	int mSpheres;
+	int mLights;
+	double mLoadTime;
+	double mPreprocessTime;
+	double mRenderTime;
+	unsigned int mThreads;
+	unsigned long long mPrimaryRays;
+	unsigned long long mShadowRays;
+	long mPeakRSS;		// KB
+
+	Result () : mOK (false), mTriangles (0), mSpheres (0), mLights (0), mLoadTime (0), mPreprocessTime (0), mRenderTime (0),
+		mThreads (0), mPrimaryRays (0), mShadowRays (0), mPeakRSS (0) {}
+
+	double raysPerSecond () const { return (mRenderTime > 0) ? (mPrimaryRays + mShadowRays) * 1000.0 / mRenderTime : 0; }
+};
+
+// Pick the numbers out of the renderer's log
+void parseLog (const std::string& log, Result& result) {
+
+	size_t start = 0;
+	while (start < log.size ()) {
+		size_t end = log.find ('\n', start);
+		if (end == std::string::npos) {
+			end = log.size ();
+		}
+		std::string line = log.substr (start, end - start);
+		start = end + 1;
+
+		const char* text = line.c_str ();
+		const char* counts = strstr (text, "): ");
+		if (strncmp (text, "Loaded ", 7) == 0 && counts != NULL) {
+			sscanf (counts + 3, "%d triangles (%*d vertices, %*d materials), %d spheres, %d lights", &result.mTriangles,
+				&result.mSpheres, &result.mLights);
+			const char* time = strrchr (text, ')');
+			sscanf (time, ") in %lf ms", &result.mLoadTime);
+		}
+
+		else if (strncmp (text, "BVH: ", 5) == 0 && strstr (text, "built in ") != NULL) {
+			sscanf (strstr (text, "built in ") + 9, "%lf", &result.mPreprocessTime);
+		}
+
+		else if (strncmp (text, "BVH: ", 5) == 0 && strstr (text, "primary rays") != NULL) {
+			sscanf (text + 5, "%llu", &result.mPrimaryRays);
+		}
+
+		else if (strncmp (text, "BVH: ", 5) == 0 && strstr (text, "shadow rays") != NULL) {
+			sscanf (text + 5, "%llu", &result.mShadowRays);
+		}
+
+		else if (strncmp (text, "Rendered ", 9) == 0) {
+			sscanf (text, "Rendered %*ux%*u in %lf ms on %u", &result.mRenderTime, &result.mThreads);
+		}
+
+		else if (strncmp (text, "File saved Successfully", 23) == 0) {
+			result.mOK = true;
+		}
+	}
+}
+
+// Render a scene in a child process and collect its log and peak RSS
+Result render (const std::string& group, const std::string& scene) {
+
+	Result result;
+	result.mGroup = group;
+	result.mScene = scene;
+
+	std::string output = std::string (gSceneDir) + "/render.jpg";
+	std::vector<char*> argv;
+	argv.push_back ((char*)gRenderer);
+	argv.push_back ((char*)scene.c_str ());
+	argv.push_back ((char*)output.c_str ());
+	for (size_t i = 0; i < gRenderArgs.size (); i++) {
+		argv.push_back ((char*)gRenderArgs[i]);
+	}
+	argv.push_back (NULL);
+
+	int pipes[2];
+	if (pipe (pipes) != 0) {
+		return result;
+	}
+
+	pid_t child = fork ();
+	if (child == 0) {
+		dup2 (pipes[1], STDOUT_FILENO);
+		close (pipes[0]);
+		close (pipes[1]);
+		execv (gRenderer, &argv[0]);
+		_exit (127);
+	}
+	close (pipes[1]);
+
+	std::string log;
+	char chunk[4096];
+	ssize_t bytes;
+	while ((bytes = read (pipes[0], chunk, sizeof (chunk))) > 0) {
+		log.append (chunk, bytes);
+	}
+	close (pipes[0]);
+
+	int status = 0;
+	struct rusage usage;
+	if (child < 0 || wait4 (child, &status, 0, &usage) != child) {
+		return result;
+	}
+
+	parseLog (log, result);
+	result.mOK = result.mOK && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+	result.mPeakRSS = usage.ru_maxrss;
+	return result;
+}
+
+/*************************************************************/
+// Report
+/*************************************************************/
+void printHeader () {
+
+	if (gJSON) {
+		printf ("[\n");
+	}
+
+	else {
+		printf ("group,scene,ok,triangles,spheres,lights,load_ms,preprocess_ms,render_ms,threads,primary_rays,shadow_rays,"
+			"rays_per_sec,peak_rss_kb\n");
+	}
+}
+
+void printResult (const Result& result, bool first) {
+
+	if (gJSON) {
+		printf ("%s  {\"group\": \"%s\", \"scene\": \"%s\", \"ok\": %s, \"triangles\": %d, \"spheres\": %d, \"lights\": %d, "
+			"\"load_ms\": %.3f, \"preprocess_ms\": %.3f, \"render_ms\": %.3f, \"threads\": %u, \"primary_rays\": %llu, "
+			"\"shadow_rays\": %llu, \"rays_per_sec\": %.0f, \"peak_rss_kb\": %ld}", first ? "" : ",\n", result.mGroup.c_str (),
+			result.mScene.c_str (), result.mOK ? "true" : "false", result.mTriangles, result.mSpheres, result.mLights,
+			result.mLoadTime, result.mPreprocessTime, result.mRenderTime, result.mThreads, result.mPrimaryRays,
+			result.mShadowRays, result.raysPerSecond (), result.mPeakRSS);
+	}
+
+	else {
+		printf ("%s,%s,%d,%d,%d,%d,%.3f,%.3f,%.3f,%u,%llu,%llu,%.0f,%ld\n", result.mGroup.c_str (), result.mScene.c_str (),
+			result.mOK ? 1 : 0, result.mTriangles, result.mSpheres, result.mLights, result.mLoadTime, result.mPreprocessTime,
+			result.mRenderTime, result.mThreads, result.mPrimaryRays, result.mShadowRays, result.raysPerSecond (),
+			result.mPeakRSS);
+	}
+	fflush (stdout);
+}
+
+void printFooter () {
+	if (gJSON) {
+		printf ("\n]\n");
+	}
+}
+
+// Generate (if needed) and render one scene of a sweep
+void runGenerated (const char* group, unsigned int triangles, unsigned int spheres, unsigned int lights, bool& first) {
+
+	char name[64];
+	snprintf (name, sizeof (name), "%s_t%u_s%u_l%u.scene", group, triangles, spheres, lights);
+	std::string path = std::string (gSceneDir) + "/" + name;
+
+	fprintf (stderr, "Rendering %s\n", path.c_str ());
+	if (!generateScene (path, triangles, spheres, lights)) {
+		fprintf (stderr, "Could not write %s\n", path.c_str ());
+		return;
+	}
+	printResult (render (group, path), first);
+	first = false;
+}
+
+int main (int argc, char** argv) {
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "--renderer") == 0 && i + 1 < argc) {
+			gRenderer = argv[++i];
+		}
+		else if (strcmp (argv[i], "--bundled-dir") == 0 && i + 1 < argc) {
+			gBundledDir = argv[++i];
+		}
+		else if (strcmp (argv[i], "--scene-dir") == 0 && i + 1 < argc) {
+			gSceneDir = argv[++i];
+		}
+		else if (strcmp (argv[i], "--max-triangles") == 0 && i + 1 < argc) {
+			gMaxTriangles = strtoul (argv[++i], NULL, 10);
+		}
+		else if (strcmp (argv[i], "--bundled-only") == 0) {
+			gRunGenerated = false;
+		}
+		else if (strcmp (argv[i], "--generated-only") == 0) {
+			gRunBundled = false;
+		}
+		else if (strcmp (argv[i], "--json") == 0) {
+			gJSON = true;
+		}
+		else if (strcmp (argv[i], "--") == 0) {
+			gRenderArgs.assign (argv + i + 1, argv + argc);
+			break;
+		}
+		else {
+			printf ("Usage: %s [--renderer path] [--bundled-dir dir] [--scene-dir dir] [--max-triangles N]\n"
+				"       [--bundled-only | --generated-only] [--json] [-- renderer options]\n", argv[0]);
+			exit(0);
+		}
+	}
+
+	mkdir (gSceneDir, 0755);
+	printHeader ();
+	bool first = true;
+
+	if (gRunBundled) {
+		std::vector<std::string> scenes;
+		DIR* directory = opendir (gBundledDir);
+		struct dirent* entry;
+		while (directory != NULL && (entry = readdir (directory)) != NULL) {
+			size_t length = strlen (entry->d_name);
+			if (length > 6 && strcmp (entry->d_name + length - 6, ".scene") == 0) {
+				scenes.push_back (std::string (gBundledDir) + "/" + entry->d_name);
+			}
+		}
+		if (directory != NULL) {
+			closedir (directory);
+		}
+		std::sort (scenes.begin (), scenes.end ());
+
+		for (size_t i = 0; i < scenes.size (); i++) {
+			fprintf (stderr, "Rendering %s\n", scenes[i].c_str ());
+			printResult (render ("bundled", scenes[i]), first);
+			first = false;
+		}
+	}
+
+	if (gRunGenerated) {
+		for (size_t i = 0; i < sizeof (TRIANGLE_COUNTS) / sizeof (TRIANGLE_COUNTS[0]); i++) {
+			if (TRIANGLE_COUNTS[i] <= gMaxTriangles) {
+				runGenerated ("triangles", TRIANGLE_COUNTS[i], 0, 2, first);
+			}
+		}
+
+		for (size_t i = 0; i < sizeof (SPHERE_COUNTS) / sizeof (SPHERE_COUNTS[0]); i++) {
+			runGenerated ("spheres", 0, SPHERE_COUNTS[i], 2, first);
+		}
+
+		for (size_t i = 0; i < sizeof (LIGHT_COUNTS) / sizeof (LIGHT_COUNTS[0]); i++) {
+			runGenerated ("lights", std::min (LIGHT_SWEEP_TRIANGLES, gMaxTriangles), LIGHT_SWEEP_SPHERES, LIGHT_COUNTS[i], first);
+		}
+	}
+
+	printFooter ();
+	return 0;
+}